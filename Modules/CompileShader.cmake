@@ -4,14 +4,23 @@ if(NOT GlslangValidator)
 endif()
 
 function(compile_shader)
-   set(OneValueArgs SOURCE TARGET)
-   cmake_parse_arguments(COMPILE_SHADER "" "${OneValueArgs}" "" ${ARGN})
+   set(OneValueArgs SOURCE TARGET TARGET_ENV)
+   set(MultiValueArgs DEFINES DEPENDS)
+   cmake_parse_arguments(COMPILE_SHADER "" "${OneValueArgs}" "${MultiValueArgs}" ${ARGN})
+
+   set(ExtraArgs)
+   foreach(Define ${COMPILE_SHADER_DEFINES})
+      list(APPEND ExtraArgs -D${Define})
+   endforeach()
+   if(COMPILE_SHADER_TARGET_ENV)
+      list(APPEND ExtraArgs --target-env ${COMPILE_SHADER_TARGET_ENV})
+   endif()
 
    get_filename_component(TargetDir ${COMPILE_SHADER_TARGET} DIRECTORY)
    add_custom_command(
       COMMAND ${CMAKE_COMMAND} ARGS -E make_directory ${TargetDir}
-      COMMAND ${GlslangValidator} ARGS -V ${COMPILE_SHADER_SOURCE} -o ${COMPILE_SHADER_TARGET}
-      DEPENDS ${COMPILE_SHADER_SOURCE}
+      COMMAND ${GlslangValidator} ARGS -V ${ExtraArgs} ${COMPILE_SHADER_SOURCE} -o ${COMPILE_SHADER_TARGET}
+      DEPENDS ${COMPILE_SHADER_SOURCE} ${COMPILE_SHADER_DEPENDS}
       OUTPUT ${COMPILE_SHADER_TARGET}
    )
    add_custom_target(${ARGV0} DEPENDS ${COMPILE_SHADER_TARGET})
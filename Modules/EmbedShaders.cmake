@@ -0,0 +1,27 @@
+# Embed compiled SPIR-V shaders into a C source file. Run as
+# cmake -DSHADER_DIR=<dir> -DNAMES=<name1,name2,...> -DOUTPUT=<file> -P EmbedShaders.cmake
+# Each <dir>/<name>.spv becomes an entry in an_embedded_shaders[].
+
+string(REPLACE "," ";" Names "${NAMES}")
+
+set(Content "/* Generated by EmbedShaders.cmake, do not edit */\n")
+set(Content "${Content}#include \"embedded-shaders.h\"\n\n")
+set(Table "")
+set(Index 0)
+
+foreach(Name ${Names})
+   file(READ ${SHADER_DIR}/${Name}.spv Hex HEX)
+   string(LENGTH "${Hex}" HexLength)
+   math(EXPR Size "${HexLength} / 2")
+   string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," Bytes "${Hex}")
+
+   set(Content "${Content}/* ${Name}.spv */\n")
+   set(Content "${Content}static const unsigned char __attribute__((aligned (4))) shader${Index}[] = {\n")
+   set(Content "${Content}${Bytes}\n};\n\n")
+   set(Table "${Table}    { \"${Name}\", shader${Index}, ${Size} },\n")
+   math(EXPR Index "${Index} + 1")
+endforeach()
+
+set(Content "${Content}const struct an_embedded_shader an_embedded_shaders[] = {\n")
+set(Content "${Content}${Table}    { NULL, NULL, 0 }\n};\n")
+file(WRITE ${OUTPUT} "${Content}")
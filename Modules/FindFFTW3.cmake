@@ -10,3 +10,9 @@ MARK_AS_ADVANCED(FFTW3_LIBRARY)
 INCLUDE(FindPackageHandleStandardArgs)
 FIND_PACKAGE_HANDLE_STANDARD_ARGS (FFTW3 DEFAULT_MSG
                                    FFTW3_LIBRARY FFTW3_INCLUDE_DIR)
+
+# Optional threaded planner
+FIND_LIBRARY(FFTW3_THREADS_LIBRARY NAMES
+  fftw3f_threads
+  libfftw3f_threads)
+MARK_AS_ADVANCED(FFTW3_THREADS_LIBRARY)
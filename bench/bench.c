@@ -0,0 +1,358 @@
+/* Micro-benchmarks of the public interface, results are written as JSON */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/utsname.h>
+
+#include "annealing-lowlevel.h"
+
+#define MAX_SIZES 4
+#define BATCH_POINTS 64
+
+/* Grid sizes along each axis for 1, 2 and 3 dimensions */
+static const unsigned int grid_sizes[MAX_DIMENSIONS][MAX_SIZES] = {
+    { 4096, 65536, 262144, 1048576 },
+    { 64, 256, 512, 1024 },
+    { 16, 32, 64, 128 }
+};
+
+struct options {
+    const char *output;
+    double minTime;
+    int nsizes;
+    int maxdim;
+    int vulkan;
+    int cpu;
+};
+
+struct results {
+    FILE *out;
+    int count;
+};
+
+static double
+now () {
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+result (struct results *results, const char *name, const char *backend,
+        const unsigned int *dimensions, unsigned int ndim,
+        double value, const char *unit, int higherIsBetter) {
+    FILE *out = results->out;
+
+    fprintf (out, "%s\n    {\"name\": \"%s\", \"backend\": \"%s\", \"dimensions\": [",
+             (results->count > 0) ? "," : "", name, backend);
+    for (unsigned int i = 0; i < ndim; i++) {
+        fprintf (out, "%s%u", (i > 0) ? ", " : "", dimensions[i]);
+    }
+    fprintf (out, "], \"value\": %.6g, \"unit\": \"%s\", \"higher_is_better\": %s}",
+             value, unit, higherIsBetter ? "true" : "false");
+    results->count++;
+
+    fprintf (stderr, "%-20s %-7s ", name, backend);
+    for (unsigned int i = 0; i < ndim; i++) {
+        fprintf (stderr, "%s%u", (i > 0) ? "x" : "", dimensions[i]);
+    }
+    fprintf (stderr, "\t%.6g %s\n", value, unit);
+}
+
+static size_t
+volume (const unsigned int *dimensions, unsigned int ndim) {
+    size_t size = 1;
+    for (unsigned int i = 0; i < ndim; i++) {
+        size *= dimensions[i];
+    }
+
+    return size;
+}
+
+static size_t
+spectrum_size (const unsigned int *dimensions, unsigned int ndim) {
+    return volume (dimensions, ndim) / dimensions[ndim - 1] * (dimensions[ndim - 1] / 2 + 1);
+}
+
+static void
+random_coords (unsigned int *coords, const unsigned int *dimensions,
+               unsigned int ndim, unsigned int npoints) {
+    for (unsigned int k = 0; k < npoints; k++) {
+        for (unsigned int i = 0; i < ndim; i++) {
+            coords[k * ndim + i] = rand () % dimensions[i];
+        }
+    }
+}
+
+/* Data shared by benchmarks of one grid */
+struct grid {
+    unsigned int dimensions[MAX_DIMENSIONS];
+    unsigned int ndim;
+    size_t size, ssize;
+    float *array;
+    float *real, *imag;
+    float *corrfn;
+};
+
+static void
+make_grid (struct grid *grid, unsigned int ndim, int sizeIndex) {
+    memset (grid, 0, sizeof (struct grid));
+    grid->ndim = ndim;
+    for (unsigned int i = 0; i < ndim; i++) {
+        grid->dimensions[i] = grid_sizes[ndim - 1][sizeIndex];
+    }
+
+    grid->size = volume (grid->dimensions, ndim);
+    grid->ssize = spectrum_size (grid->dimensions, ndim);
+    grid->array = malloc (sizeof (float) * grid->size);
+    grid->real = malloc (sizeof (float) * grid->ssize);
+    grid->imag = malloc (sizeof (float) * grid->ssize);
+    grid->corrfn = malloc (sizeof (float) * grid->ssize);
+
+    for (size_t i = 0; i < grid->size; i++) {
+        grid->array[i] = rand () % 2;
+    }
+
+    an_rfft (grid->array, grid->real, grid->imag, grid->dimensions, ndim);
+    for (size_t i = 0; i < grid->ssize; i++) {
+        grid->corrfn[i] = grid->real[i] * grid->real[i] + grid->imag[i] * grid->imag[i];
+    }
+}
+
+static void
+free_grid (struct grid *grid) {
+    free (grid->array);
+    free (grid->real);
+    free (grid->imag);
+    free (grid->corrfn);
+}
+
+/* Host FFT, does not depend on the backend */
+static void
+bench_fft (struct results *results, const struct options *options, struct grid *grid) {
+    float *array = malloc (sizeof (float) * grid->size);
+    double start, elapsed;
+    long n;
+
+    /* Plans are cached, the first call is not measured */
+    an_rfft (grid->array, grid->real, grid->imag, grid->dimensions, grid->ndim);
+    start = now ();
+    for (n = 0; (elapsed = now () - start) < options->minTime || n < 3; n++) {
+        an_rfft (grid->array, grid->real, grid->imag, grid->dimensions, grid->ndim);
+    }
+    result (results, "rfft", "host", grid->dimensions, grid->ndim,
+            n * grid->size / elapsed * 1e-6, "Mvoxels/s", 1);
+
+    an_irfft (array, grid->real, grid->imag, grid->dimensions, grid->ndim);
+    start = now ();
+    for (n = 0; (elapsed = now () - start) < options->minTime || n < 3; n++) {
+        an_irfft (array, grid->real, grid->imag, grid->dimensions, grid->ndim);
+    }
+    result (results, "irfft", "host", grid->dimensions, grid->ndim,
+            n * grid->size / elapsed * 1e-6, "Mvoxels/s", 1);
+
+    free (array);
+}
+
+static void
+bench_images (struct results *results, const struct options *options,
+              struct an_gpu_context *ctx, const char *backend, struct grid *grid) {
+    double mbytes = 2 * sizeof (float) * grid->ssize * 1e-6;
+    unsigned int coords[BATCH_POINTS * MAX_DIMENSIONS];
+    float deltas[BATCH_POINTS];
+    double start, elapsed;
+    float distance;
+    long n;
+
+    /* Creation and readback */
+    start = now ();
+    for (n = 0; (elapsed = now () - start) < options->minTime || n < 3; n++) {
+        struct an_image *image = an_create_image (ctx, grid->real, grid->imag,
+                                                  grid->dimensions, grid->ndim);
+        if (image == NULL) {
+            fprintf (stderr, "Cannot create an image\n");
+            return;
+        }
+        an_destroy_image (image);
+    }
+    result (results, "image_create", backend, grid->dimensions, grid->ndim,
+            n * mbytes / elapsed, "MB/s", 1);
+
+    struct an_image *image = an_create_image (ctx, grid->real, grid->imag,
+                                              grid->dimensions, grid->ndim);
+    struct an_corrfn *corrfn = an_create_corrfn (ctx, grid->corrfn,
+                                                 grid->dimensions, grid->ndim);
+    struct an_metric *metric = (image != NULL && corrfn != NULL) ?
+        an_create_metric (ctx, corrfn, image) : NULL;
+    if (metric == NULL) {
+        fprintf (stderr, "Cannot create a metric\n");
+        goto cleanup;
+    }
+
+    start = now ();
+    for (n = 0; (elapsed = now () - start) < options->minTime || n < 3; n++) {
+        an_image_get (image, grid->real, grid->imag);
+    }
+    result (results, "image_readback", backend, grid->dimensions, grid->ndim,
+            n * mbytes / elapsed, "MB/s", 1);
+
+    /* Updates, the distance at the end waits for the last one */
+    start = now ();
+    for (n = 0; (elapsed = now () - start) < options->minTime || n < 3; n++) {
+        random_coords (coords, grid->dimensions, grid->ndim, 1);
+        an_image_update_fft (image, coords, grid->ndim, (n % 2) ? -1 : 1);
+    }
+    an_distance (metric, &distance);
+    elapsed = now () - start;
+    result (results, "update_fft", backend, grid->dimensions, grid->ndim,
+            n / elapsed, "updates/s", 1);
+
+    for (unsigned int k = 0; k < BATCH_POINTS; k++) {
+        deltas[k] = (k % 2) ? -1 : 1;
+    }
+
+    start = now ();
+    for (n = 0; (elapsed = now () - start) < options->minTime || n < 3; n++) {
+        random_coords (coords, grid->dimensions, grid->ndim, BATCH_POINTS);
+        an_image_update_fft_batch (image, coords, deltas, BATCH_POINTS, grid->ndim);
+    }
+    an_distance (metric, &distance);
+    elapsed = now () - start;
+    result (results, "update_fft_batch", backend, grid->dimensions, grid->ndim,
+            n * BATCH_POINTS / elapsed, "updates/s", 1);
+
+    start = now ();
+    for (n = 0; (elapsed = now () - start) < options->minTime || n < 3; n++) {
+        an_distance (metric, &distance);
+    }
+    result (results, "distance", backend, grid->dimensions, grid->ndim,
+            elapsed / n * 1e6, "us", 0);
+
+cleanup:
+    if (metric != NULL) {
+        an_destroy_metric (metric);
+    }
+
+    if (corrfn != NULL) {
+        an_destroy_corrfn (corrfn);
+    }
+
+    if (image != NULL) {
+        an_destroy_image (image);
+    }
+}
+
+static void
+run_backend (struct results *results, const struct options *options,
+             enum an_backend backend, const char *name) {
+    unsigned int none[1] = { 0 };
+
+    /* Startup with all pipelines built */
+    double start = now ();
+    struct an_gpu_context *ctx = an_create_context_with_backend (MAX_DIMENSIONS, backend, 0);
+    double elapsed = now () - start;
+
+    if (ctx == NULL) {
+        fprintf (stderr, "Backend %s is not available\n", name);
+        return;
+    }
+
+    result (results, "context_startup", name, none, 0, elapsed * 1e3, "ms", 0);
+
+    for (unsigned int ndim = 1; ndim <= options->maxdim; ndim++) {
+        for (int i = 0; i < options->nsizes; i++) {
+            struct grid grid;
+            make_grid (&grid, ndim, i);
+            bench_images (results, options, ctx, name, &grid);
+            free_grid (&grid);
+        }
+    }
+
+    an_destroy_context (ctx);
+}
+
+static void
+usage (const char *name) {
+    fprintf (stderr,
+             "Usage: %s [-o output.json] [-t seconds] [-s nsizes] [-d maxdim] [-b vulkan|cpu|all]\n"
+             "  -o  Output file (default bench.json)\n"
+             "  -t  Minimal time of each measurement (default 0.5)\n"
+             "  -s  Number of grid sizes for each number of dimensions (1-%i, default %i)\n"
+             "  -d  Maximal number of dimensions (default %i)\n"
+             "  -b  Backends to measure (default all)\n",
+             name, MAX_SIZES, MAX_SIZES, MAX_DIMENSIONS);
+}
+
+int
+main (int argc, char *argv[]) {
+    struct options options = { "bench.json", 0.5, MAX_SIZES, MAX_DIMENSIONS, 1, 1 };
+    struct results results = { NULL, 0 };
+    struct utsname uts;
+    int opt;
+
+    while ((opt = getopt (argc, argv, "o:t:s:d:b:h")) != -1) {
+        switch (opt) {
+        case 'o':
+            options.output = optarg;
+            break;
+        case 't':
+            options.minTime = atof (optarg);
+            break;
+        case 's':
+            options.nsizes = atoi (optarg);
+            break;
+        case 'd':
+            options.maxdim = atoi (optarg);
+            break;
+        case 'b':
+            options.vulkan = strcmp (optarg, "cpu") != 0;
+            options.cpu = strcmp (optarg, "vulkan") != 0;
+            break;
+        default:
+            usage (argv[0]);
+            return 1;
+        }
+    }
+
+    if (options.nsizes < 1 || options.nsizes > MAX_SIZES ||
+        options.maxdim < 1 || options.maxdim > MAX_DIMENSIONS) {
+        usage (argv[0]);
+        return 1;
+    }
+
+    results.out = fopen (options.output, "w");
+    if (results.out == NULL) {
+        perror ("Cannot open the output file");
+        return 1;
+    }
+
+    uname (&uts);
+    fprintf (results.out, "{\n  \"format\": 1,\n  \"host\": \"%s %s %s\",\n"
+             "  \"time\": %ld,\n  \"min_time\": %g,\n  \"results\": [",
+             uts.sysname, uts.release, uts.machine, (long) time (NULL), options.minTime);
+
+    srand (1);
+    for (unsigned int ndim = 1; ndim <= options.maxdim; ndim++) {
+        for (int i = 0; i < options.nsizes; i++) {
+            struct grid grid;
+            make_grid (&grid, ndim, i);
+            bench_fft (&results, &options, &grid);
+            free_grid (&grid);
+        }
+    }
+
+    if (options.vulkan) {
+        run_backend (&results, &options, AN_BACKEND_VULKAN, "vulkan");
+    }
+
+    if (options.cpu) {
+        run_backend (&results, &options, AN_BACKEND_CPU, "cpu");
+    }
+
+    fprintf (results.out, "\n  ]\n}\n");
+    fclose (results.out);
+    return 0;
+}
@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+"""Compare two result files of the bench program and flag regressions.
+
+Usage: compare.py [--threshold 0.1] baseline.json current.json
+
+Exits with status 1 if some result got worse by more than the threshold
+(a relative change, 0.1 is 10%).
+"""
+
+import argparse
+import json
+import sys
+
+
+def load(path):
+    with open(path) as f:
+        data = json.load(f)
+    results = {}
+    for r in data["results"]:
+        key = (r["name"], r["backend"], tuple(r["dimensions"]))
+        results[key] = r
+    return data, results
+
+
+def describe(key):
+    name, backend, dims = key
+    grid = "x".join(str(d) for d in dims) if dims else "-"
+    return f"{name:<18} {backend:<7} {grid:<16}"
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("baseline")
+    parser.add_argument("current")
+    parser.add_argument("--threshold", type=float, default=0.1,
+                        help="relative change counted as a regression (default 0.1)")
+    args = parser.parse_args()
+
+    baseline_data, baseline = load(args.baseline)
+    current_data, current = load(args.current)
+    regressions = 0
+
+    print(f"baseline: {baseline_data.get('host', '?')}")
+    print(f"current:  {current_data.get('host', '?')}")
+    print()
+
+    for key in sorted(set(baseline) | set(current)):
+        if key not in baseline or key not in current:
+            where = "current" if key in current else "baseline"
+            print(f"{describe(key)} only in {where}")
+            continue
+
+        old, new = baseline[key], current[key]
+        unit = new["unit"]
+        if old["value"] == 0:
+            continue
+
+        change = (new["value"] - old["value"]) / old["value"]
+        # Positive gain means better
+        gain = change if new["higher_is_better"] else -change
+        mark = ""
+        if gain < -args.threshold:
+            mark = "REGRESSION"
+            regressions += 1
+        elif gain > args.threshold:
+            mark = "improved"
+
+        print(f"{describe(key)} {old['value']:>12.6g} -> {new['value']:>12.6g} {unit:<10}"
+              f" {change:+7.1%} {mark}")
+
+    print()
+    print(f"{regressions} regression(s) over {args.threshold:.0%}")
+    return 1 if regressions > 0 else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,49 @@
+/*
+ * exp(-2 pi i <point, gid / logical_dimensions>) calculated with
+ * tables of roots of unity for each axis. Before including this file,
+ * declare the twiddle buffer and the updateData push constants with
+ * ndim and logical_dimensions.
+ */
+
+/* x + y mod n for x, y < n without overflow */
+uint add_mod (uint x, uint y, uint n) {
+    return (x >= n - y) ? x - (n - y) : x + y;
+}
+
+/*
+ * a * b mod n. The product does not fit in 32 bits only for axes
+ * longer than 65536, then it is calculated by doubling.
+ */
+uint mul_mod (uint a, uint b, uint n) {
+    uint hi, lo;
+    umulExtended (a, b, hi, lo);
+    if (hi == 0) {
+        return lo % n;
+    }
+
+    a %= n;
+    uint r = 0;
+    for (int bit = 31; bit >= 0; bit--) {
+        r = add_mod (r, r, n);
+        if (((b >> bit) & 1) != 0) {
+            r = add_mod (r, a, n);
+        }
+    }
+
+    return r;
+}
+
+vec2 phase (uvec3 point, uvec3 gid) {
+    vec2 result = vec2(1, 0);
+    uint offset = 0;
+
+    for (int i = 0; i < updateData.ndim; i++) {
+        uint n = updateData.logical_dimensions[i];
+        vec2 root = twiddle[offset + mul_mod (point[i], gid[i], n)];
+        result = vec2(result.x * root.x - result.y * root.y,
+                      result.x * root.y + result.y * root.x);
+        offset += n;
+    }
+
+    return result;
+}
@@ -0,0 +1,108 @@
+/*
+ * Reduction of a value over all work groups in one dispatch. Before
+ * including this file, define REDUCE_BINDING: bindings REDUCE_BINDING,
+ * REDUCE_BINDING + 1 and REDUCE_BINDING + 2 are used for partial
+ * sums, counters of finished work groups and results respectively.
+ * Define USE_SUBGROUPS to use subgroup arithmetic (the extensions
+ * must be enabled by the including shader).
+ */
+
+#define MAX_GRP_SIZE 512
+
+layout(std430, binding = REDUCE_BINDING) coherent buffer reduceLay0 {
+    float partials[];
+};
+
+/* Must be zero before the dispatch. Reset by the last work group */
+layout(std430, binding = REDUCE_BINDING + 1) coherent buffer reduceLay1 {
+    uint counters[];
+};
+
+layout(std430, binding = REDUCE_BINDING + 2) buffer reduceLay2 {
+    float results[];
+};
+
+#ifdef USE_SUBGROUPS
+shared float subgroupSums[MAX_GRP_SIZE];
+
+/* The sum is valid in the first invocation of the work group */
+float group_sum (float value) {
+    float sum = subgroupAdd (value);
+    if (subgroupElect ()) {
+        subgroupSums[gl_SubgroupID] = sum;
+    }
+    barrier();
+
+    sum = 0;
+    if (gl_SubgroupID == 0) {
+        for (uint i = gl_SubgroupInvocationID; i < gl_NumSubgroups; i += gl_SubgroupSize) {
+            sum += subgroupSums[i];
+        }
+        sum = subgroupAdd (sum);
+    }
+    barrier();
+
+    return sum;
+}
+#else
+shared float tmp[MAX_GRP_SIZE];
+
+/* Work group size must be a power of two */
+float group_sum (float value) {
+    uint lid = gl_LocalInvocationIndex;
+    uint grpSize = gl_WorkGroupSize.x * gl_WorkGroupSize.y * gl_WorkGroupSize.z;
+
+    tmp[lid] = value;
+    barrier();
+
+    for (uint i = grpSize >> 1; i > 0; i >>= 1) {
+        if (lid < i) {
+            tmp[lid] += tmp[lid + i];
+        }
+        barrier();
+    }
+
+    float sum = tmp[0];
+    barrier();
+
+    return sum;
+}
+#endif
+
+shared bool lastGroup;
+
+/*
+ * Sum value over ngroups work groups of a segment and write the sum
+ * to results[target + segment]. The last finished work group does the
+ * final summation. Must be called by all invocations.
+ */
+void reduce_groups (float value, uint segment, uint group, uint ngroups,
+                    uint target, bool accumulate) {
+    uint lid = gl_LocalInvocationIndex;
+    uint grpSize = gl_WorkGroupSize.x * gl_WorkGroupSize.y * gl_WorkGroupSize.z;
+    uint base = segment * ngroups;
+
+    float sum = group_sum (value);
+    if (lid == 0) {
+        partials[base + group] = sum;
+        memoryBarrierBuffer();
+        lastGroup = atomicAdd (counters[segment], 1) == ngroups - 1;
+    }
+    barrier();
+
+    if (!lastGroup) {
+        return;
+    }
+
+    float acc = 0;
+    for (uint i = lid; i < ngroups; i += grpSize) {
+        acc += partials[base + i];
+    }
+
+    sum = group_sum (acc);
+    if (lid == 0) {
+        uint slot = target + segment;
+        results[slot] = accumulate ? results[slot] + sum : sum;
+        counters[segment] = 0;
+    }
+}
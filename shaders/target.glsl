@@ -0,0 +1,25 @@
+/*
+ * Target correlation function. Before including this file, define
+ * TARGET_BINDING. Values are stored as float32 or packed two in a
+ * word as float16 or bfloat16 (the lower half goes first), the format
+ * is passed in push constants (see enum an_storage_format).
+ */
+
+#define TARGET_FLOAT32  0
+#define TARGET_FLOAT16  1
+#define TARGET_BFLOAT16 2
+
+layout(std430, binding = TARGET_BINDING) readonly buffer targetLay {
+    uint cfBits[];
+};
+
+float load_target (uint idx, uint format) {
+    if (format == TARGET_FLOAT32) {
+        return uintBitsToFloat(cfBits[idx]);
+    }
+
+    uint word = cfBits[idx >> 1];
+    uint bits = ((idx & 1) != 0) ? word >> 16 : word & 0xffffu;
+    return (format == TARGET_FLOAT16) ?
+        unpackHalf2x16(bits).x : uintBitsToFloat(bits << 16);
+}
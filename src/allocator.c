@@ -0,0 +1,297 @@
+/* Device memory sub-allocator */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <vulkan/vulkan.h>
+
+#include "annealing-lowlevel.h"
+#include "internal.h"
+
+/*
+ * Device memory is allocated in blocks of MEMORY_BLOCK_SIZE bytes, one
+ * list of blocks per memory type. Buffers are placed in free ranges of
+ * these blocks (first fit). Requests bigger than a half of a block get
+ * their own dedicated allocation. Host-visible blocks are mapped once
+ * when created and stay mapped until they are freed.
+ */
+#define MEMORY_BLOCK_SIZE (16 << 20)
+
+struct free_range {
+    VkDeviceSize offset;
+    VkDeviceSize size;
+    struct free_range *next;
+};
+
+struct an_memory_block {
+    VkDeviceMemory memory;
+    VkDeviceSize size;
+    VkDeviceSize used;
+    uint32_t type;
+    int dedicated;
+    char *mapped;
+
+    /* Sorted by offset */
+    struct free_range *free;
+    struct an_memory_block *next;
+};
+
+static VkDeviceSize
+align_up (VkDeviceSize x, VkDeviceSize alignment) {
+    return (alignment > 1) ? (x + alignment - 1) / alignment * alignment : x;
+}
+
+static void
+destroy_block (struct an_gpu_context *ctx, struct an_memory_block *block) {
+    struct free_range *range = block->free;
+    while (range != NULL) {
+        struct free_range *next = range->next;
+        free (range);
+        range = next;
+    }
+
+    if (block->mapped != NULL) {
+        vkUnmapMemory (ctx->device, block->memory);
+    }
+
+    if (block->memory != VK_NULL_HANDLE) {
+        vkFreeMemory (ctx->device, block->memory, NULL);
+    }
+
+    free (block);
+}
+
+static struct an_memory_block*
+create_block (struct an_gpu_context *ctx, uint32_t type, VkDeviceSize size, int dedicated) {
+    VkResult result;
+    struct an_memory_block *block = malloc (sizeof (struct an_memory_block));
+    memset (block, 0, sizeof (struct an_memory_block));
+    block->size = size;
+    block->type = type;
+    block->dedicated = dedicated;
+
+    VkMemoryAllocateInfo allocInfo;
+    ZERO(allocInfo);
+    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocInfo.allocationSize = size;
+    allocInfo.memoryTypeIndex = type;
+
+    result = vkAllocateMemory (ctx->device, &allocInfo, NULL, &block->memory);
+    if (result != VK_SUCCESS) {
+        fprintf (stderr, "Cannot allocate device memory, code = %i\n", result);
+        goto cleanup;
+    }
+
+    if (ctx->memProperties.memoryTypes[type].propertyFlags &
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        void *ptr;
+        result = vkMapMemory (ctx->device, block->memory, 0, VK_WHOLE_SIZE, 0, &ptr);
+        if (result != VK_SUCCESS) {
+            fprintf (stderr, "Cannot map memory, code = %i\n", result);
+            goto cleanup;
+        }
+        block->mapped = ptr;
+    }
+
+    block->free = malloc (sizeof (struct free_range));
+    block->free->offset = 0;
+    block->free->size = size;
+    block->free->next = NULL;
+
+    return block;
+
+cleanup:
+    destroy_block (ctx, block);
+    return NULL;
+}
+
+/* Carve SIZE bytes aligned to ALIGNMENT from BLOCK */
+static int
+place (struct an_memory_block *block, VkDeviceSize size, VkDeviceSize alignment,
+       VkDeviceSize *offset) {
+    struct free_range **link = &block->free;
+
+    while (*link != NULL) {
+        struct free_range *range = *link;
+        VkDeviceSize start = align_up (range->offset, alignment);
+        VkDeviceSize end = range->offset + range->size;
+
+        if (start + size <= end) {
+            if (start + size < end) {
+                /* The tail stays free */
+                struct free_range *tail = malloc (sizeof (struct free_range));
+                tail->offset = start + size;
+                tail->size = end - tail->offset;
+                tail->next = range->next;
+                range->next = tail;
+            }
+
+            if (start > range->offset) {
+                /* So does the alignment padding */
+                range->size = start - range->offset;
+            } else {
+                *link = range->next;
+                free (range);
+            }
+
+            block->used += size;
+            *offset = start;
+            return 1;
+        }
+
+        link = &range->next;
+    }
+
+    return 0;
+}
+
+/* Return the range back to BLOCK, merging it with neighbours */
+static void
+release (struct an_memory_block *block, VkDeviceSize offset, VkDeviceSize size) {
+    struct free_range *prev = NULL;
+    struct free_range *next = block->free;
+
+    while (next != NULL && next->offset < offset) {
+        prev = next;
+        next = next->next;
+    }
+
+    block->used -= size;
+
+    if (prev != NULL && prev->offset + prev->size == offset) {
+        prev->size += size;
+    } else {
+        struct free_range *range = malloc (sizeof (struct free_range));
+        range->offset = offset;
+        range->size = size;
+        range->next = next;
+
+        if (prev != NULL) {
+            prev->next = range;
+        } else {
+            block->free = range;
+        }
+        prev = range;
+    }
+
+    if (next != NULL && prev->offset + prev->size == next->offset) {
+        prev->size += next->size;
+        prev->next = next->next;
+        free (next);
+    }
+}
+
+static int
+find_memory_type (struct an_gpu_context *ctx, uint32_t typeBits,
+                  VkMemoryPropertyFlags properties, uint32_t *type) {
+    const VkPhysicalDeviceMemoryProperties *memProperties = &ctx->memProperties;
+
+    for (uint32_t i = 0; i < memProperties->memoryTypeCount; i++) {
+        if ((typeBits & (1 << i)) &&
+            (memProperties->memoryTypes[i].propertyFlags & properties) == properties) {
+            *type = i;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int
+an_allocate_memory (struct an_gpu_context         *ctx,
+                    const VkMemoryRequirements    *requirements,
+                    VkMemoryPropertyFlags          properties,
+                    struct an_image_memory        *imemory) {
+    uint32_t type;
+
+    if (!find_memory_type (ctx, requirements->memoryTypeBits, properties, &type)) {
+        fprintf (stderr, "Cannot find memory with needed requirements\n");
+        return 0;
+    }
+
+    VkDeviceSize size = requirements->size;
+    VkDeviceSize offset = 0;
+    struct an_memory_block *block;
+
+    if (size > MEMORY_BLOCK_SIZE / 2) {
+        block = create_block (ctx, type, size, 1);
+        if (block == NULL) {
+            return 0;
+        }
+
+        place (block, size, 1, &offset);
+        block->next = ctx->memBlocks[type];
+        ctx->memBlocks[type] = block;
+    } else {
+        for (block = ctx->memBlocks[type]; block != NULL; block = block->next) {
+            if (!block->dedicated &&
+                block->size - block->used >= size &&
+                place (block, size, requirements->alignment, &offset)) {
+                break;
+            }
+        }
+
+        if (block == NULL) {
+            block = create_block (ctx, type, MEMORY_BLOCK_SIZE, 0);
+            if (block == NULL) {
+                return 0;
+            }
+
+            place (block, size, requirements->alignment, &offset);
+            block->next = ctx->memBlocks[type];
+            ctx->memBlocks[type] = block;
+        }
+    }
+
+    imemory->block = block;
+    imemory->memory = block->memory;
+    imemory->offset = offset;
+    imemory->size = size;
+    imemory->mapped = (block->mapped != NULL) ? block->mapped + offset : NULL;
+
+    return 1;
+}
+
+void
+an_free_memory (struct an_gpu_context *ctx, struct an_image_memory *imemory) {
+    struct an_memory_block *block = imemory->block;
+
+    if (block == NULL) {
+        return;
+    }
+
+    release (block, imemory->offset, imemory->size);
+    imemory->block = NULL;
+    imemory->memory = VK_NULL_HANDLE;
+    imemory->mapped = NULL;
+
+    /*
+     * Keep the first block of each type around even when it is empty,
+     * so that creating and destroying small objects repeatedly does not
+     * hit vkAllocateMemory.
+     */
+    struct an_memory_block **link = &ctx->memBlocks[block->type];
+    if (block->used == 0 && (block->dedicated || *link != block)) {
+        while (*link != block) {
+            link = &(*link)->next;
+        }
+
+        *link = block->next;
+        destroy_block (ctx, block);
+    }
+}
+
+void
+an_destroy_allocator (struct an_gpu_context *ctx) {
+    for (int i = 0; i < VK_MAX_MEMORY_TYPES; i++) {
+        struct an_memory_block *block = ctx->memBlocks[i];
+        while (block != NULL) {
+            struct an_memory_block *next = block->next;
+            destroy_block (ctx, block);
+            block = next;
+        }
+
+        ctx->memBlocks[i] = NULL;
+    }
+}
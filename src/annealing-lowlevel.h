@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define AN_EXPORT __attribute__((visibility ("default")))
 
 /* Fourier transform */
@@ -17,16 +20,71 @@ an_irfft (float              *array,
           const unsigned int *dimensions,
           unsigned int        ndims);
 
+/*
+ * Plans for an_rfft and an_irfft are cached by dimensions and by the
+ * distance between the real and imaginary arrays, so callers which keep
+ * both parts in one block reuse a single plan. Planning mode and the
+ * number of threads apply to plans created after the call (the cache
+ * is cleared when they change). Wisdom functions return 1 on success.
+ */
+enum an_fft_planning {
+    AN_FFT_ESTIMATE = 0,
+    AN_FFT_MEASURE,
+    AN_FFT_PATIENT
+};
+
+AN_EXPORT int
+an_fft_set_planning (enum an_fft_planning planning);
+
+AN_EXPORT int
+an_fft_set_threads (int nthreads);
+
+AN_EXPORT int
+an_fft_import_wisdom (const char *path);
+
+AN_EXPORT int
+an_fft_export_wisdom (const char *path);
+
+AN_EXPORT void
+an_fft_forget_plans (void);
+
 #define MAX_DIMENSIONS 3
 
 struct an_gpu_context;
 struct an_image;
 struct an_corrfn;
 struct an_metric;
+struct an_multi_metric;
+struct an_replicas;
+struct an_frequency_set;
+struct an_directional_s2;
+struct an_lineal;
 
+enum an_backend {
+    AN_BACKEND_VULKAN = 0,
+    AN_BACKEND_CPU
+};
+
+/*
+ * A context works with images of any number of dimensions up to
+ * MAX_DIMENSIONS. Pipelines for ndim dimensions are built right away,
+ * the others when the first image of that dimensionality is created.
+ * ndim may be 0 to build everything lazily.
+ */
 AN_EXPORT struct an_gpu_context*
 an_create_context(unsigned int ndim, int validation);
 
+/*
+ * Create a context with a specified backend. The CPU backend uses all
+ * available cores and does not need a Vulkan device. validation is
+ * ignored for the CPU backend. The environment variable AN_CPU_KERNELS
+ * (scalar, avx2 or avx512) limits the SIMD kernels it may use.
+ */
+AN_EXPORT struct an_gpu_context*
+an_create_context_with_backend (unsigned int    ndim,
+                                enum an_backend backend,
+                                int             validation);
+
 AN_EXPORT void
 an_destroy_context (struct an_gpu_context *ctx);
 
@@ -37,6 +95,24 @@ an_create_image (struct an_gpu_context *ctx,
                  const unsigned int    *dimensions,
                  unsigned int           ndim);
 
+/* The same, DATA holds pairs of real and imaginary parts */
+AN_EXPORT struct an_image*
+an_create_image_interleaved (struct an_gpu_context *ctx,
+                             const float           *data,
+                             const unsigned int    *dimensions,
+                             unsigned int           ndim);
+
+/*
+ * Create an image from a real volume. When the dimensions allow it
+ * (the last one is even and all of them have no prime factors other
+ * than 2, 3 and 5), the spectrum is calculated on the device.
+ */
+AN_EXPORT struct an_image*
+an_create_image_from_real (struct an_gpu_context *ctx,
+                           const float           *array,
+                           const unsigned int    *dimensions,
+                           unsigned int           ndim);
+
 AN_EXPORT void
 an_destroy_image (struct an_image *image);
 
@@ -46,6 +122,31 @@ an_create_corrfn (struct an_gpu_context *ctx,
                   const unsigned int    *dimensions,
                   unsigned int           ndim);
 
+/*
+ * Storage formats of the target on the device. Packed formats halve
+ * the memory traffic of the metric kernels, all arithmetic is still
+ * done in float32.
+ */
+enum an_storage_format {
+    AN_STORAGE_FLOAT32 = 0,
+    AN_STORAGE_FLOAT16,
+    AN_STORAGE_BFLOAT16
+};
+
+/*
+ * The same as an_create_corrfn, the target is stored in FORMAT.
+ * ERROR (may be NULL) receives the maximal relative rounding error of
+ * the stored values. The CPU backend keeps float32 storage but rounds
+ * the values in the same way, so both backends give the same results.
+ */
+AN_EXPORT struct an_corrfn*
+an_create_corrfn_with_format (struct an_gpu_context *ctx,
+                              const float           *corrfn,
+                              const unsigned int    *dimensions,
+                              unsigned int           ndim,
+                              enum an_storage_format format,
+                              float                 *error);
+
 AN_EXPORT void
 an_destroy_corrfn (struct an_corrfn *corrfn);
 
@@ -55,12 +156,114 @@ an_image_update_fft (struct an_image    *image,
                      unsigned int        ndim,
                      float               delta);
 
+/*
+ * Apply npoints updates in one pass over the spectrum. coords is an
+ * array of npoints * ndim coordinates, deltas has npoints elements.
+ */
+AN_EXPORT int
+an_image_update_fft_batch (struct an_image    *image,
+                           const unsigned int *coords,
+                           const float        *deltas,
+                           unsigned int        npoints,
+                           unsigned int        ndim);
+
 /* Testing */
 AN_EXPORT int
 an_image_get (struct an_image *image,
               float           *real,
               float           *imag);
 
+/* The same, DATA receives pairs of real and imaginary parts */
+AN_EXPORT int
+an_image_get_interleaved (struct an_image *image,
+                          float           *data);
+
+/* Inverse of an_create_image_from_real (the result is normalized) */
+AN_EXPORT int
+an_image_get_real (struct an_image *image,
+                   float           *array);
+
+/*
+ * Incremental updates accumulate rounding errors in the spectrum. When
+ * resynchronization is enabled, the image keeps its real volume
+ * (ARRAY, or recovered from the spectrum if ARRAY is NULL) and every
+ * INTERVAL updated points replaces the spectrum with its exact
+ * transform, computed in the background. If THRESHOLD is positive,
+ * the interval is adapted to keep the measured drift (relative RMS
+ * difference of the spectra) below it.
+ */
+AN_EXPORT int
+an_image_enable_resync (struct an_image *image,
+                        const float     *array,
+                        unsigned long    interval,
+                        float            threshold);
+
+AN_EXPORT void
+an_image_disable_resync (struct an_image *image);
+
+/* Resynchronize now. DRIFT (may be NULL) receives the measured drift */
+AN_EXPORT int
+an_image_resync (struct an_image *image,
+                 float           *drift);
+
+/* Drift measured at the last resynchronization or -1 */
+AN_EXPORT float
+an_image_last_drift (struct an_image *image);
+
+/*
+ * Frequency subsets. Images and targets created from a frequency set
+ * store only the retained frequencies, so updates and distances cost
+ * in proportion to their number. A frequency (in the layout of the
+ * half-spectrum of an image with the given dimensions) is retained if
+ * MASK is NULL or non-zero at it and, when CUTOFF is positive, its
+ * distance from zero in cycles per sample is at most CUTOFF (e.g. 0.1
+ * keeps a ball of radius 25.6 in a 256^3 volume). The set must outlive
+ * the images and targets created from it.
+ */
+AN_EXPORT struct an_frequency_set*
+an_create_frequency_set (struct an_gpu_context *ctx,
+                         const unsigned int    *dimensions,
+                         unsigned int           ndim,
+                         const unsigned char   *mask,
+                         float                  cutoff);
+
+AN_EXPORT void
+an_destroy_frequency_set (struct an_frequency_set *set);
+
+/* Number of retained frequencies */
+AN_EXPORT size_t
+an_frequency_set_size (const struct an_frequency_set *set);
+
+/* Positions of retained frequencies in the half-spectrum, in the stored order */
+AN_EXPORT const unsigned int*
+an_frequency_set_indices (const struct an_frequency_set *set);
+
+/*
+ * REAL and IMAG are the whole half-spectrum. an_image_get returns
+ * only retained frequencies. Such images can be updated and measured
+ * with an_metric (an_distance and its asynchronous variants) and
+ * an_multi_metric, moves, tracked updates, replicas, resynchronization
+ * and an_image_get_real are not supported.
+ */
+AN_EXPORT struct an_image*
+an_create_image_subset (struct an_gpu_context         *ctx,
+                        const struct an_frequency_set *set,
+                        const float                   *real,
+                        const float                   *imag);
+
+AN_EXPORT struct an_image*
+an_create_image_subset_from_real (struct an_gpu_context         *ctx,
+                                  const struct an_frequency_set *set,
+                                  const float                   *array);
+
+/* CORRFN is the whole half-spectrum, see an_create_corrfn_with_format */
+AN_EXPORT struct an_corrfn*
+an_create_corrfn_subset (struct an_gpu_context         *ctx,
+                         const struct an_frequency_set *set,
+                         const float                   *corrfn,
+                         enum an_storage_format         format,
+                         float                         *error);
+
 /* Distance measurement */
 AN_EXPORT struct an_metric*
 an_create_metric (struct an_gpu_context *ctx,
@@ -73,3 +276,310 @@ an_destroy_metric (struct an_metric *metric);
 AN_EXPORT int
 an_distance (struct an_metric *metric,
              float            *distance);
+
+/*
+ * Start calculation of the distance and return without waiting for
+ * the result. The returned ticket is passed to an_distance_wait or
+ * an_distance_poll. Only the latest request of a metric can be
+ * waited for.
+ */
+AN_EXPORT int
+an_distance_async (struct an_metric *metric,
+                   uint64_t         *ticket);
+
+AN_EXPORT int
+an_distance_wait (struct an_metric *metric,
+                  uint64_t          ticket,
+                  float            *distance);
+
+/* Set ready to non-zero if the result is available */
+AN_EXPORT int
+an_distance_poll (struct an_metric *metric,
+                  uint64_t          ticket,
+                  int              *ready);
+
+/*
+ * Calculate the distance which the image would have after the
+ * update (see an_image_update_fft_batch). The image is not changed
+ * until the move is committed with an_metric_commit_move.
+ */
+AN_EXPORT int
+an_metric_evaluate_move (struct an_metric   *metric,
+                         const unsigned int *coords,
+                         const float        *deltas,
+                         unsigned int        npoints,
+                         unsigned int        ndim,
+                         float              *distance);
+
+/* Apply the last move evaluated with an_metric_evaluate_move */
+AN_EXPORT int
+an_metric_commit_move (struct an_metric *metric);
+
+/*
+ * Apply a batch of updates to the image of the metric and update the
+ * distance incrementally, without a separate pass over the spectrum.
+ */
+AN_EXPORT int
+an_metric_update_fft (struct an_metric   *metric,
+                      const unsigned int *coords,
+                      const float        *deltas,
+                      unsigned int        npoints,
+                      unsigned int        ndim);
+
+/*
+ * Get the incrementally maintained distance. It is calculated from
+ * scratch if the image was modified not through this metric. Call
+ * an_distance to get rid of accumulated rounding errors.
+ */
+AN_EXPORT int
+an_metric_current_distance (struct an_metric *metric,
+                            float            *distance);
+
+/*
+ * Distance to several targets (at most 8, with the same storage
+ * format) calculated in one pass over the spectrum. The distance is
+ * the sum of WEIGHTS[k] times the distance to TARGETS[k]. If
+ * FREQUENCYWEIGHTS is not NULL, squared differences at each frequency
+ * are multiplied by its values (it has as many elements as the
+ * targets).
+ */
+AN_EXPORT struct an_multi_metric*
+an_create_multi_metric (struct an_gpu_context  *ctx,
+                        struct an_corrfn      **targets,
+                        const float            *weights,
+                        unsigned int            ntargets,
+                        const float            *frequencyWeights,
+                        struct an_image        *recon);
+
+AN_EXPORT void
+an_destroy_multi_metric (struct an_multi_metric *metric);
+
+/* COMPONENTS (may be NULL) receives the distances to each target */
+AN_EXPORT int
+an_multi_distance (struct an_multi_metric *metric,
+                   float                  *distance,
+                   float                  *components);
+
+/* Replica sets for parallel tempering */
+
+/*
+ * Create nreplicas copies of the image stored in one buffer. Each
+ * replica can be updated with at most maxpoints points at once.
+ */
+AN_EXPORT struct an_replicas*
+an_create_replicas (struct an_gpu_context *ctx,
+                    struct an_corrfn      *target,
+                    struct an_image       *image,
+                    unsigned int           nreplicas,
+                    unsigned int           maxpoints);
+
+AN_EXPORT void
+an_destroy_replicas (struct an_replicas *replicas);
+
+/* Copy an image to the replica with the given index */
+AN_EXPORT int
+an_replicas_set_image (struct an_replicas *replicas,
+                       unsigned int        index,
+                       struct an_image    *image);
+
+/* Copy the replica with the given index to an image */
+AN_EXPORT int
+an_replicas_get_image (struct an_replicas *replicas,
+                       unsigned int        index,
+                       struct an_image    *image);
+
+/*
+ * Update all replicas at once. npoints has nreplicas elements,
+ * coords and deltas contain the updates of all replicas one after
+ * another (see an_image_update_fft_batch). Distances to the target
+ * are calculated in the same submission.
+ */
+AN_EXPORT int
+an_replicas_update_fft (struct an_replicas *replicas,
+                        const unsigned int *npoints,
+                        const unsigned int *coords,
+                        const float        *deltas,
+                        unsigned int        ndim);
+
+/* Get distances of all replicas. distances has nreplicas elements */
+AN_EXPORT int
+an_replicas_distances (struct an_replicas *replicas,
+                       float              *distances);
+
+/* Exchange replicas i and j. No data is copied */
+AN_EXPORT int
+an_replicas_swap (struct an_replicas *replicas,
+                  unsigned int        i,
+                  unsigned int        j);
+
+/*
+ * Two-point functions along the axes up to LENGTH, maintained in real
+ * space on the host. S2 along axis a at lag r is the mean of
+ * I(x) I(x + r e_a) over the periodic volume, so an update of a point
+ * costs O(ndim * LENGTH) regardless of the size of the volume. Values
+ * and targets have ndim rows of LENGTH + 1 lags, in the order of
+ * dimensions. TARGET may be NULL (zeros). Updates, moves and distances
+ * work like those of an_metric, with coordinates and deltas as in
+ * an_image_update_fft_batch.
+ */
+AN_EXPORT struct an_directional_s2*
+an_create_directional_s2 (const float        *array,
+                          const unsigned int *dimensions,
+                          unsigned int        ndim,
+                          unsigned int        length,
+                          const float        *target);
+
+AN_EXPORT void
+an_destroy_directional_s2 (struct an_directional_s2 *s2);
+
+AN_EXPORT void
+an_directional_s2_set_target (struct an_directional_s2 *s2,
+                              const float              *target);
+
+AN_EXPORT void
+an_directional_s2_get (struct an_directional_s2 *s2,
+                       float                    *values);
+
+AN_EXPORT int
+an_directional_s2_update (struct an_directional_s2 *s2,
+                          const unsigned int       *coords,
+                          const float              *deltas,
+                          unsigned int              npoints,
+                          unsigned int              ndim);
+
+/* Sum of squared differences with the target */
+AN_EXPORT int
+an_directional_s2_distance (struct an_directional_s2 *s2,
+                            float                    *distance);
+
+AN_EXPORT int
+an_directional_s2_evaluate_move (struct an_directional_s2 *s2,
+                                 const unsigned int       *coords,
+                                 const float              *deltas,
+                                 unsigned int              npoints,
+                                 unsigned int              ndim,
+                                 float                    *distance);
+
+AN_EXPORT int
+an_directional_s2_commit_move (struct an_directional_s2 *s2);
+
+/*
+ * Lineal-path function and chord-length distribution of a two-phase
+ * image along the axes, maintained with tables of chords on the
+ * host. PHASES is non-zero for pixels of the phase. Lines are
+ * periodic. Values have ndim rows: L(r) for r = 1 ... MAXLENGTH
+ * pixels (the fraction of positions where r consecutive pixels are in
+ * the phase) and the fraction of chords of lengths 1 ... MAXCHORD.
+ * Neither may exceed dimensions. A flip costs
+ * O(ndim * (chord length + MAXLENGTH)).
+ */
+AN_EXPORT struct an_lineal*
+an_create_lineal (const unsigned char *phases,
+                  const unsigned int  *dimensions,
+                  unsigned int         ndim,
+                  unsigned int         maxLength,
+                  unsigned int         maxChord);
+
+AN_EXPORT void
+an_destroy_lineal (struct an_lineal *lineal);
+
+/*
+ * The distance is LINEALWEIGHT times the sum of squared differences
+ * with LINEALTARGET plus CHORDWEIGHT times that with CHORDTARGET.
+ * Either target may be NULL to leave its term out.
+ */
+AN_EXPORT void
+an_lineal_set_targets (struct an_lineal *lineal,
+                       const float      *linealTarget,
+                       const float      *chordTarget,
+                       float             linealWeight,
+                       float             chordWeight);
+
+/* Either array may be NULL */
+AN_EXPORT void
+an_lineal_get (struct an_lineal *lineal,
+               float            *linealPath,
+               float            *chords);
+
+/* Flip phases of NPOINTS pixels, COORDS as in an_image_update_fft_batch */
+AN_EXPORT int
+an_lineal_flip (struct an_lineal   *lineal,
+                const unsigned int *coords,
+                unsigned int        npoints,
+                unsigned int        ndim);
+
+AN_EXPORT int
+an_lineal_distance (struct an_lineal *lineal,
+                    float            *distance);
+
+/* See an_metric_evaluate_move, a move is a set of flips */
+AN_EXPORT int
+an_lineal_evaluate_move (struct an_lineal   *lineal,
+                         const unsigned int *coords,
+                         unsigned int        npoints,
+                         unsigned int        ndim,
+                         float              *distance);
+
+AN_EXPORT int
+an_lineal_commit_move (struct an_lineal *lineal);
+
+/*
+ * Statistics. Stages of the device are timed with timestamp queries
+ * written around command buffers submitted while statistics are
+ * enabled, so they can be switched at any time. With the CPU backend
+ * the same stages are timed on the host.
+ * SUBMIT and WAIT are host time spent in vkQueueSubmit and in blocking
+ * waits for the device. Times are in microseconds. Statistics cost
+ * nothing but a check when they are disabled (the default).
+ */
+enum an_stat_stage {
+    /* Updates of an image (single points, batches, subsets) */
+    AN_STAGE_UPDATE = 0,
+    /* Distance calculation of an_metric and an_multi_metric */
+    AN_STAGE_METRIC,
+    /* Evaluation of a move, see an_metric_evaluate_move */
+    AN_STAGE_MOVE,
+    /* Updates with the distance, see an_metric_update_fft */
+    AN_STAGE_TRACKED,
+    AN_STAGE_SUBMIT,
+    AN_STAGE_WAIT,
+    AN_STAGE_COUNT
+};
+
+struct an_stage_stats {
+    unsigned long count;
+    double min, mean, max;
+};
+
+struct an_stats {
+    struct an_stage_stats stages[AN_STAGE_COUNT];
+    /* Submissions and waits which blocked, transfers included */
+    unsigned long submits;
+    unsigned long waits;
+    unsigned long allocations;
+    uint64_t bytesUploaded;
+    uint64_t bytesDownloaded;
+};
+
+AN_EXPORT int
+an_enable_stats (struct an_gpu_context *ctx, int enable);
+
+AN_EXPORT void
+an_get_stats (struct an_gpu_context *ctx, struct an_stats *stats);
+
+AN_EXPORT void
+an_reset_stats (struct an_gpu_context *ctx);
+
+/*
+ * Tracing. Calls of the library functions, submissions and waits are
+ * recorded with their host time, stages of the device with timestamps
+ * put on the same time line (command buffers submitted while tracing
+ * are timed, as for statistics). an_stop_trace writes the trace to
+ * FILENAME (NULL to discard it) in the Chrome trace format, see
+ * chrome://tracing or ui.perfetto.dev.
+ */
+AN_EXPORT int
+an_start_trace (struct an_gpu_context *ctx);
+
+AN_EXPORT int
+an_stop_trace (struct an_gpu_context *ctx, const char *filename);
@@ -12,13 +12,12 @@ void
 an_destroy_buffer (struct an_gpu_context *ctx, struct an_image_memory *imemory) {
     assert (ctx->device != VK_NULL_HANDLE);
 
-    if (imemory->memory != VK_NULL_HANDLE) {
-        vkFreeMemory (ctx->device, imemory->memory, NULL);
-    }
-
     if (imemory->buffer != VK_NULL_HANDLE) {
         vkDestroyBuffer (ctx->device, imemory->buffer, NULL);
     }
+
+    an_free_memory (ctx, imemory);
+    free (imemory);
 }
 
 struct an_image_memory*
@@ -43,66 +42,250 @@ an_create_buffer (struct an_gpu_context *ctx, VkBufferUsageFlags usage,
         goto cleanup;
     }
 
-    VkPhysicalDeviceMemoryProperties memProperties;
-    vkGetPhysicalDeviceMemoryProperties(ctx->physDev, &memProperties);
     VkMemoryRequirements memRequirements;
     vkGetBufferMemoryRequirements(ctx->device, imemory->buffer, &memRequirements);
 
-    int i;
-    for (i = 0; i < memProperties.memoryTypeCount; i++) {
-        if ((memRequirements.memoryTypeBits & (1 << i)) &&
-            (memProperties.memoryTypes[i].propertyFlags & properties) == properties) {
-            break;
+    if (!an_allocate_memory (ctx, &memRequirements, properties, imemory)) {
+        fprintf (stderr, "Cannot allocate buffer memory\n");
+        goto cleanup;
+    }
+
+    vkBindBufferMemory (ctx->device, imemory->buffer, imemory->memory, imemory->offset);
+    an_stats_count (ctx, STATS_ALLOCATIONS, 1);
+    return imemory;
+
+cleanup:
+    an_destroy_buffer (ctx, imemory);
+    return NULL;
+}
+
+/*
+ * Staging ring. Transfers between the host and the device go through
+ * STAGING_SLOTS host-visible buffers owned by the context, each with
+ * its own command buffer and fence. While one chunk is copied by the
+ * device, the host fills (or drains) another one. The slots are
+ * created on the first use and grow on demand up to
+ * STAGING_MAX_SLOT_SIZE, larger transfers are split into chunks.
+ */
+#define STAGING_SLOTS 2
+#define STAGING_MIN_SLOT_SIZE (64 << 10)
+#define STAGING_MAX_SLOT_SIZE (8 << 20)
+/* Slot sizes are multiples of this, see an_write_data_with() */
+#define STAGING_ALIGNMENT 64
+
+struct staging_slot {
+    struct an_image_memory *memory;
+    void *ptr;
+    VkCommandBuffer commandBuffer;
+    VkFence fence;
+    int pending;
+
+    /* What to do with the data after the copy is done */
+    an_drain_fn drain;
+    void *drainArg;
+    size_t readOffset;
+    size_t readSize;
+};
+
+struct an_staging {
+    size_t size;
+    unsigned int next;
+    struct staging_slot slots[STAGING_SLOTS];
+};
+
+static void
+finish_slot (struct an_gpu_context *ctx, struct staging_slot *slot) {
+    if (slot->pending) {
+        if (vkGetFenceStatus (ctx->device, slot->fence) != VK_SUCCESS) {
+            an_stats_count (ctx, STATS_WAITS, 1);
+            double start = an_stats_start (ctx);
+            double traceStart = an_trace_begin (ctx);
+            vkWaitForFences (ctx->device, 1, &slot->fence, VK_TRUE, -1);
+            an_stats_time (ctx, AN_STAGE_WAIT, start);
+            an_trace_end (ctx, "wait", traceStart);
         }
+
+        vkResetFences (ctx->device, 1, &slot->fence);
+        slot->pending = 0;
     }
 
-    if (i == memProperties.memoryTypeCount) {
-        fprintf (stderr, "Cannot find memory with needed requirements\n");
-        goto cleanup;
+    if (slot->drain != NULL) {
+        slot->drain (slot->ptr, slot->readOffset, slot->readSize, slot->drainArg);
+        slot->drain = NULL;
     }
+}
 
-    VkMemoryAllocateInfo allocInfo;
-    ZERO(allocInfo);
-    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocInfo.allocationSize = memRequirements.size;
-    allocInfo.memoryTypeIndex = i;
+static void
+finish_all (struct an_gpu_context *ctx) {
+    struct an_staging *staging = ctx->staging;
 
-    result = vkAllocateMemory(ctx->device, &allocInfo, NULL, &imemory->memory);
-    if (result != VK_SUCCESS) {
-        fprintf (stderr, "Cannot allocate buffer memory, code = %i\n", result);
-        goto cleanup;
+    for (int i = 0; i < STAGING_SLOTS; i++) {
+        /* In order of submission */
+        finish_slot (ctx, &staging->slots[(staging->next + i) % STAGING_SLOTS]);
     }
+}
 
-    vkBindBufferMemory (ctx->device, imemory->buffer, imemory->memory, 0);
-    return imemory;
+static void
+destroy_slot_memory (struct an_gpu_context *ctx, struct staging_slot *slot) {
+    if (slot->memory != NULL) {
+        an_destroy_buffer (ctx, slot->memory);
+        slot->memory = NULL;
+        slot->ptr = NULL;
+    }
+}
 
-cleanup:
-    an_destroy_buffer (ctx, imemory);
-    return NULL;
+void
+an_destroy_staging (struct an_gpu_context *ctx) {
+    struct an_staging *staging = ctx->staging;
+
+    if (staging == NULL) {
+        return;
+    }
+
+    finish_all (ctx);
+    for (int i = 0; i < STAGING_SLOTS; i++) {
+        struct staging_slot *slot = &staging->slots[i];
+        destroy_slot_memory (ctx, slot);
+
+        if (slot->fence != VK_NULL_HANDLE) {
+            vkDestroyFence (ctx->device, slot->fence, NULL);
+        }
+
+        if (slot->commandBuffer != VK_NULL_HANDLE) {
+            vkFreeCommandBuffers (ctx->device, ctx->cmdPool, 1, &slot->commandBuffer);
+        }
+    }
+
+    free (staging);
+    ctx->staging = NULL;
 }
 
 static int
-copy_buffer (struct an_gpu_context *ctx, VkBuffer source, VkBuffer destination,
-             VkDeviceSize size) {
+ensure_staging (struct an_gpu_context *ctx, size_t size) {
     VkResult result;
-    VkCommandBuffer commandBuffer;
-    result = an_create_command_buffer (ctx, &commandBuffer);
-    if (result != VK_SUCCESS) {
-        return 0;
+
+    if (ctx->staging == NULL) {
+        ctx->staging = malloc (sizeof (struct an_staging));
+        memset (ctx->staging, 0, sizeof (struct an_staging));
+
+        for (int i = 0; i < STAGING_SLOTS; i++) {
+            struct staging_slot *slot = &ctx->staging->slots[i];
+
+            result = an_create_command_buffer (ctx, &slot->commandBuffer);
+            if (result != VK_SUCCESS) {
+                fprintf (stderr, "Cannot allocate command buffer, code = %i\n", result);
+                return 0;
+            }
+
+            VkFenceCreateInfo fenceInfo;
+            ZERO (fenceInfo);
+            fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+            result = vkCreateFence (ctx->device, &fenceInfo, NULL, &slot->fence);
+            if (result != VK_SUCCESS) {
+                fprintf (stderr, "Cannot create a fence, code = %i\n", result);
+                return 0;
+            }
+        }
+    }
+
+    struct an_staging *staging = ctx->staging;
+    size_t wanted = (size < STAGING_MAX_SLOT_SIZE) ? size : STAGING_MAX_SLOT_SIZE;
+    if (wanted <= staging->size) {
+        return 1;
+    }
+
+    /* Grow geometrically */
+    size_t newSize = 2 * staging->size;
+    if (newSize < STAGING_MIN_SLOT_SIZE) {
+        newSize = STAGING_MIN_SLOT_SIZE;
+    }
+    if (newSize < wanted) {
+        newSize = (wanted + STAGING_ALIGNMENT - 1) / STAGING_ALIGNMENT * STAGING_ALIGNMENT;
     }
+    if (newSize > STAGING_MAX_SLOT_SIZE) {
+        newSize = STAGING_MAX_SLOT_SIZE;
+    }
+
+    finish_all (ctx);
+    staging->size = 0;
+
+    for (int i = 0; i < STAGING_SLOTS; i++) {
+        struct staging_slot *slot = &staging->slots[i];
+        destroy_slot_memory (ctx, slot);
+
+        slot->memory =
+            an_create_buffer (ctx, VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                              VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                              VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                              VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                              newSize);
+        if (slot->memory == NULL) {
+            fprintf (stderr, "Cannot create staging buffer\n");
+            return 0;
+        }
+
+        slot->ptr = slot->memory->mapped;
+    }
+
+    staging->size = newSize;
+    return 1;
+}
+
+/* Get the next slot of the ring, waiting for its previous copy */
+static struct staging_slot*
+acquire_slot (struct an_gpu_context *ctx) {
+    struct an_staging *staging = ctx->staging;
+    struct staging_slot *slot = &staging->slots[staging->next];
+
+    staging->next = (staging->next + 1) % STAGING_SLOTS;
+    finish_slot (ctx, slot);
 
+    return slot;
+}
+
+static void
+submit_copy (struct an_gpu_context *ctx, VkCommandBuffer commandBuffer, VkFence fence,
+             VkBuffer source, VkDeviceSize srcOffset,
+             VkBuffer destination, VkDeviceSize dstOffset,
+             VkDeviceSize size, int toHost) {
     VkCommandBufferBeginInfo beginInfo;
     ZERO(beginInfo);
     beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
     beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 
-    vkBeginCommandBuffer(commandBuffer, &beginInfo);
+    vkResetCommandBuffer (commandBuffer, 0);
+    vkBeginCommandBuffer (commandBuffer, &beginInfo);
+
+    /* Wait for compute shaders and copies submitted before */
+    VkMemoryBarrier memoryBarrier;
+    ZERO (memoryBarrier);
+    memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+    memoryBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+    vkCmdPipelineBarrier (commandBuffer,
+                          VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                          VK_PIPELINE_STAGE_TRANSFER_BIT,
+                          VK_PIPELINE_STAGE_TRANSFER_BIT,
+                          0, 1, &memoryBarrier, 0, NULL, 0, NULL);
+
     VkBufferCopy copyRegion;
     ZERO(copyRegion);
-    copyRegion.srcOffset = 0; // Optional
-    copyRegion.dstOffset = 0; // Optional
+    copyRegion.srcOffset = srcOffset;
+    copyRegion.dstOffset = dstOffset;
     copyRegion.size = size;
-    vkCmdCopyBuffer(commandBuffer, source, destination, 1, &copyRegion);
+    vkCmdCopyBuffer (commandBuffer, source, destination, 1, &copyRegion);
+
+    if (toHost) {
+        ZERO (memoryBarrier);
+        memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        memoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        memoryBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+        vkCmdPipelineBarrier (commandBuffer,
+                              VK_PIPELINE_STAGE_TRANSFER_BIT,
+                              VK_PIPELINE_STAGE_HOST_BIT,
+                              0, 1, &memoryBarrier, 0, NULL, 0, NULL);
+    }
+
     vkEndCommandBuffer (commandBuffer);
 
     VkSubmitInfo submitInfo;
@@ -111,93 +294,115 @@ copy_buffer (struct an_gpu_context *ctx, VkBuffer source, VkBuffer destination,
     submitInfo.commandBufferCount = 1;
     submitInfo.pCommandBuffers = &commandBuffer;
 
-    vkQueueSubmit(ctx->queue, 1, &submitInfo, VK_NULL_HANDLE);
-    vkQueueWaitIdle(ctx->queue);
-    vkFreeCommandBuffers(ctx->device, ctx->cmdPool, 1, &commandBuffer);
-
-    return 1;
+    an_stats_count (ctx, STATS_SUBMITS, 1);
+    double start = an_stats_start (ctx);
+    vkQueueSubmit (ctx->queue, 1, &submitInfo, fence);
+    an_stats_time (ctx, AN_STAGE_SUBMIT, start);
 }
 
+/*
+ * Transfers with callbacks. FILL is called to put SIZE bytes at
+ * OFFSET of the transfer straight into the mapped staging memory,
+ * DRAIN to take them out of it. Chunks split at multiples of the slot
+ * size, which is a multiple of STAGING_ALIGNMENT bytes, so they never
+ * split an element of a float or a complex array.
+ */
 int
-an_write_data (struct an_gpu_context *ctx, struct an_image_memory *imageMemory,
-               const void *data, size_t size) {
-    int code = 1;
-    void *ptr;
-    VkResult result;
-
-    struct an_image_memory *tmp =
-        an_create_buffer (ctx, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                          size);
-    if (tmp == NULL) {
-        fprintf (stderr, "Cannot create staging buffer\n");
-        code = 0;
-        goto cleanup;
+an_write_data_with (struct an_gpu_context *ctx, struct an_image_memory *imageMemory,
+                    size_t size, an_fill_fn fill, void *arg) {
+    if (!ensure_staging (ctx, size)) {
+        fprintf (stderr, "Cannot create staging buffers\n");
+        return 0;
     }
 
-    result = vkMapMemory (ctx->device, tmp->memory, 0, size, 0, &ptr);
-    if (result != VK_SUCCESS) {
-        fprintf (stderr, "Cannot map memory\n");
-        code = 0;
-        goto cleanup;
+    an_stats_count (ctx, STATS_BYTES_UPLOADED, size);
+    double traceStart = an_trace_begin (ctx);
+    size_t chunkSize = ctx->staging->size;
+    for (size_t offset = 0; offset < size; offset += chunkSize) {
+        size_t chunk = (size - offset < chunkSize) ? size - offset : chunkSize;
+        struct staging_slot *slot = acquire_slot (ctx);
+
+        fill (slot->ptr, offset, chunk, arg);
+        submit_copy (ctx, slot->commandBuffer, slot->fence,
+                     slot->memory->buffer, 0, imageMemory->buffer, offset,
+                     chunk, 0);
+        slot->pending = 1;
     }
 
-    memcpy(ptr, data, size);
-    vkUnmapMemory (ctx->device, tmp->memory);
+    finish_all (ctx);
+    an_trace_end (ctx, "an_write_data", traceStart);
+    return 1;
+}
 
-    if (!copy_buffer (ctx, tmp->buffer, imageMemory->buffer, size)) {
-        fprintf (stderr, "Cannot copy data from staging buffer\n");
-        code = 0;
-        goto cleanup;
+int
+an_read_data_with (struct an_gpu_context *ctx, struct an_image_memory *imageMemory,
+                   size_t size, an_drain_fn drain, void *arg) {
+    if (!ensure_staging (ctx, size)) {
+        fprintf (stderr, "Cannot create staging buffers\n");
+        return 0;
     }
 
-cleanup:
-    if (tmp != NULL) {
-        an_destroy_buffer (ctx, tmp);
+    an_stats_count (ctx, STATS_BYTES_DOWNLOADED, size);
+    double traceStart = an_trace_begin (ctx);
+    size_t chunkSize = ctx->staging->size;
+    for (size_t offset = 0; offset < size; offset += chunkSize) {
+        size_t chunk = (size - offset < chunkSize) ? size - offset : chunkSize;
+        /* Drains the previous chunk read to this slot */
+        struct staging_slot *slot = acquire_slot (ctx);
+
+        submit_copy (ctx, slot->commandBuffer, slot->fence,
+                     imageMemory->buffer, offset, slot->memory->buffer, 0,
+                     chunk, 1);
+        slot->pending = 1;
+        slot->drain = drain;
+        slot->drainArg = arg;
+        slot->readOffset = offset;
+        slot->readSize = chunk;
     }
 
-    return code;
+    finish_all (ctx);
+    an_trace_end (ctx, "an_read_data", traceStart);
+    return 1;
+}
+
+static void
+fill_copy (void *staging, size_t offset, size_t size, void *arg) {
+    memcpy (staging, (const char*)arg + offset, size);
+}
+
+static void
+drain_copy (const void *staging, size_t offset, size_t size, void *arg) {
+    memcpy ((char*)arg + offset, staging, size);
+}
+
+int
+an_write_data (struct an_gpu_context *ctx, struct an_image_memory *imageMemory,
+               const void *data, size_t size) {
+    return an_write_data_with (ctx, imageMemory, size, fill_copy, (void*)data);
 }
 
 int
 an_read_data (struct an_gpu_context *ctx, struct an_image_memory *imageMemory,
               void *data, size_t size) {
-    int code = 1;
-    void *ptr;
-    VkResult result;
-
-    struct an_image_memory *tmp =
-        an_create_buffer (ctx, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-                          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                          size);
-    if (tmp == NULL) {
-        fprintf (stderr, "Cannot create staging buffer\n");
-        code = 0;
-        goto cleanup;
-    }
-
-    if (!copy_buffer (ctx, imageMemory->buffer, tmp->buffer, size)) {
-        fprintf (stderr, "Cannot copy data to staging buffer\n");
-        code = 0;
-        goto cleanup;
-    }
+    return an_read_data_with (ctx, imageMemory, size, drain_copy, data);
+}
 
-    result = vkMapMemory (ctx->device, tmp->memory, 0, size, 0, &ptr);
-    if (result != VK_SUCCESS) {
-        fprintf (stderr, "Cannot map memory\n");
-        code = 0;
-        goto cleanup;
+int
+an_copy_data (struct an_gpu_context *ctx,
+              struct an_image_memory *source, size_t srcOffset,
+              struct an_image_memory *destination, size_t dstOffset,
+              size_t size) {
+    if (!ensure_staging (ctx, 0)) {
+        fprintf (stderr, "Cannot create staging buffers\n");
+        return 0;
     }
 
-    memcpy(data, ptr, size);
-    vkUnmapMemory (ctx->device, tmp->memory);
-
-cleanup:
-    if (tmp != NULL) {
-        an_destroy_buffer (ctx, tmp);
-    }
+    struct staging_slot *slot = acquire_slot (ctx);
+    submit_copy (ctx, slot->commandBuffer, slot->fence,
+                 source->buffer, srcOffset, destination->buffer, dstOffset,
+                 size, 0);
+    slot->pending = 1;
+    finish_slot (ctx, slot);
 
-    return code;
+    return 1;
 }
@@ -6,9 +6,9 @@
 #include <assert.h>
 #include <vulkan/vulkan.h>
 
-#include <shader-source.h>
 #include "annealing-lowlevel.h"
 #include "internal.h"
+#include "embedded-shaders.h"
 
 const unsigned int update_group_sizes[] = {
     64,  1, 1,
@@ -38,6 +38,27 @@ hasValidationLayer () {
     return result;
 }
 
+static int
+hasDeviceExtension (VkPhysicalDevice physDev, const char *name) {
+    int result = 0;
+    uint32_t extensionCount;
+    vkEnumerateDeviceExtensionProperties (physDev, NULL, &extensionCount, NULL);
+
+    VkExtensionProperties *extensions =
+        malloc (sizeof (VkExtensionProperties) * extensionCount);
+    vkEnumerateDeviceExtensionProperties (physDev, NULL, &extensionCount, extensions);
+
+    for (int i=0; i<extensionCount; i++) {
+        if (strcmp (name, extensions[i].extensionName) == 0) {
+            result = 1;
+            break;
+        }
+    }
+
+    free (extensions);
+    return result;
+}
+
 static VkResult
 create_command_pool (struct an_gpu_context *ctx) {
     assert (ctx->device != VK_NULL_HANDLE);
@@ -51,38 +72,79 @@ create_command_pool (struct an_gpu_context *ctx) {
     return vkCreateCommandPool(ctx->device, &poolCmdInfo, NULL, &ctx->cmdPool);
 }
 
+/*
+ * Descriptor sets are allocated from a chain of pools. When all pools
+ * are full, a new one twice as large as the last one is added.
+ */
 static VkResult
-create_descriptor_pool (struct an_gpu_context *ctx) {
+add_descriptor_pool (struct an_gpu_context *ctx) {
     assert (ctx->device != VK_NULL_HANDLE);
 
+    uint32_t nsets = (ctx->nDescPools == 0) ? DESCRIPTOR_SETS_IN_POOL :
+        2 * ctx->descPoolSets;
+    if (nsets > MAX_DESCRIPTOR_SETS_IN_POOL) {
+        nsets = MAX_DESCRIPTOR_SETS_IN_POOL;
+    }
+
     VkDescriptorPoolSize poolSizes[2];
     memset (poolSizes, 0, sizeof (poolSizes));
     poolSizes[0].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-    poolSizes[0].descriptorCount = DESCRIPTORS_IN_POOL;
+    poolSizes[0].descriptorCount = nsets * MAX_STORAGE_BUFFERS_IN_SET;
     poolSizes[1].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    poolSizes[1].descriptorCount = DESCRIPTORS_IN_POOL;
+    poolSizes[1].descriptorCount = nsets;
 
     VkDescriptorPoolCreateInfo poolInfo;
     ZERO(poolInfo);
     poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
     poolInfo.poolSizeCount = 2;
     poolInfo.pPoolSizes = poolSizes;
-    poolInfo.maxSets = DESCRIPTORS_IN_POOL;
+    poolInfo.maxSets = nsets;
     poolInfo.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
 
-    return vkCreateDescriptorPool(ctx->device, &poolInfo, NULL, &ctx->descPool);
+    VkDescriptorPool pool;
+    VkResult result = vkCreateDescriptorPool(ctx->device, &poolInfo, NULL, &pool);
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+
+    ctx->descPools = realloc (ctx->descPools,
+                              sizeof (VkDescriptorPool) * (ctx->nDescPools + 1));
+    ctx->descPools[ctx->nDescPools++] = pool;
+    ctx->descPoolSets = nsets;
+
+    return VK_SUCCESS;
 }
 
-static VkResult
-create_pipelines (struct an_gpu_context *ctx) {
-    /* TODO: Good idea to check pipeline structures */
-    assert (ctx->ndim > 0 && ctx->ndim <= MAX_DIMENSIONS &&
+/* Pipelines which depend on the number of dimensions (through work group size) */
+static const int pipeline_specialized[PIPELINE_COUNT] = {
+    [PIPELINE_CFUPDATE]         = 1,
+    [PIPELINE_CFUPDATE_BATCH]   = 1,
+    [PIPELINE_CFUPDATE_SUBSET]  = 0,
+    [PIPELINE_CFUPDATE_TRACKED] = 1,
+    [PIPELINE_METRIC]           = 0,
+    [PIPELINE_METRIC_MOVE]      = 1,
+    [PIPELINE_METRIC_MULTI]     = 0,
+    [PIPELINE_REPLICAS_UPDATE]  = 0,
+    [PIPELINE_FFT_RADIX2]       = 0,
+    [PIPELINE_FFT_RADIX3]       = 0,
+    [PIPELINE_FFT_RADIX4]       = 0,
+    [PIPELINE_FFT_RADIX5]       = 0,
+    [PIPELINE_FFT_REAL]         = 0
+};
+
+VkPipeline
+an_get_pipeline (struct an_gpu_context *ctx, enum pipeline_type type, unsigned int ndim) {
+    struct pipeline *pipeline = ctx->pipelines[type];
+    return pipeline->variants[pipeline_specialized[type] ? ndim - 1 : 0];
+}
+
+/* Create all pipelines for NDIM dimensions which are not created yet */
+VkResult
+an_prepare_pipelines (struct an_gpu_context *ctx, unsigned int ndim) {
+    assert (ndim > 0 && ndim <= MAX_DIMENSIONS &&
             ctx->device != VK_NULL_HANDLE &&
             ctx->cache != VK_NULL_HANDLE);
 
-    VkSpecializationInfo specInfos[PIPELINE_COUNT];
-    memset (specInfos, 0, sizeof (specInfos));
-
     VkSpecializationMapEntry specEntry[MAX_DIMENSIONS];
     for (int i = 0; i < MAX_DIMENSIONS; i++) {
         specEntry[i].constantID = i;
@@ -90,75 +152,89 @@ create_pipelines (struct an_gpu_context *ctx) {
         specEntry[i].size = sizeof(int);
     }
 
-    const unsigned int *groupSize = &update_group_sizes[MAX_DIMENSIONS * (ctx->ndim - 1)];
-    specInfos[PIPELINE_CFUPDATE].mapEntryCount = 3;
-    specInfos[PIPELINE_CFUPDATE].pMapEntries = specEntry;
-    specInfos[PIPELINE_CFUPDATE].dataSize = 3 * sizeof(int);
-    specInfos[PIPELINE_CFUPDATE].pData = groupSize;
+    VkSpecializationInfo specInfo;
+    ZERO (specInfo);
+    specInfo.mapEntryCount = 3;
+    specInfo.pMapEntries = specEntry;
+    specInfo.dataSize = 3 * sizeof(int);
+    specInfo.pData = &update_group_sizes[MAX_DIMENSIONS * (ndim - 1)];
 
-    VkPipelineShaderStageCreateInfo stageInfos[PIPELINE_COUNT];
-    memset (stageInfos, 0, sizeof (stageInfos));
-    for (int i = 0; i < PIPELINE_COUNT; i++) {
-        stageInfos[i].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-        stageInfos[i].stage = VK_SHADER_STAGE_COMPUTE_BIT;
-        stageInfos[i].module = ctx->pipelines[i]->shader;
-        stageInfos[i].pName = "main";
-        stageInfos[i].pSpecializationInfo = &specInfos[i];
-    }
+    VkSpecializationInfo noSpecInfo;
+    ZERO (noSpecInfo);
 
     VkComputePipelineCreateInfo pipelineInfos[PIPELINE_COUNT];
+    VkPipeline *targets[PIPELINE_COUNT];
     memset (pipelineInfos, 0, sizeof (pipelineInfos));
+    uint32_t count = 0;
+
     for (int i = 0; i < PIPELINE_COUNT; i++) {
-        pipelineInfos[i].sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
-        pipelineInfos[i].stage = stageInfos[i];
-        pipelineInfos[i].layout = ctx->pipelines[i]->pipelineLayout;
+        struct pipeline *pipeline = ctx->pipelines[i];
+        VkPipeline *target = &pipeline->variants[pipeline_specialized[i] ? ndim - 1 : 0];
+        if (*target != VK_NULL_HANDLE) {
+            continue;
+        }
+
+        VkPipelineShaderStageCreateInfo *stageInfo = &pipelineInfos[count].stage;
+        stageInfo->sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        stageInfo->stage = VK_SHADER_STAGE_COMPUTE_BIT;
+        stageInfo->module = pipeline->shader;
+        stageInfo->pName = "main";
+        stageInfo->pSpecializationInfo = pipeline_specialized[i] ? &specInfo : &noSpecInfo;
+
+        pipelineInfos[count].sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+        pipelineInfos[count].layout = pipeline->pipelineLayout;
+        targets[count] = target;
+        count++;
+    }
+
+    if (count == 0) {
+        return VK_SUCCESS;
     }
 
     VkPipeline ps[PIPELINE_COUNT];
     VkResult result;
-    result = vkCreateComputePipelines (ctx->device, ctx->cache, 3, pipelineInfos, NULL, ps);
+    result = vkCreateComputePipelines (ctx->device, ctx->cache, count,
+                                       pipelineInfos, NULL, ps);
 
-    for (int i = 0; i < PIPELINE_COUNT; i++) {
-        ctx->pipelines[i]->pipeline = ps[i];
+    for (uint32_t i = 0; i < count; i++) {
+        *targets[i] = (result == VK_SUCCESS) ? ps[i] : VK_NULL_HANDLE;
     }
 
     return result;
 }
 
 static VkResult
-load_shader (VkDevice device, const char *source, VkShaderModule *shaderModule) {
-    FILE *stream = fopen (source, "rb");
-    if (stream == NULL) {
-        fprintf (stderr, "Cannot open a shader\n");
-        return 0;
-    }
+load_shader (VkDevice device, const char *name, VkShaderModule *shaderModule) {
+    const struct an_embedded_shader *shader;
 
-    long size;
-    fseek (stream, 0, SEEK_END);
-    size = ftell (stream);
-    fseek (stream, 0, SEEK_SET);
+    for (shader = an_embedded_shaders; shader->name != NULL; shader++) {
+        if (strcmp (shader->name, name) == 0) {
+            break;
+        }
+    }
 
-    void *code = malloc (size);
-    fread (code, size, 1, stream);
-    fclose (stream);
+    if (shader->name == NULL) {
+        fprintf (stderr, "Cannot find shader %s\n", name);
+        return VK_ERROR_INITIALIZATION_FAILED;
+    }
 
     VkShaderModuleCreateInfo createInfo;
     ZERO (createInfo);
     createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-    createInfo.codeSize = size;
-    createInfo.pCode = code;
+    createInfo.codeSize = shader->size;
+    createInfo.pCode = (const uint32_t*)shader->code;
 
-    VkResult result = vkCreateShaderModule(device, &createInfo, NULL, shaderModule);
-    free (code);
-    return result;
+    return vkCreateShaderModule(device, &createInfo, NULL, shaderModule);
 }
 
 static void
 pipeline_cleanup (struct an_gpu_context *ctx, struct pipeline *pipeline) {
-    assert (ctx->device != VK_NULL_HANDLE && ctx->descPool != VK_NULL_HANDLE);
+    assert (ctx->device != VK_NULL_HANDLE);
 
-    if (pipeline->pipeline != VK_NULL_HANDLE) {
-        vkDestroyPipeline (ctx->device, pipeline->pipeline, NULL);
+    for (int i = 0; i < MAX_DIMENSIONS; i++) {
+        if (pipeline->variants[i] != VK_NULL_HANDLE) {
+            vkDestroyPipeline (ctx->device, pipeline->variants[i], NULL);
+        }
     }
 
     if (pipeline->pipelineLayout != VK_NULL_HANDLE) {
@@ -179,32 +255,208 @@ pipeline_cleanup (struct an_gpu_context *ctx, struct pipeline *pipeline) {
 VkResult
 an_allocate_descriptor_set (struct an_gpu_context *ctx,
                             struct pipeline *pipeline,
+                            VkDescriptorPool *pool,
                             VkDescriptorSet *descriptorSet) {
-    assert (ctx->descPool != VK_NULL_HANDLE &&
-            pipeline->descriptorSetLayout != VK_NULL_HANDLE);
+    assert (pipeline->descriptorSetLayout != VK_NULL_HANDLE);
 
     VkDescriptorSetAllocateInfo allocateInfo;
     ZERO(allocateInfo);
     allocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-    allocateInfo.descriptorPool = ctx->descPool;
     allocateInfo.descriptorSetCount = 1;
     allocateInfo.pSetLayouts = &pipeline->descriptorSetLayout;
 
-    return vkAllocateDescriptorSets (ctx->device, &allocateInfo, descriptorSet);
+    VkResult result = VK_ERROR_OUT_OF_POOL_MEMORY;
+    /* The newest pool is the most likely to have free space */
+    for (int i = ctx->nDescPools - 1; i >= 0; i--) {
+        allocateInfo.descriptorPool = ctx->descPools[i];
+        result = vkAllocateDescriptorSets (ctx->device, &allocateInfo, descriptorSet);
+        if (result != VK_ERROR_OUT_OF_POOL_MEMORY &&
+            result != VK_ERROR_FRAGMENTED_POOL) {
+            break;
+        }
+    }
+
+    if (result == VK_ERROR_OUT_OF_POOL_MEMORY ||
+        result == VK_ERROR_FRAGMENTED_POOL) {
+        result = add_descriptor_pool (ctx);
+        if (result != VK_SUCCESS) {
+            return result;
+        }
+
+        allocateInfo.descriptorPool = ctx->descPools[ctx->nDescPools - 1];
+        result = vkAllocateDescriptorSets (ctx->device, &allocateInfo, descriptorSet);
+    }
+
+    if (result == VK_SUCCESS) {
+        *pool = allocateInfo.descriptorPool;
+    }
+
+    return result;
 }
 
-VkResult
-an_create_fence (struct an_gpu_context *ctx, VkFence *fence) {
-    VkFenceCreateInfo info;
-    ZERO (info);
-    info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+void
+an_free_descriptor_set (struct an_gpu_context *ctx,
+                        VkDescriptorPool pool,
+                        VkDescriptorSet *descriptorSet) {
+    if (*descriptorSet != VK_NULL_HANDLE) {
+        vkFreeDescriptorSets (ctx->device, pool, 1, descriptorSet);
+        *descriptorSet = VK_NULL_HANDLE;
+    }
+}
+
+void
+an_write_storage_descriptors (struct an_gpu_context        *ctx,
+                              VkDescriptorSet               set,
+                              struct an_image_memory *const *buffers,
+                              const size_t                 *sizes,
+                              unsigned int                  count) {
+    VkDescriptorBufferInfo *infos = malloc (sizeof (VkDescriptorBufferInfo) * count);
+    VkWriteDescriptorSet *dsSets = malloc (sizeof (VkWriteDescriptorSet) * count);
+    memset (infos, 0, sizeof (VkDescriptorBufferInfo) * count);
+    memset (dsSets, 0, sizeof (VkWriteDescriptorSet) * count);
+
+    for (unsigned int i = 0; i < count; i++) {
+        infos[i].buffer = buffers[i]->buffer;
+        infos[i].offset = 0;
+        infos[i].range = sizes[i];
+
+        dsSets[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        dsSets[i].dstSet = set;
+        dsSets[i].dstBinding = i; // binding #
+        dsSets[i].dstArrayElement = 0;
+        dsSets[i].descriptorCount = 1;
+        dsSets[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        dsSets[i].pBufferInfo = &infos[i];
+    }
+
+    vkUpdateDescriptorSets (ctx->device, count, dsSets, 0, NULL);
+    free (dsSets);
+    free (infos);
+}
+
+static VkResult
+create_submission_sync (struct an_gpu_context *ctx) {
+    assert (ctx->device != VK_NULL_HANDLE);
+
+    if (!ctx->hasTimeline) {
+        VkFenceCreateInfo info;
+        ZERO (info);
+        info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+
+        return vkCreateFence (ctx->device, &info, NULL, &ctx->submitFence);
+    }
+
+    VkSemaphoreTypeCreateInfo typeInfo;
+    ZERO(typeInfo);
+    typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    typeInfo.initialValue = 0;
+
+    VkSemaphoreCreateInfo info;
+    ZERO(info);
+    info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    info.pNext = &typeInfo;
+
+    return vkCreateSemaphore (ctx->device, &info, NULL, &ctx->timeline);
+}
+
+/*
+ * All submissions signal the next value of the context's timeline
+ * semaphore, which is returned as a ticket. Command buffers start
+ * with a barrier, so they are executed in the order of submission.
+ * Without timeline semaphores each submission is waited for
+ * immediately.
+ */
+uint64_t
+an_submit (struct an_gpu_context *ctx, VkCommandBuffer commandBuffer) {
+    uint64_t ticket = ++ctx->ticket;
+
+    /* With timestamps around it if it is timed */
+    VkCommandBuffer commandBuffers[3];
+    VkSubmitInfo submitInfo;
+    ZERO(submitInfo);
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount =
+        an_stats_submitted (ctx, commandBuffer, ticket, commandBuffers);
+    submitInfo.pCommandBuffers = commandBuffers;
+
+    an_stats_count (ctx, STATS_SUBMITS, 1);
+    double start = an_stats_start (ctx);
+    double traceStart = an_trace_begin (ctx);
+
+    if (!ctx->hasTimeline) {
+        vkQueueSubmit (ctx->queue, 1, &submitInfo, ctx->submitFence);
+        an_stats_time (ctx, AN_STAGE_SUBMIT, start);
+        an_trace_end (ctx, "vkQueueSubmit", traceStart);
+
+        start = an_stats_start (ctx);
+        traceStart = an_trace_begin (ctx);
+        vkWaitForFences (ctx->device, 1, &ctx->submitFence, VK_TRUE, -1);
+        vkResetFences (ctx->device, 1, &ctx->submitFence);
+        an_stats_count (ctx, STATS_WAITS, 1);
+        an_stats_time (ctx, AN_STAGE_WAIT, start);
+        an_trace_end (ctx, "wait", traceStart);
+
+        ctx->completed = ticket;
+        return ticket;
+    }
+
+    VkTimelineSemaphoreSubmitInfo timelineInfo;
+    ZERO(timelineInfo);
+    timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timelineInfo.signalSemaphoreValueCount = 1;
+    timelineInfo.pSignalSemaphoreValues = &ticket;
+
+    submitInfo.pNext = &timelineInfo;
+    submitInfo.signalSemaphoreCount = 1;
+    submitInfo.pSignalSemaphores = &ctx->timeline;
+
+    vkQueueSubmit (ctx->queue, 1, &submitInfo, VK_NULL_HANDLE);
+    an_stats_time (ctx, AN_STAGE_SUBMIT, start);
+    an_trace_end (ctx, "vkQueueSubmit", traceStart);
+    return ticket;
+}
+
+int
+an_ticket_completed (struct an_gpu_context *ctx, uint64_t ticket) {
+    if (ticket <= ctx->completed) {
+        return 1;
+    }
+
+    uint64_t value;
+    if (vkGetSemaphoreCounterValue (ctx->device, ctx->timeline, &value) == VK_SUCCESS) {
+        ctx->completed = value;
+    }
+
+    return ticket <= ctx->completed;
+}
+
+void
+an_wait_ticket (struct an_gpu_context *ctx, uint64_t ticket) {
+    if (ticket <= ctx->completed) {
+        return;
+    }
 
-    return vkCreateFence (ctx->device, &info, NULL, fence);
+    VkSemaphoreWaitInfo waitInfo;
+    ZERO(waitInfo);
+    waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    waitInfo.semaphoreCount = 1;
+    waitInfo.pSemaphores = &ctx->timeline;
+    waitInfo.pValues = &ticket;
+
+    an_stats_count (ctx, STATS_WAITS, 1);
+    double start = an_stats_start (ctx);
+    double traceStart = an_trace_begin (ctx);
+    if (vkWaitSemaphores (ctx->device, &waitInfo, -1) == VK_SUCCESS) {
+        ctx->completed = ticket;
+    }
+    an_stats_time (ctx, AN_STAGE_WAIT, start);
+    an_trace_end (ctx, "wait", traceStart);
 }
 
 /* Create VkPipelineLayout */
 static struct pipeline*
-create_pipeline_layout (struct an_gpu_context *ctx, const char *shaderPath,
+create_pipeline_layout (struct an_gpu_context *ctx, const char *shaderName,
                         unsigned int storageBuffers, unsigned int uniformBuffers,
                         size_t pushConstantsSize) {
     assert (ctx->device != VK_NULL_HANDLE);
@@ -213,7 +465,7 @@ create_pipeline_layout (struct an_gpu_context *ctx, const char *shaderPath,
     struct pipeline *pipeline = malloc (sizeof (struct pipeline));
     memset (pipeline, 0, sizeof (struct pipeline));
 
-    result = load_shader (ctx->device, shaderPath, &pipeline->shader);
+    result = load_shader (ctx->device, shaderName, &pipeline->shader);
     if (result != VK_SUCCESS) {
         fprintf (stderr, "Cannot create shader module, code = %i\n", result);
         goto cleanup;
@@ -282,25 +534,90 @@ cleanup:
 static int
 create_cfupdate_pipeline (struct an_gpu_context *ctx) {
     ctx->pipelines[PIPELINE_CFUPDATE] =
-        create_pipeline_layout (ctx, SHADER_SOURCE "update-s2.spv",
-                                1, 1, sizeof (struct CFUpdateDataConst));
+        create_pipeline_layout (ctx, "update-s2",
+                                2, 1, sizeof (struct CFUpdateDataConst));
     return ctx->pipelines[PIPELINE_CFUPDATE] != NULL;
 }
 
+static int
+create_cfupdate_batch_pipeline (struct an_gpu_context *ctx) {
+    ctx->pipelines[PIPELINE_CFUPDATE_BATCH] =
+        create_pipeline_layout (ctx, "update-s2-batch",
+                                3, 0, sizeof (struct CFUpdateDataConst));
+    return ctx->pipelines[PIPELINE_CFUPDATE_BATCH] != NULL;
+}
+
+static int
+create_cfupdate_subset_pipeline (struct an_gpu_context *ctx) {
+    ctx->pipelines[PIPELINE_CFUPDATE_SUBSET] =
+        create_pipeline_layout (ctx, "update-s2-subset",
+                                4, 0, sizeof (struct SubsetUpdateData));
+    return ctx->pipelines[PIPELINE_CFUPDATE_SUBSET] != NULL;
+}
+
+/* Shaders which reduce with subgroup operations when they are supported */
+#define REDUCING_SHADER(ctx, name)                                      \
+    ((ctx)->hasSubgroups ? name "-subgroup" : name)
+
+static int
+create_cfupdate_tracked_pipeline (struct an_gpu_context *ctx) {
+    ctx->pipelines[PIPELINE_CFUPDATE_TRACKED] =
+        create_pipeline_layout (ctx, REDUCING_SHADER (ctx, "update-s2-tracked"),
+                                7, 0, sizeof (struct CFUpdateReduceData));
+    return ctx->pipelines[PIPELINE_CFUPDATE_TRACKED] != NULL;
+}
+
 static int
 create_metric_pipeline (struct an_gpu_context *ctx) {
     ctx->pipelines[PIPELINE_METRIC] =
-        create_pipeline_layout (ctx, SHADER_SOURCE "metric.spv",
-                                3, 0, sizeof (struct MetricUpdateData));
+        create_pipeline_layout (ctx, REDUCING_SHADER (ctx, "metric"),
+                                5, 0, sizeof (struct MetricUpdateData));
     return ctx->pipelines[PIPELINE_METRIC] != NULL;
 }
 
 static int
-create_reduce_pipeline (struct an_gpu_context *ctx) {
-    ctx->pipelines[PIPELINE_REDUCE] =
-        create_pipeline_layout (ctx, SHADER_SOURCE "reduce.spv",
-                                2, 0, sizeof (struct MetricUpdateData));
-    return ctx->pipelines[PIPELINE_REDUCE] != NULL;
+create_metric_move_pipeline (struct an_gpu_context *ctx) {
+    ctx->pipelines[PIPELINE_METRIC_MOVE] =
+        create_pipeline_layout (ctx, REDUCING_SHADER (ctx, "metric-move"),
+                                7, 0, sizeof (struct CFUpdateReduceData));
+    return ctx->pipelines[PIPELINE_METRIC_MOVE] != NULL;
+}
+
+static int
+create_metric_multi_pipeline (struct an_gpu_context *ctx) {
+    ctx->pipelines[PIPELINE_METRIC_MULTI] =
+        create_pipeline_layout (ctx, REDUCING_SHADER (ctx, "metric-multi"),
+                                6, 0, sizeof (struct MultiMetricData));
+    return ctx->pipelines[PIPELINE_METRIC_MULTI] != NULL;
+}
+
+static int
+create_replicas_update_pipeline (struct an_gpu_context *ctx) {
+    ctx->pipelines[PIPELINE_REPLICAS_UPDATE] =
+        create_pipeline_layout (ctx, "replicas-update",
+                                4, 0, sizeof (struct ReplicasUpdateData));
+    return ctx->pipelines[PIPELINE_REPLICAS_UPDATE] != NULL;
+}
+
+static int
+create_fft_pipelines (struct an_gpu_context *ctx) {
+    static const char *radixShaders[] = {
+        "fft-radix2", "fft-radix3", "fft-radix4", "fft-radix5"
+    };
+
+    for (int i = 0; i < 4; i++) {
+        ctx->pipelines[PIPELINE_FFT_RADIX2 + i] =
+            create_pipeline_layout (ctx, radixShaders[i],
+                                    3, 0, sizeof (struct FFTStageData));
+        if (ctx->pipelines[PIPELINE_FFT_RADIX2 + i] == NULL) {
+            return 0;
+        }
+    }
+
+    ctx->pipelines[PIPELINE_FFT_REAL] =
+        create_pipeline_layout (ctx, "fft-real",
+                                3, 0, sizeof (struct FFTRealData));
+    return ctx->pipelines[PIPELINE_FFT_REAL] != NULL;
 }
 
 static int
@@ -356,6 +673,11 @@ find_device (struct an_gpu_context *ctx) {
     }
 
     free (devices);
+
+    if (ctx->physDev != VK_NULL_HANDLE) {
+        vkGetPhysicalDeviceMemoryProperties (ctx->physDev, &ctx->memProperties);
+    }
+
     return ctx->physDev != VK_NULL_HANDLE;
 }
 
@@ -373,7 +695,23 @@ create_instance (struct an_gpu_context *ctx, int enableValidation) {
     appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
     appInfo.pEngineName = "No Engine";
     appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-    appInfo.apiVersion = VK_API_VERSION_1_0;
+    /*
+     * Subgroup operations are in the core since Vulkan 1.1, timeline
+     * semaphores since Vulkan 1.2
+     */
+    uint32_t version = VK_API_VERSION_1_0;
+    if (vkEnumerateInstanceVersion (&version) != VK_SUCCESS) {
+        version = VK_API_VERSION_1_0;
+    }
+
+    if (version >= VK_API_VERSION_1_2) {
+        ctx->apiVersion = VK_API_VERSION_1_2;
+    } else if (version >= VK_API_VERSION_1_1) {
+        ctx->apiVersion = VK_API_VERSION_1_1;
+    } else {
+        ctx->apiVersion = VK_API_VERSION_1_0;
+    }
+    appInfo.apiVersion = ctx->apiVersion;
 
     VkInstanceCreateInfo createInfo;
     ZERO(createInfo);
@@ -400,32 +738,87 @@ create_device (struct an_gpu_context *ctx) {
     VkPhysicalDeviceFeatures deviceFeatures;
     ZERO(deviceFeatures);
 
+    VkPhysicalDeviceTimelineSemaphoreFeatures timelineFeatures;
+    ZERO(timelineFeatures);
+    timelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties (ctx->physDev, &properties);
+    if (ctx->apiVersion >= VK_API_VERSION_1_1 &&
+        properties.apiVersion >= VK_API_VERSION_1_1) {
+        VkPhysicalDeviceSubgroupProperties subgroupProperties;
+        ZERO(subgroupProperties);
+        subgroupProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES;
+
+        VkPhysicalDeviceProperties2 properties2;
+        ZERO(properties2);
+        properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+        properties2.pNext = &subgroupProperties;
+        vkGetPhysicalDeviceProperties2 (ctx->physDev, &properties2);
+
+        VkSubgroupFeatureFlags needed =
+            VK_SUBGROUP_FEATURE_BASIC_BIT | VK_SUBGROUP_FEATURE_ARITHMETIC_BIT;
+        ctx->hasSubgroups =
+            (subgroupProperties.supportedStages & VK_SHADER_STAGE_COMPUTE_BIT) &&
+            (subgroupProperties.supportedOperations & needed) == needed;
+    }
+
+    if (ctx->apiVersion >= VK_API_VERSION_1_2 &&
+        properties.apiVersion >= VK_API_VERSION_1_2) {
+        VkPhysicalDeviceFeatures2 features2;
+        ZERO(features2);
+        features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        features2.pNext = &timelineFeatures;
+        vkGetPhysicalDeviceFeatures2 (ctx->physDev, &features2);
+        ctx->hasTimeline = timelineFeatures.timelineSemaphore;
+    }
+
+    /* Used to line up device timestamps with the host in traces */
+    const char *calibrated = VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME;
+    ctx->hasCalibratedTimestamps = hasDeviceExtension (ctx->physDev, calibrated);
+
     VkDeviceCreateInfo createDevInfo;
     ZERO(createDevInfo);
     createDevInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+    if (ctx->hasTimeline) {
+        timelineFeatures.pNext = NULL;
+        createDevInfo.pNext = &timelineFeatures;
+    }
     createDevInfo.pQueueCreateInfos = &queueCreateInfo;
     createDevInfo.queueCreateInfoCount = 1;
     createDevInfo.pEnabledFeatures = &deviceFeatures;
+    createDevInfo.enabledExtensionCount = ctx->hasCalibratedTimestamps ? 1 : 0;
+    createDevInfo.ppEnabledExtensionNames = ctx->hasCalibratedTimestamps ? &calibrated : NULL;
 
     return vkCreateDevice(ctx->physDev, &createDevInfo, NULL, &ctx->device);
 }
 
-static VkResult
-create_pipeline_cache (struct an_gpu_context *ctx) {
-    assert (ctx->device != VK_NULL_HANDLE);
-
-    VkPipelineCacheCreateInfo cacheInfo;
-    ZERO(cacheInfo);
-    cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
-    return vkCreatePipelineCache (ctx->device, &cacheInfo, NULL, &ctx->cache);
+struct an_gpu_context* an_create_context(unsigned int ndim, int validation) {
+    return an_create_context_with_backend (ndim, AN_BACKEND_VULKAN, validation);
 }
 
-struct an_gpu_context* an_create_context(unsigned int ndim, int validation) {
+struct an_gpu_context*
+an_create_context_with_backend (unsigned int    ndim,
+                                enum an_backend backend,
+                                int             validation) {
+    if (ndim > MAX_DIMENSIONS) {
+        fprintf (stderr, "Too many dimensions\n");
+        return NULL;
+    }
+
     VkResult result;
     struct an_gpu_context *ctx = malloc (sizeof (struct an_gpu_context));
     memset (ctx, 0, sizeof (struct an_gpu_context));
+    ctx->backend = backend;
+
+    if (backend == AN_BACKEND_CPU) {
+        if (!an_cpu_create_context (ctx)) {
+            fprintf (stderr, "Cannot create CPU context\n");
+            goto cleanup;
+        }
 
-    ctx->ndim = ndim;
+        return ctx;
+    }
 
     /* Create an instance */
     result = create_instance (ctx, validation);
@@ -454,13 +847,13 @@ struct an_gpu_context* an_create_context(unsigned int ndim, int validation) {
     }
 
     /* Create pipeline cache */
-    result = create_pipeline_cache (ctx);
+    result = an_create_pipeline_cache (ctx);
     if (result != VK_SUCCESS) {
         fprintf (stderr, "Cannot create pipeline cache, code = %i\n", result);
     }
 
-    /* Create descriptor pool */
-    result = create_descriptor_pool (ctx);
+    /* Create the first descriptor pool */
+    result = add_descriptor_pool (ctx);
     if (result != VK_SUCCESS) {
         fprintf (stderr, "Cannot descriptor pool, code = %i\n", result);
         goto cleanup;
@@ -472,25 +865,66 @@ struct an_gpu_context* an_create_context(unsigned int ndim, int validation) {
         goto cleanup;
     }
 
+    /* Create pipeline layout for batched updates */
+    if (!create_cfupdate_batch_pipeline (ctx)) {
+        fprintf (stderr, "Cannot create batched cf updating pipeline layout\n");
+        goto cleanup;
+    }
+
+    /* Create pipeline layout for updates of frequency subsets */
+    if (!create_cfupdate_subset_pipeline (ctx)) {
+        fprintf (stderr, "Cannot create subset cf updating pipeline layout\n");
+        goto cleanup;
+    }
+
+    /* Create pipeline layout for updates which also track the distance */
+    if (!create_cfupdate_tracked_pipeline (ctx)) {
+        fprintf (stderr, "Cannot create tracked cf updating pipeline layout\n");
+        goto cleanup;
+    }
+
     /* Create pipeline layout for calculation difference with the original */
     if (!create_metric_pipeline (ctx)) {
         fprintf (stderr, "Cannot create metric pipeline layout\n");
         goto cleanup;
     }
 
-    /* Create pipeline layout for reduction */
-    if (!create_reduce_pipeline (ctx)) {
-        fprintf (stderr, "Cannot create reduction pipeline layout\n");
+    /* Create pipeline layout for evaluation of speculative moves */
+    if (!create_metric_move_pipeline (ctx)) {
+        fprintf (stderr, "Cannot create move evaluation pipeline layout\n");
         goto cleanup;
     }
 
-    /* Create pipelines */
-    result = create_pipelines (ctx);
-    if (result != VK_SUCCESS) {
-        fprintf (stderr, "Cannot create pipelines, code = %i\n", result);
+    /* Create pipeline layout for metrics with several targets */
+    if (!create_metric_multi_pipeline (ctx)) {
+        fprintf (stderr, "Cannot create multi-target metric pipeline layout\n");
+        goto cleanup;
+    }
+
+    /* Create pipeline layout for updates of replica sets */
+    if (!create_replicas_update_pipeline (ctx)) {
+        fprintf (stderr, "Cannot create replicas updating pipeline layout\n");
         goto cleanup;
     }
 
+    /* Create pipeline layouts for FFT stages */
+    if (!create_fft_pipelines (ctx)) {
+        fprintf (stderr, "Cannot create FFT pipeline layouts\n");
+        goto cleanup;
+    }
+
+    /*
+     * Pipelines for other numbers of dimensions are created when the
+     * first image with that number of dimensions is created.
+     */
+    if (ndim > 0) {
+        result = an_prepare_pipelines (ctx, ndim);
+        if (result != VK_SUCCESS) {
+            fprintf (stderr, "Cannot create pipelines, code = %i\n", result);
+            goto cleanup;
+        }
+    }
+
     /* Get queue */
     vkGetDeviceQueue (ctx->device, ctx->queueFamilyID, 0, &ctx->queue);
 
@@ -501,6 +935,13 @@ struct an_gpu_context* an_create_context(unsigned int ndim, int validation) {
         goto cleanup;
     }
 
+    /* Create a timeline semaphore (or a fence) for submissions */
+    result = create_submission_sync (ctx);
+    if (result != VK_SUCCESS) {
+        fprintf (stderr, "Cannot create synchronization primitive, code = %i\n", result);
+        goto cleanup;
+    }
+
     return ctx;
 
 cleanup:
@@ -509,6 +950,25 @@ cleanup:
 }
 
 void an_destroy_context (struct an_gpu_context *ctx) {
+    an_cpu_destroy_context (ctx);
+
+    if (ctx->queue != VK_NULL_HANDLE) {
+        vkQueueWaitIdle (ctx->queue);
+    }
+
+    an_destroy_staging (ctx);
+    an_trace_destroy (ctx);
+    an_stats_destroy (ctx);
+    an_destroy_allocator (ctx);
+
+    if (ctx->timeline != VK_NULL_HANDLE) {
+        vkDestroySemaphore (ctx->device, ctx->timeline, NULL);
+    }
+
+    if (ctx->submitFence != VK_NULL_HANDLE) {
+        vkDestroyFence (ctx->device, ctx->submitFence, NULL);
+    }
+
     if (ctx->cmdPool != VK_NULL_HANDLE) {
         vkDestroyCommandPool (ctx->device, ctx->cmdPool, NULL);
     }
@@ -519,11 +979,13 @@ void an_destroy_context (struct an_gpu_context *ctx) {
         }
     }
 
-    if (ctx->descPool != VK_NULL_HANDLE) {
-        vkDestroyDescriptorPool (ctx->device, ctx->descPool, NULL);
+    for (int i = 0; i < ctx->nDescPools; i++) {
+        vkDestroyDescriptorPool (ctx->device, ctx->descPools[i], NULL);
     }
+    free (ctx->descPools);
 
     if (ctx->cache != VK_NULL_HANDLE) {
+        an_save_pipeline_cache (ctx);
         vkDestroyPipelineCache (ctx->device, ctx->cache, NULL);
     }
 
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 #include <vulkan/vulkan.h>
 
 #include "annealing-lowlevel.h"
@@ -15,16 +16,147 @@ an_destroy_corrfn (struct an_corrfn *image) {
         an_destroy_buffer (ctx, image->corrfnMemory);
     }
 
+    free (image->cpuData);
     free (image);
 }
 
+/* Conversions with rounding to nearest even */
+static uint16_t
+float_to_half (float value) {
+    uint32_t x;
+    memcpy (&x, &value, sizeof (x));
+
+    uint16_t sign = (x >> 16) & 0x8000;
+    uint32_t absx = x & 0x7fffffff;
+    uint32_t h, rem, halfway;
+
+    if (absx > 0x7f800000) {
+        /* NaN */
+        return sign | 0x7e00;
+    } else if (absx >= 0x477ff000) {
+        /* Rounds to 65536 or more */
+        return sign | 0x7c00;
+    } else if (absx < 0x33000000) {
+        /* Less than or equal to a half of the smallest subnormal */
+        return sign;
+    } else if (absx < 0x38800000) {
+        /* Subnormal */
+        int shift = 126 - (absx >> 23);
+        uint32_t mantissa = (absx & 0x7fffff) | 0x800000;
+        h = mantissa >> shift;
+        rem = mantissa & ((1u << shift) - 1);
+        halfway = 1u << (shift - 1);
+    } else {
+        /* Normal, change the exponent bias from 127 to 15 */
+        h = (absx - 0x38000000) >> 13;
+        rem = absx & 0x1fff;
+        halfway = 0x1000;
+    }
+
+    if (rem > halfway || (rem == halfway && (h & 1))) {
+        h++;
+    }
+
+    return sign | h;
+}
+
+static float
+half_to_float (uint16_t h) {
+    unsigned int exponent = (h >> 10) & 0x1f;
+    unsigned int mantissa = h & 0x3ff;
+    float value;
+
+    if (exponent == 0) {
+        value = ldexpf (mantissa, -24);
+    } else if (exponent == 31) {
+        value = (mantissa != 0) ? NAN : INFINITY;
+    } else {
+        value = ldexpf (mantissa | 0x400, exponent - 25);
+    }
+
+    return (h & 0x8000) ? -value : value;
+}
+
+static uint16_t
+float_to_bfloat (float value) {
+    uint32_t x;
+    memcpy (&x, &value, sizeof (x));
+
+    if ((x & 0x7fffffff) > 0x7f800000) {
+        return (x >> 16) | 0x40;
+    }
+
+    return (x + 0x7fff + ((x >> 16) & 1)) >> 16;
+}
+
+static float
+bfloat_to_float (uint16_t b) {
+    uint32_t x = (uint32_t)b << 16;
+    float value;
+    memcpy (&value, &x, sizeof (value));
+    return value;
+}
+
+/*
+ * Pack VALUES into 16-bit words (padded to a whole number of 32-bit
+ * words) and replace them with the rounded values. Returns the
+ * maximal relative error.
+ */
+static float
+pack_values (float *values, uint16_t *packed, size_t n,
+             enum an_storage_format format) {
+    float error = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        float rounded;
+
+        if (format == AN_STORAGE_FLOAT16) {
+            packed[i] = float_to_half (values[i]);
+            rounded = half_to_float (packed[i]);
+        } else {
+            packed[i] = float_to_bfloat (values[i]);
+            rounded = bfloat_to_float (packed[i]);
+        }
+
+        if (values[i] != 0) {
+            float e = fabsf ((rounded - values[i]) / values[i]);
+            if (!(e <= error)) {
+                error = e;
+            }
+        }
+
+        values[i] = rounded;
+    }
+
+    if (n % 2 != 0) {
+        packed[n] = 0;
+    }
+
+    return error;
+}
+
 struct an_corrfn*
 an_create_corrfn (struct an_gpu_context *ctx,
                   const float           *corrfn,
                   const unsigned int    *dimensions,
                   unsigned int           ndim) {
-    if (ndim != ctx->ndim) {
-        fprintf (stderr, "Context dimensions must match image dimensions\n");
+    return an_create_corrfn_with_format (ctx, corrfn, dimensions, ndim,
+                                         AN_STORAGE_FLOAT32, NULL);
+}
+
+/* Create a target with COUNT values in the order of the spectrum */
+static struct an_corrfn*
+create_corrfn (struct an_gpu_context        *ctx,
+               const float                  *corrfn,
+               size_t                        count,
+               const struct an_frequency_set *subset,
+               enum an_storage_format        format,
+               float                        *error) {
+    uint16_t *packed = NULL;
+
+    if (format != AN_STORAGE_FLOAT32 && format != AN_STORAGE_FLOAT16 &&
+        format != AN_STORAGE_BFLOAT16) {
+        fprintf (stderr, "Unknown storage format\n");
         return NULL;
     }
 
@@ -32,32 +164,103 @@ an_create_corrfn (struct an_gpu_context *ctx,
     memset (image, 0, sizeof (struct an_corrfn));
 
     image->ctx = ctx;
-    image->actual_size = 1;
+    image->format = format;
+    image->actual_size = count;
+    image->subset = subset;
 
-    for (int i = 0; i < ndim-1; i++) {
-        image->actual_size *= dimensions[i];
+    image->cpuData = malloc (image->actual_size * sizeof(float));
+    memcpy (image->cpuData, corrfn, image->actual_size * sizeof(float));
+
+    if (format == AN_STORAGE_FLOAT32) {
+        image->storage_size = image->actual_size * sizeof(float);
+        if (error != NULL) {
+            *error = 0;
+        }
+    } else {
+        size_t nwords = (image->actual_size + 1) / 2;
+        image->storage_size = nwords * sizeof (uint32_t);
+        packed = malloc (image->storage_size);
+
+        float e = pack_values (image->cpuData, packed, image->actual_size, format);
+        if (error != NULL) {
+            *error = e;
+        }
+
+        if (isinf (e)) {
+            fprintf (stderr, "The target does not fit into the storage format\n");
+            goto cleanup;
+        }
+    }
+
+    if (ctx->backend == AN_BACKEND_CPU) {
+        return image;
     }
-    image->actual_size *= dimensions[ndim-1] / 2 + 1;
 
     image->corrfnMemory =
         an_create_buffer (ctx, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                          VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
                           VK_BUFFER_USAGE_TRANSFER_DST_BIT,
                           VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                          image->actual_size * sizeof(float));
+                          image->storage_size);
     if (image->corrfnMemory == NULL) {
         fprintf (stderr, "Cannot create output buffer\n");
         goto cleanup;
     }
 
-    if (!an_write_data (ctx, image->corrfnMemory, corrfn,
-                        sizeof (float) * image->actual_size)) {
+    if (!an_write_data (ctx, image->corrfnMemory,
+                        (packed != NULL) ? (const void*)packed : (const void*)image->cpuData,
+                        image->storage_size)) {
         fprintf (stderr, "Cannot write data to image memory\n");
         goto cleanup;
     }
 
+    free (packed);
+    free (image->cpuData);
+    image->cpuData = NULL;
     return image;
 
 cleanup:
+    free (packed);
     an_destroy_corrfn (image);
     return NULL;
 }
+
+struct an_corrfn*
+an_create_corrfn_with_format (struct an_gpu_context *ctx,
+                              const float           *corrfn,
+                              const unsigned int    *dimensions,
+                              unsigned int           ndim,
+                              enum an_storage_format format,
+                              float                 *error) {
+    if (ndim == 0 || ndim > MAX_DIMENSIONS) {
+        fprintf (stderr, "Wrong number of dimensions\n");
+        return NULL;
+    }
+
+    size_t actual_size = 1;
+    for (int i = 0; i < ndim-1; i++) {
+        actual_size *= dimensions[i];
+    }
+    actual_size *= dimensions[ndim-1] / 2 + 1;
+
+    return create_corrfn (ctx, corrfn, actual_size, NULL, format, error);
+}
+
+struct an_corrfn*
+an_create_corrfn_subset (struct an_gpu_context         *ctx,
+                         const struct an_frequency_set *set,
+                         const float                   *corrfn,
+                         enum an_storage_format         format,
+                         float                         *error) {
+    if (set->ctx != ctx) {
+        fprintf (stderr, "The frequency set belongs to another context\n");
+        return NULL;
+    }
+
+    float *values = malloc (sizeof (float) * set->count);
+    an_subset_gather (set, corrfn, values);
+
+    struct an_corrfn *image = create_corrfn (ctx, values, set->count, set, format, error);
+    free (values);
+    return image;
+}
@@ -0,0 +1,681 @@
+/* CPU backend: thread pool and SIMD kernels */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <vulkan/vulkan.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AN_X86 1
+#include <immintrin.h>
+#endif
+
+#include "annealing-lowlevel.h"
+#include "internal.h"
+
+/* Thread pool */
+
+typedef void (*job_fn) (void *arg, unsigned int thread, unsigned int nthreads);
+
+/*
+ * Waking the pool costs tens of microseconds, jobs with less work (in
+ * complex multiply-adds) run on the calling thread
+ */
+#define CPU_MIN_PARALLEL_WORK 65536
+
+struct an_cpu_pool {
+    unsigned int nthreads;
+    pthread_t *threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+
+    job_fn fn;
+    void *arg;
+    unsigned long jobID;
+    unsigned int running;
+    int quit;
+
+    /* Scratch memory of jobs, kept between them and grown on demand */
+    mycomplex *tables;
+    size_t tablesSize;
+    mycomplex *rows;
+    size_t rowsSize;
+    double *sums;
+    size_t sumsSize;
+};
+
+struct worker_arg {
+    struct an_cpu_pool *pool;
+    unsigned int thread;
+};
+
+static void*
+worker (void *data) {
+    struct worker_arg *warg = data;
+    struct an_cpu_pool *pool = warg->pool;
+    unsigned int thread = warg->thread;
+    unsigned long seen = 0;
+    free (warg);
+
+    pthread_mutex_lock (&pool->lock);
+    while (1) {
+        while (!pool->quit && pool->jobID == seen) {
+            pthread_cond_wait (&pool->start, &pool->lock);
+        }
+
+        if (pool->quit) {
+            break;
+        }
+
+        seen = pool->jobID;
+        job_fn fn = pool->fn;
+        void *arg = pool->arg;
+        pthread_mutex_unlock (&pool->lock);
+
+        fn (arg, thread, pool->nthreads);
+
+        pthread_mutex_lock (&pool->lock);
+        if (--pool->running == 0) {
+            pthread_cond_signal (&pool->done);
+        }
+    }
+    pthread_mutex_unlock (&pool->lock);
+
+    return NULL;
+}
+
+static void
+destroy_pool (struct an_cpu_pool *pool) {
+    pthread_mutex_lock (&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast (&pool->start);
+    pthread_mutex_unlock (&pool->lock);
+
+    /* Thread 0 is the caller */
+    for (unsigned int i = 1; i < pool->nthreads; i++) {
+        pthread_join (pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy (&pool->done);
+    pthread_cond_destroy (&pool->start);
+    pthread_mutex_destroy (&pool->lock);
+    free (pool->tables);
+    free (pool->rows);
+    free (pool->sums);
+    free (pool->threads);
+    free (pool);
+}
+
+static struct an_cpu_pool*
+create_pool (unsigned int nthreads) {
+    struct an_cpu_pool *pool = malloc (sizeof (struct an_cpu_pool));
+    memset (pool, 0, sizeof (struct an_cpu_pool));
+
+    pool->threads = malloc (sizeof (pthread_t) * nthreads);
+    pthread_mutex_init (&pool->lock, NULL);
+    pthread_cond_init (&pool->start, NULL);
+    pthread_cond_init (&pool->done, NULL);
+
+    pool->nthreads = 1;
+    for (unsigned int i = 1; i < nthreads; i++) {
+        struct worker_arg *warg = malloc (sizeof (struct worker_arg));
+        warg->pool = pool;
+        warg->thread = i;
+
+        if (pthread_create (&pool->threads[i], NULL, worker, warg) != 0) {
+            fprintf (stderr, "Cannot create a worker thread\n");
+            free (warg);
+            break;
+        }
+
+        pool->nthreads++;
+    }
+
+    return pool;
+}
+
+/* Contents are not preserved */
+static void*
+ensure_scratch (void *ptr, size_t *size, size_t wanted) {
+    if (wanted > *size) {
+        free (ptr);
+        ptr = malloc (wanted);
+        *size = wanted;
+    }
+
+    return ptr;
+}
+
+/*
+ * Run fn on all threads of the pool and wait for completion. Returns
+ * the number of threads fn was run on.
+ */
+static unsigned int
+run_parallel (struct an_cpu_pool *pool, job_fn fn, void *arg, size_t work) {
+    if (pool->nthreads == 1 || work < CPU_MIN_PARALLEL_WORK) {
+        fn (arg, 0, 1);
+        return 1;
+    }
+
+    pthread_mutex_lock (&pool->lock);
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->running = pool->nthreads - 1;
+    pool->jobID++;
+    pthread_cond_broadcast (&pool->start);
+    pthread_mutex_unlock (&pool->lock);
+
+    fn (arg, 0, pool->nthreads);
+
+    pthread_mutex_lock (&pool->lock);
+    while (pool->running > 0) {
+        pthread_cond_wait (&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock (&pool->lock);
+
+    return pool->nthreads;
+}
+
+/* Row kernels */
+
+/* row[j] += a * table[j] */
+typedef void (*axpy_fn) (mycomplex *row, const mycomplex *table, mycomplex a, size_t n);
+/* Sum of (cf[j] - |row[j]|^2)^2 */
+typedef double (*metric_fn) (const mycomplex *row, const float *cf, size_t n);
+
+static void
+row_axpy_scalar (mycomplex *row, const mycomplex *table, mycomplex a, size_t n) {
+    for (size_t j = 0; j < n; j++) {
+        row[j].re += a.re * table[j].re - a.im * table[j].im;
+        row[j].im += a.re * table[j].im + a.im * table[j].re;
+    }
+}
+
+static double
+row_metric_scalar (const mycomplex *row, const float *cf, size_t n) {
+    double sum = 0;
+    for (size_t j = 0; j < n; j++) {
+        float diff = cf[j] - (row[j].re * row[j].re + row[j].im * row[j].im);
+        sum += diff * diff;
+    }
+
+    return sum;
+}
+
+#ifdef AN_X86
+__attribute__((target("avx2,fma"))) static void
+row_axpy_avx2 (mycomplex *row, const mycomplex *table, mycomplex a, size_t n) {
+    __m256 ar = _mm256_set1_ps (a.re);
+    __m256 ai = _mm256_set1_ps (a.im);
+    size_t j;
+
+    for (j = 0; j + 4 <= n; j += 4) {
+        __m256 t  = _mm256_loadu_ps (table[j].s);
+        __m256 ts = _mm256_permute_ps (t, 0xb1);
+        __m256 r  = _mm256_loadu_ps (row[j].s);
+        r = _mm256_add_ps (r, _mm256_fmaddsub_ps (ar, t, _mm256_mul_ps (ai, ts)));
+        _mm256_storeu_ps (row[j].s, r);
+    }
+
+    row_axpy_scalar (row + j, table + j, a, n - j);
+}
+
+__attribute__((target("avx2,fma"))) static double
+row_metric_avx2 (const mycomplex *row, const float *cf, size_t n) {
+    __m256 acc = _mm256_setzero_ps();
+    size_t j;
+
+    for (j = 0; j + 4 <= n; j += 4) {
+        __m256 v   = _mm256_loadu_ps (row[j].s);
+        __m256 sq  = _mm256_mul_ps (v, v);
+        __m256 mag = _mm256_add_ps (sq, _mm256_permute_ps (sq, 0xb1));
+        __m128 c   = _mm_loadu_ps (cf + j);
+        __m256 cd  = _mm256_set_m128 (_mm_unpackhi_ps (c, c), _mm_unpacklo_ps (c, c));
+        __m256 d   = _mm256_sub_ps (cd, mag);
+        acc = _mm256_fmadd_ps (d, d, acc);
+    }
+
+    float lanes[8];
+    _mm256_storeu_ps (lanes, acc);
+    double sum = 0;
+    for (int i = 0; i < 8; i++) {
+        sum += lanes[i];
+    }
+
+    /* Each difference is counted twice */
+    return sum / 2 + row_metric_scalar (row + j, cf + j, n - j);
+}
+
+__attribute__((target("avx512f"))) static void
+row_axpy_avx512 (mycomplex *row, const mycomplex *table, mycomplex a, size_t n) {
+    __m512 ar = _mm512_set1_ps (a.re);
+    __m512 ai = _mm512_set1_ps (a.im);
+    size_t j;
+
+    for (j = 0; j + 8 <= n; j += 8) {
+        __m512 t  = _mm512_loadu_ps (table[j].s);
+        __m512 ts = _mm512_permute_ps (t, 0xb1);
+        __m512 r  = _mm512_loadu_ps (row[j].s);
+        r = _mm512_add_ps (r, _mm512_fmaddsub_ps (ar, t, _mm512_mul_ps (ai, ts)));
+        _mm512_storeu_ps (row[j].s, r);
+    }
+
+    row_axpy_scalar (row + j, table + j, a, n - j);
+}
+
+__attribute__((target("avx512f"))) static double
+row_metric_avx512 (const mycomplex *row, const float *cf, size_t n) {
+    const __m512i dup = _mm512_set_epi32 (7, 7, 6, 6, 5, 5, 4, 4,
+                                          3, 3, 2, 2, 1, 1, 0, 0);
+    __m512 acc = _mm512_setzero_ps();
+    size_t j;
+
+    for (j = 0; j + 8 <= n; j += 8) {
+        __m512 v   = _mm512_loadu_ps (row[j].s);
+        __m512 sq  = _mm512_mul_ps (v, v);
+        __m512 mag = _mm512_add_ps (sq, _mm512_permute_ps (sq, 0xb1));
+        __m512 c   = _mm512_castps256_ps512 (_mm256_loadu_ps (cf + j));
+        __m512 cd  = _mm512_permutexvar_ps (dup, c);
+        __m512 d   = _mm512_sub_ps (cd, mag);
+        acc = _mm512_fmadd_ps (d, d, acc);
+    }
+
+    float lanes[16];
+    _mm512_storeu_ps (lanes, acc);
+    double sum = 0;
+    for (int i = 0; i < 16; i++) {
+        sum += lanes[i];
+    }
+
+    /* Each difference is counted twice */
+    return sum / 2 + row_metric_scalar (row + j, cf + j, n - j);
+}
+#endif
+
+static axpy_fn row_axpy = row_axpy_scalar;
+static metric_fn row_metric = row_metric_scalar;
+
+/*
+ * The best kernels the processor supports. AN_CPU_KERNELS (scalar,
+ * avx2 or avx512) limits the choice, so tests can check each of them.
+ */
+static void
+select_kernels (void) {
+    const char *limit = getenv ("AN_CPU_KERNELS");
+    int avx512 = limit == NULL || strcmp (limit, "avx512") == 0;
+    int avx2 = avx512 || strcmp (limit, "avx2") == 0;
+
+    row_axpy = row_axpy_scalar;
+    row_metric = row_metric_scalar;
+
+#ifdef AN_X86
+    __builtin_cpu_init ();
+    if (avx512 && __builtin_cpu_supports ("avx512f")) {
+        row_axpy = row_axpy_avx512;
+        row_metric = row_metric_avx512;
+    } else if (avx2 && __builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("fma")) {
+        row_axpy = row_axpy_avx2;
+        row_metric = row_metric_avx2;
+    }
+#else
+    (void)avx2;
+#endif
+}
+
+/* Context */
+
+int
+an_cpu_create_context (struct an_gpu_context *ctx) {
+    long ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+    select_kernels ();
+
+    ctx->pool = create_pool ((ncpus > 0) ? ncpus : 1);
+    return 1;
+}
+
+void
+an_cpu_destroy_context (struct an_gpu_context *ctx) {
+    if (ctx->pool != NULL) {
+        destroy_pool (ctx->pool);
+    }
+}
+
+/* Spectrum kernels */
+
+enum cpu_job_type {
+    CPU_JOB_UPDATE,
+    CPU_JOB_UPDATE_TRACKED,
+    CPU_JOB_DISTANCE
+};
+
+struct cpu_job {
+    enum cpu_job_type type;
+    struct an_image *image;
+    const float *cf;
+
+    /* Update data */
+    const struct CFUpdateBatchPoint *points;
+    unsigned int npoints;
+    /* Phase factors along the first axis, npoints rows of actual_dimensions[0] */
+    mycomplex *tables;
+    /* Updated copies of rows for distances, one per thread */
+    mycomplex *rows;
+
+    /* Results per thread */
+    double *sums;
+};
+
+/*
+ * Gather phase factors along the first axis from the table of roots
+ * of unity. The phase along the other axes is constant for a row and
+ * is calculated per row.
+ */
+static void
+make_tables (struct an_image *image, const struct CFUpdateBatchPoint *points,
+             unsigned int npoints, mycomplex *tables) {
+    const struct CFUpdateDataConst *data = &image->updateData;
+    unsigned int len = data->actual_dimensions[0];
+    unsigned int n = data->logical_dimensions[0];
+
+    for (unsigned int k = 0; k < npoints; k++) {
+        unsigned int step = points[k].point[0] % n;
+        unsigned int m = 0;
+        for (unsigned int j = 0; j < len; j++) {
+            tables[k * len + j] = image->twiddle[m];
+            m += step;
+            m = (m >= n) ? m - n : m;
+        }
+    }
+}
+
+static mycomplex
+row_factor (const struct an_image *image,
+            const struct CFUpdateBatchPoint *point,
+            size_t row) {
+    const struct CFUpdateDataConst *data = &image->updateData;
+    const mycomplex *table = image->twiddle + data->logical_dimensions[0];
+    mycomplex factor;
+    factor.re = point->c;
+    factor.im = 0;
+
+    for (unsigned int i = 1; i < data->ndim; i++) {
+        unsigned int n = data->logical_dimensions[i];
+        size_t gid = row % data->actual_dimensions[i];
+        row /= data->actual_dimensions[i];
+
+        mycomplex root = table[(uint64_t)point->point[i] * gid % n];
+        float re = factor.re * root.re - factor.im * root.im;
+        float im = factor.re * root.im + factor.im * root.re;
+        factor.re = re;
+        factor.im = im;
+        table += n;
+    }
+
+    return factor;
+}
+
+static void
+apply_updates (const struct cpu_job *job, mycomplex *dst, size_t row,
+               size_t col, size_t len) {
+    const struct CFUpdateDataConst *data = &job->image->updateData;
+    unsigned int rowlen = data->actual_dimensions[0];
+
+    for (unsigned int k = 0; k < job->npoints; k++) {
+        mycomplex factor = row_factor (job->image, &job->points[k], row);
+        row_axpy (dst, job->tables + k * rowlen + col, factor, len);
+    }
+}
+
+/* Each thread processes a contiguous slab of the spectrum */
+static void
+spectrum_job (void *arg, unsigned int thread, unsigned int nthreads) {
+    struct cpu_job *job = arg;
+    struct an_image *image = job->image;
+    size_t rowlen = image->updateData.actual_dimensions[0];
+    size_t start = image->actual_size * thread / nthreads;
+    size_t end = image->actual_size * (thread + 1) / nthreads;
+    mycomplex *tmp = (job->rows != NULL) ? job->rows + thread * rowlen : NULL;
+    double sum = 0;
+
+    for (size_t idx = start; idx < end;) {
+        size_t row = idx / rowlen;
+        size_t col = idx % rowlen;
+        size_t len = rowlen - col;
+        if (len > end - idx) {
+            len = end - idx;
+        }
+
+        mycomplex *data = image->cpuData + idx;
+        switch (job->type) {
+        case CPU_JOB_UPDATE:
+            apply_updates (job, data, row, col, len);
+            break;
+        case CPU_JOB_UPDATE_TRACKED:
+            sum -= row_metric (data, job->cf + idx, len);
+            apply_updates (job, data, row, col, len);
+            sum += row_metric (data, job->cf + idx, len);
+            break;
+        case CPU_JOB_DISTANCE:
+            if (tmp != NULL) {
+                memcpy (tmp, data, sizeof (mycomplex) * len);
+                apply_updates (job, tmp, row, col, len);
+                data = tmp;
+            }
+            sum += row_metric (data, job->cf + idx, len);
+            break;
+        }
+
+        idx += len;
+    }
+
+    job->sums[thread] = sum;
+}
+
+static double
+run_job (struct cpu_job *job) {
+    struct an_image *image = job->image;
+    struct an_cpu_pool *pool = image->ctx->pool;
+    size_t rowlen = image->updateData.actual_dimensions[0];
+    double sum = 0;
+
+    /* Row kernels work only with the whole spectrum */
+    assert (image->subset == NULL || job->npoints == 0);
+
+    if (job->npoints > 0) {
+        pool->tables = ensure_scratch (pool->tables, &pool->tablesSize,
+                                       sizeof (mycomplex) * rowlen * job->npoints);
+        job->tables = pool->tables;
+        make_tables (image, job->points, job->npoints, job->tables);
+    }
+
+    if (job->type == CPU_JOB_DISTANCE && job->npoints > 0) {
+        pool->rows = ensure_scratch (pool->rows, &pool->rowsSize,
+                                     sizeof (mycomplex) * rowlen * pool->nthreads);
+        job->rows = pool->rows;
+    }
+
+    pool->sums = ensure_scratch (pool->sums, &pool->sumsSize,
+                                 sizeof (double) * pool->nthreads);
+    job->sums = pool->sums;
+
+    unsigned int nthreads = run_parallel (pool, spectrum_job, job,
+                                          image->actual_size * (job->npoints + 1));
+    for (unsigned int i = 0; i < nthreads; i++) {
+        sum += job->sums[i];
+    }
+
+    return sum;
+}
+
+/*
+ * Frequencies of a subset are scattered over the spectrum, so the
+ * phase is calculated for each of them from the tables of roots of
+ * unity.
+ */
+static void
+subset_job (void *arg, unsigned int thread, unsigned int nthreads) {
+    struct cpu_job *job = arg;
+    struct an_image *image = job->image;
+    const struct CFUpdateDataConst *data = &image->updateData;
+    const unsigned int *indices = image->subset->indices;
+    size_t start = image->actual_size * thread / nthreads;
+    size_t end = image->actual_size * (thread + 1) / nthreads;
+
+    for (size_t idx = start; idx < end; idx++) {
+        unsigned int gid[MAX_DIMENSIONS];
+        for (unsigned int i = 0; i < data->ndim; i++) {
+            gid[i] = (indices[idx] / data->stride[i]) % data->actual_dimensions[i];
+        }
+
+        mycomplex acc = { { 0, 0 } };
+        for (unsigned int k = 0; k < job->npoints; k++) {
+            const mycomplex *table = image->twiddle;
+            float re = job->points[k].c, im = 0;
+
+            for (unsigned int i = 0; i < data->ndim; i++) {
+                unsigned int n = data->logical_dimensions[i];
+                mycomplex root = table[(uint64_t)job->points[k].point[i] * gid[i] % n];
+                float r = re * root.re - im * root.im;
+                im = re * root.im + im * root.re;
+                re = r;
+                table += n;
+            }
+
+            acc.re += re;
+            acc.im += im;
+        }
+
+        image->cpuData[idx].re += acc.re;
+        image->cpuData[idx].im += acc.im;
+    }
+}
+
+void
+an_cpu_update (struct an_image                 *image,
+               const struct CFUpdateBatchPoint *points,
+               unsigned int                     npoints) {
+    struct cpu_job job;
+    ZERO (job);
+    job.type = CPU_JOB_UPDATE;
+    job.image = image;
+    job.points = points;
+    job.npoints = npoints;
+
+    double start = an_stats_start (image->ctx);
+    if (image->subset != NULL) {
+        run_parallel (image->ctx->pool, subset_job, &job,
+                      image->actual_size * npoints * image->updateData.ndim);
+    } else {
+        run_job (&job);
+    }
+    an_stats_time (image->ctx, AN_STAGE_UPDATE, start);
+}
+
+double
+an_cpu_update_tracked (struct an_image                 *image,
+                       const struct an_corrfn          *target,
+                       const struct CFUpdateBatchPoint *points,
+                       unsigned int                     npoints) {
+    struct cpu_job job;
+    ZERO (job);
+    job.type = CPU_JOB_UPDATE_TRACKED;
+    job.image = image;
+    job.cf = target->cpuData;
+    job.points = points;
+    job.npoints = npoints;
+
+    double start = an_stats_start (image->ctx);
+    double result = run_job (&job);
+    an_stats_time (image->ctx, AN_STAGE_TRACKED, start);
+    return result;
+}
+
+double
+an_cpu_distance (struct an_image                 *image,
+                 const struct an_corrfn          *target,
+                 const struct CFUpdateBatchPoint *points,
+                 unsigned int                     npoints) {
+    struct cpu_job job;
+    ZERO (job);
+    job.type = CPU_JOB_DISTANCE;
+    job.image = image;
+    job.cf = target->cpuData;
+    job.points = points;
+    job.npoints = npoints;
+
+    /* Distances with updates applied on the fly are moves */
+    double start = an_stats_start (image->ctx);
+    double result = run_job (&job);
+    an_stats_time (image->ctx, (npoints > 0) ? AN_STAGE_MOVE : AN_STAGE_METRIC, start);
+    return result;
+}
+
+/* Weighted distances to several targets */
+
+struct cpu_multi_job {
+    const struct an_image *image;
+    const float *const *targets;
+    const float *weights;
+    unsigned int ntargets;
+    /* ntargets sums per thread */
+    double *sums;
+};
+
+static void
+multi_distance_job (void *arg, unsigned int thread, unsigned int nthreads) {
+    struct cpu_multi_job *job = arg;
+    const struct an_image *image = job->image;
+    size_t start = image->actual_size * thread / nthreads;
+    size_t end = image->actual_size * (thread + 1) / nthreads;
+    double *sums = job->sums + thread * job->ntargets;
+
+    for (unsigned int k = 0; k < job->ntargets; k++) {
+        sums[k] = 0;
+    }
+
+    for (size_t idx = start; idx < end; idx++) {
+        const mycomplex *s = image->cpuData + idx;
+        float mag = s->re * s->re + s->im * s->im;
+        float w = (job->weights != NULL) ? job->weights[idx] : 1;
+
+        for (unsigned int k = 0; k < job->ntargets; k++) {
+            float diff = job->targets[k][idx] - mag;
+            sums[k] += w * diff * diff;
+        }
+    }
+}
+
+void
+an_cpu_multi_distance (const struct an_image *image,
+                       const float *const    *targets,
+                       const float           *weights,
+                       unsigned int           ntargets,
+                       double                *distances) {
+    struct an_cpu_pool *pool = image->ctx->pool;
+    struct cpu_multi_job job;
+    job.image = image;
+    job.targets = targets;
+    job.weights = weights;
+    job.ntargets = ntargets;
+    pool->sums = ensure_scratch (pool->sums, &pool->sumsSize,
+                                 sizeof (double) * ntargets * pool->nthreads);
+    job.sums = pool->sums;
+
+    double start = an_stats_start (image->ctx);
+    unsigned int nthreads = run_parallel (pool, multi_distance_job, &job,
+                                          image->actual_size * ntargets);
+    an_stats_time (image->ctx, AN_STAGE_METRIC, start);
+
+    for (unsigned int k = 0; k < ntargets; k++) {
+        distances[k] = 0;
+        for (unsigned int i = 0; i < nthreads; i++) {
+            distances[k] += job.sums[i * ntargets + k];
+        }
+    }
+}
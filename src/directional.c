@@ -0,0 +1,318 @@
+/* Two-point functions along the axes, maintained in real space */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <vulkan/vulkan.h>
+
+#include "annealing-lowlevel.h"
+#include "internal.h"
+
+/*
+ * S2 along axis a at lag r is the mean of I(x) I(x + r e_a) over the
+ * periodic volume. Only pairs which include a changed point change,
+ * so an update costs O(ndim * length) instead of a pass over the
+ * spectrum. Sums are kept in double precision, for binary images they
+ * are exact.
+ */
+struct an_directional_s2 {
+    float *image;
+    size_t size;
+    unsigned int dimensions[MAX_DIMENSIONS];
+    size_t strides[MAX_DIMENSIONS];
+    unsigned int ndim;
+    unsigned int length;
+
+    /* ndim rows of length + 1 lags */
+    size_t nbins;
+    double *sums;
+    double *backup;
+    float *target;
+
+    /* The last evaluated move */
+    float *moveDeltas;
+    float *oldValues;
+    size_t *movePositions;
+    unsigned int moveCapacity;
+    unsigned int npoints;
+    int movePending;
+};
+
+/* Position shifted by LAG along AXIS with periodic boundaries */
+static size_t
+shift (const struct an_directional_s2 *s2, size_t pos, unsigned int axis, long lag) {
+    unsigned int n = s2->dimensions[axis];
+    size_t stride = s2->strides[axis];
+    long coord = (pos / stride) % n;
+    long moved = (coord + lag) % (long)n;
+    if (moved < 0) {
+        moved += n;
+    }
+
+    return pos + (moved - coord) * stride;
+}
+
+/* Products I(x) I(x + r e_a) which contain the point at POS */
+static double
+pairs_with (const struct an_directional_s2 *s2, size_t pos, unsigned int axis,
+            unsigned int lag) {
+    const float *image = s2->image;
+    double sum = (double)image[pos] * image[shift (s2, pos, axis, lag)];
+
+    if (lag != 0) {
+        size_t prev = shift (s2, pos, axis, -(long)lag);
+        sum += (double)image[prev] * image[pos];
+    }
+
+    return sum;
+}
+
+static void
+apply_point (struct an_directional_s2 *s2, size_t pos, float delta) {
+    unsigned int nlags = s2->length + 1;
+
+    for (unsigned int a = 0; a < s2->ndim; a++) {
+        for (unsigned int r = 0; r < nlags; r++) {
+            s2->sums[a * nlags + r] -= pairs_with (s2, pos, a, r);
+        }
+    }
+
+    s2->image[pos] += delta;
+
+    for (unsigned int a = 0; a < s2->ndim; a++) {
+        for (unsigned int r = 0; r < nlags; r++) {
+            s2->sums[a * nlags + r] += pairs_with (s2, pos, a, r);
+        }
+    }
+}
+
+static void
+recompute (struct an_directional_s2 *s2) {
+    unsigned int nlags = s2->length + 1;
+
+    memset (s2->sums, 0, sizeof (double) * s2->nbins);
+    for (size_t pos = 0; pos < s2->size; pos++) {
+        for (unsigned int a = 0; a < s2->ndim; a++) {
+            for (unsigned int r = 0; r < nlags; r++) {
+                s2->sums[a * nlags + r] +=
+                    (double)s2->image[pos] * s2->image[shift (s2, pos, a, r)];
+            }
+        }
+    }
+}
+
+static double
+distance (const struct an_directional_s2 *s2) {
+    double sum = 0;
+
+    for (size_t i = 0; i < s2->nbins; i++) {
+        double diff = s2->target[i] - s2->sums[i] / s2->size;
+        sum += diff * diff;
+    }
+
+    return sum;
+}
+
+/* Also used by the lineal-path function, see lineal.c */
+int
+an_real_positions (const unsigned int *dimensions,
+                   const size_t       *strides,
+                   unsigned int        ndim,
+                   const unsigned int *coords,
+                   unsigned int        npoints,
+                   size_t             *result) {
+    for (unsigned int k = 0; k < npoints; k++) {
+        const unsigned int *coord = coords + k * ndim;
+        result[k] = 0;
+
+        for (unsigned int i = 0; i < ndim; i++) {
+            if (coord[i] >= dimensions[i]) {
+                fprintf (stderr, "Coordinates are out of range\n");
+                return 0;
+            }
+
+            result[k] += coord[i] * strides[i];
+        }
+    }
+
+    return 1;
+}
+
+static int
+positions (const struct an_directional_s2 *s2, const unsigned int *coords,
+           unsigned int npoints, size_t *result) {
+    return an_real_positions (s2->dimensions, s2->strides, s2->ndim,
+                              coords, npoints, result);
+}
+
+static void
+ensure_move_capacity (struct an_directional_s2 *s2, unsigned int npoints) {
+    if (npoints <= s2->moveCapacity) {
+        return;
+    }
+
+    unsigned int capacity = 2 * s2->moveCapacity;
+    if (capacity < npoints) {
+        capacity = npoints;
+    }
+
+    s2->moveDeltas = realloc (s2->moveDeltas, sizeof (float) * capacity);
+    s2->oldValues = realloc (s2->oldValues, sizeof (float) * capacity);
+    s2->movePositions = realloc (s2->movePositions, sizeof (size_t) * capacity);
+    s2->moveCapacity = capacity;
+}
+
+void
+an_destroy_directional_s2 (struct an_directional_s2 *s2) {
+    free (s2->image);
+    free (s2->sums);
+    free (s2->backup);
+    free (s2->target);
+    free (s2->moveDeltas);
+    free (s2->oldValues);
+    free (s2->movePositions);
+    free (s2);
+}
+
+struct an_directional_s2*
+an_create_directional_s2 (const float        *array,
+                          const unsigned int *dimensions,
+                          unsigned int        ndim,
+                          unsigned int        length,
+                          const float        *target) {
+    if (ndim == 0 || ndim > MAX_DIMENSIONS) {
+        fprintf (stderr, "Wrong number of dimensions\n");
+        return NULL;
+    }
+
+    for (unsigned int i = 0; i < ndim; i++) {
+        if (length >= dimensions[i]) {
+            fprintf (stderr, "The length must be smaller than dimensions\n");
+            return NULL;
+        }
+    }
+
+    struct an_directional_s2 *s2 = malloc (sizeof (struct an_directional_s2));
+    memset (s2, 0, sizeof (struct an_directional_s2));
+
+    s2->ndim = ndim;
+    s2->length = length;
+    s2->size = 1;
+    for (int i = ndim - 1; i >= 0; i--) {
+        s2->dimensions[i] = dimensions[i];
+        s2->strides[i] = s2->size;
+        s2->size *= dimensions[i];
+    }
+
+    s2->nbins = (size_t)ndim * (length + 1);
+    s2->image = malloc (sizeof (float) * s2->size);
+    s2->sums = malloc (sizeof (double) * s2->nbins);
+    s2->backup = malloc (sizeof (double) * s2->nbins);
+    s2->target = calloc (s2->nbins, sizeof (float));
+
+    memcpy (s2->image, array, sizeof (float) * s2->size);
+    if (target != NULL) {
+        memcpy (s2->target, target, sizeof (float) * s2->nbins);
+    }
+
+    recompute (s2);
+    return s2;
+}
+
+void
+an_directional_s2_set_target (struct an_directional_s2 *s2,
+                              const float              *target) {
+    memcpy (s2->target, target, sizeof (float) * s2->nbins);
+}
+
+void
+an_directional_s2_get (struct an_directional_s2 *s2,
+                       float                    *values) {
+    for (size_t i = 0; i < s2->nbins; i++) {
+        values[i] = s2->sums[i] / s2->size;
+    }
+}
+
+int
+an_directional_s2_update (struct an_directional_s2 *s2,
+                          const unsigned int       *coords,
+                          const float              *deltas,
+                          unsigned int              npoints,
+                          unsigned int              ndim) {
+    if (ndim != s2->ndim) {
+        fprintf (stderr, "Wrong dimensions\n");
+        return 0;
+    }
+
+    size_t *pos = malloc (sizeof (size_t) * npoints);
+    int ok = positions (s2, coords, npoints, pos);
+    if (ok) {
+        for (unsigned int k = 0; k < npoints; k++) {
+            apply_point (s2, pos[k], deltas[k]);
+        }
+    }
+
+    free (pos);
+    return ok;
+}
+
+int
+an_directional_s2_distance (struct an_directional_s2 *s2,
+                            float                    *result) {
+    *result = distance (s2);
+    return 1;
+}
+
+int
+an_directional_s2_evaluate_move (struct an_directional_s2 *s2,
+                                 const unsigned int       *coords,
+                                 const float              *deltas,
+                                 unsigned int              npoints,
+                                 unsigned int              ndim,
+                                 float                    *result) {
+    if (ndim != s2->ndim) {
+        fprintf (stderr, "Wrong dimensions\n");
+        return 0;
+    }
+
+    s2->movePending = 0;
+    ensure_move_capacity (s2, npoints);
+    if (!positions (s2, coords, npoints, s2->movePositions)) {
+        return 0;
+    }
+
+    memcpy (s2->moveDeltas, deltas, sizeof (float) * npoints);
+    s2->npoints = npoints;
+
+    /* Apply the move, then restore the exact state */
+    memcpy (s2->backup, s2->sums, sizeof (double) * s2->nbins);
+    for (unsigned int k = 0; k < npoints; k++) {
+        s2->oldValues[k] = s2->image[s2->movePositions[k]];
+        apply_point (s2, s2->movePositions[k], deltas[k]);
+    }
+
+    *result = distance (s2);
+
+    for (unsigned int k = npoints; k > 0; k--) {
+        s2->image[s2->movePositions[k - 1]] = s2->oldValues[k - 1];
+    }
+    memcpy (s2->sums, s2->backup, sizeof (double) * s2->nbins);
+
+    s2->movePending = 1;
+    return 1;
+}
+
+int
+an_directional_s2_commit_move (struct an_directional_s2 *s2) {
+    if (!s2->movePending) {
+        fprintf (stderr, "No move to commit\n");
+        return 0;
+    }
+
+    s2->movePending = 0;
+    for (unsigned int k = 0; k < s2->npoints; k++) {
+        apply_point (s2, s2->movePositions[k], s2->moveDeltas[k]);
+    }
+
+    return 1;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stddef.h>
+
+/* SPIR-V code compiled into the library, see Modules/EmbedShaders.cmake */
+struct an_embedded_shader {
+    const char *name;
+    const unsigned char *code;
+    size_t size;
+};
+
+/* Terminated by an entry with name == NULL */
+extern const struct an_embedded_shader an_embedded_shaders[];
@@ -1,5 +1,8 @@
 #include <fftw3.h>
+#include <stddef.h>
 #include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
 #include "annealing-lowlevel.h"
 
 struct an_array_sizes {
@@ -24,97 +27,412 @@ an_get_array_sizes (const unsigned int *dimensions,
     return result;
 }
 
-int an_rfft (const float *array,
-             float       *real,
-             float       *imag,
-             const unsigned int  *dimensions,
-             unsigned int    ndims) {
-    // Input and output arrays
-    float      *in;
-    fftwf_complex *out;
+/*
+ * Plans are cached by direction, dimensions, alignment and the distance
+ * between the real and imaginary arrays, so repeated transforms of the
+ * same shape only pay for planning once. The plans work with split
+ * complex arrays and are executed on the caller's arrays with the
+ * new-array execute functions. FFTW requires the distance im - re to be
+ * the same as at planning time, so a plan is only reused for arrays
+ * laid out like the ones it was created for. When the caller's arrays
+ * are not aligned as FFTW wants, an FFTW_UNALIGNED plan is used.
+ *
+ * FFTW planner is not thread-safe, so creation and destruction of
+ * plans is serialized with planner_lock. Execution is thread-safe and
+ * runs without locks. Each plan counts the transforms which use it, and
+ * a plan is destroyed only after its count drops to zero.
+ */
+#define PLAN_CACHE_SIZE 16
 
-    // FFT plan
-    fftwf_plan p;
+enum fft_direction {
+    FFT_FORWARD,
+    FFT_INVERSE
+};
 
-    // Dimensions
-    size_t i;
-    struct an_array_sizes asizes = an_get_array_sizes (dimensions, ndims);
+struct cached_plan {
+    enum fft_direction direction;
+    unsigned int ndims;
+    int *dimensions;
+    int aligned;
+    /* im - re in elements */
+    ptrdiff_t separation;
 
-    // Success
-    int ok = 1;
+    fftwf_plan plan;
+    /* Multidimensional c2r transforms cannot preserve their input */
+    int destroysInput;
 
-    in  = fftwf_malloc(sizeof(float)         * asizes.real);
-    out = fftwf_malloc(sizeof(fftwf_complex) * asizes.complex);
-    p   = fftwf_plan_dft_r2c (ndims, (const int*)dimensions, in, out, FFTW_ESTIMATE);
+    /* Running transforms, changed under planner_lock */
+    unsigned int users;
+    struct cached_plan *next;
+};
+
+static pthread_mutex_t planner_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t plan_released = PTHREAD_COND_INITIALIZER;
+static struct cached_plan *plan_cache = NULL;
+static unsigned int planner_flags = FFTW_ESTIMATE;
 
-    if (p == NULL) {
-        ok = 0;
-        goto cleanup;
+static void
+destroy_plan (struct cached_plan *entry) {
+    if (entry->plan != NULL) {
+        fftwf_destroy_plan (entry->plan);
     }
 
-    // Copy data to the input array and calculate FFT
-    memcpy (in, array, sizeof(float)*asizes.real);
-    fftwf_execute(p);
+    free (entry->dimensions);
+    free (entry);
+}
 
-    for (i=0; i < asizes.complex; i++) {
-        real[i] = out[i][0];
-        imag[i] = out[i][1];
+/*
+ * Destroy a plan which is already removed from the cache, waiting for
+ * transforms which still use it. Must be called with planner_lock held.
+ */
+static void
+retire_plan (struct cached_plan *entry) {
+    while (entry->users != 0) {
+        pthread_cond_wait (&plan_released, &planner_lock);
     }
 
-cleanup:
-    if (p != NULL) {
-        fftwf_destroy_plan (p);
+    destroy_plan (entry);
+}
+
+/* Must be called with planner_lock held */
+static void
+clear_plans (void) {
+    struct cached_plan *entry = plan_cache;
+    plan_cache = NULL;
+
+    while (entry != NULL) {
+        struct cached_plan *next = entry->next;
+        retire_plan (entry);
+        entry = next;
     }
+}
 
-    fftwf_free (in);
-    fftwf_free (out);
+/*
+ * Distance between the real and imaginary parts of a spectrum copied
+ * into one block, rounded up so that both parts stay aligned.
+ */
+static ptrdiff_t
+copy_separation (size_t complex) {
+    return (complex + 15) & ~(size_t)15;
+}
 
-    return ok;
+static int
+arrays_aligned (float *a, float *b, float *c) {
+    return fftwf_alignment_of (a) == 0 &&
+        fftwf_alignment_of (b) == 0 &&
+        fftwf_alignment_of (c) == 0;
 }
 
-int an_irfft (float       *array,
-              const float *real,
-              const float *imag,
-              const unsigned int  *dimensions,
-              unsigned int    ndims) {
-    // Input and output arrays
-    fftwf_complex *in;
-    float      *out;
+/* Strides of the real array and the half-complex arrays in row-major order */
+static void
+fill_iodims (fftwf_iodim *iodims, const int *dimensions, unsigned int ndims,
+             enum fft_direction direction) {
+    int realStride = 1;
+    int complexStride = 1;
+
+    for (int i = ndims - 1; i >= 0; i--) {
+        iodims[i].n  = dimensions[i];
+        iodims[i].is = (direction == FFT_FORWARD) ? realStride : complexStride;
+        iodims[i].os = (direction == FFT_FORWARD) ? complexStride : realStride;
 
-    // FFT plan
-    fftwf_plan p;
+        realStride *= dimensions[i];
+        complexStride *= (i == ndims - 1) ? dimensions[i] / 2 + 1 : dimensions[i];
+    }
+}
 
-    // Dimensions
-    size_t i;
+static fftwf_plan
+plan_split (enum fft_direction direction, const fftwf_iodim *iodims, unsigned int ndims,
+            float *real, float *re, float *im, unsigned int flags) {
+    return (direction == FFT_FORWARD) ?
+        fftwf_plan_guru_split_dft_r2c (ndims, iodims, 0, NULL, real, re, im, flags) :
+        fftwf_plan_guru_split_dft_c2r (ndims, iodims, 0, NULL, re, im, real, flags);
+}
+
+/*
+ * Create a plan. The arrays are used for planning only when the
+ * planner does not overwrite them (FFTW_ESTIMATE), otherwise temporary
+ * arrays are used. The temporary real and imaginary parts are placed in
+ * one block at the same distance as the caller's ones. If such a block
+ * cannot be allocated, the plan is made with FFTW_ESTIMATE.
+ */
+static struct cached_plan*
+create_plan (enum fft_direction direction,
+             const unsigned int *dimensions,
+             unsigned int ndims, int aligned,
+             float *real, float *re, float *im) {
     struct an_array_sizes asizes = an_get_array_sizes (dimensions, ndims);
+    struct cached_plan *entry = malloc (sizeof (struct cached_plan));
+    memset (entry, 0, sizeof (struct cached_plan));
+
+    entry->direction = direction;
+    entry->ndims = ndims;
+    entry->aligned = aligned;
+    entry->separation = im - re;
+    entry->dimensions = malloc (sizeof (int) * ndims);
+    for (unsigned int i = 0; i < ndims; i++) {
+        entry->dimensions[i] = dimensions[i];
+    }
+
+    fftwf_iodim *iodims = malloc (sizeof (fftwf_iodim) * ndims);
+    fill_iodims (iodims, entry->dimensions, ndims, direction);
+
+    unsigned int planning = planner_flags;
+    float *tmpReal = NULL, *tmpBlock = NULL;
+    if (planning != FFTW_ESTIMATE) {
+        size_t distance = (entry->separation < 0) ?
+            -entry->separation : entry->separation;
+        tmpReal  = fftwf_malloc (sizeof (float) * asizes.real);
+        tmpBlock = fftwf_malloc (sizeof (float) * (distance + asizes.complex));
+
+        if (tmpReal != NULL && tmpBlock != NULL) {
+            real = tmpReal;
+            re = (entry->separation < 0) ? tmpBlock + distance : tmpBlock;
+            im = re + entry->separation;
+        } else {
+            planning = FFTW_ESTIMATE;
+        }
+    }
+
+    unsigned int flags = planning | (aligned ? 0 : FFTW_UNALIGNED);
+    if (direction == FFT_INVERSE) {
+        entry->plan = plan_split (direction, iodims, ndims, real, re, im,
+                                  flags | FFTW_PRESERVE_INPUT);
+        if (entry->plan == NULL) {
+            /*
+             * The plan is executed on a copy of the spectrum (see
+             * an_irfft), so it is made for the layout of the copy.
+             */
+            ptrdiff_t separation = copy_separation (asizes.complex);
+            float *copy = fftwf_malloc (sizeof (float) * (separation + asizes.complex));
+
+            if (copy != NULL) {
+                entry->plan = plan_split (direction, iodims, ndims, real,
+                                          copy, copy + separation,
+                                          flags | FFTW_DESTROY_INPUT);
+                entry->destroysInput = 1;
+                fftwf_free (copy);
+            }
+        }
+    } else {
+        entry->plan = plan_split (direction, iodims, ndims, real, re, im, flags);
+    }
+
+    fftwf_free (tmpReal);
+    fftwf_free (tmpBlock);
+    free (iodims);
+
+    if (entry->plan == NULL) {
+        destroy_plan (entry);
+        return NULL;
+    }
+
+    return entry;
+}
+
+/* Find a plan in the cache or create it. Returns the plan in use. */
+static struct cached_plan*
+acquire_plan (enum fft_direction direction,
+              const unsigned int *dimensions,
+              unsigned int ndims,
+              float *real, float *re, float *im) {
+    int aligned = arrays_aligned (real, re, im);
+    ptrdiff_t separation = im - re;
+    pthread_mutex_lock (&planner_lock);
+
+    struct cached_plan **link = &plan_cache;
+    struct cached_plan *entry = NULL;
+    unsigned int count = 0;
+
+    while (*link != NULL) {
+        struct cached_plan *current = *link;
+        if (current->direction == direction && current->ndims == ndims &&
+            current->aligned == aligned && current->separation == separation &&
+            memcmp (current->dimensions, dimensions, sizeof (int) * ndims) == 0) {
+            /* Move to the front */
+            *link = current->next;
+            entry = current;
+            break;
+        }
 
-    // Success
-    int ok = 1;
+        count++;
+        link = &current->next;
+    }
+
+    struct cached_plan *evicted = NULL;
+    if (entry == NULL) {
+        entry = create_plan (direction, dimensions, ndims, aligned, real, re, im);
+
+        if (entry != NULL && count >= PLAN_CACHE_SIZE) {
+            /* Evict the least recently used plan before pushing the new one */
+            struct cached_plan **last = &plan_cache;
+            while ((*last)->next != NULL) {
+                last = &(*last)->next;
+            }
 
-    in  = fftwf_malloc(sizeof(fftwf_complex) * asizes.complex);
-    out = fftwf_malloc(sizeof(float)      * asizes.real);
-    p   = fftwf_plan_dft_c2r (ndims, (const int*)dimensions, in, out, FFTW_ESTIMATE);
+            evicted = *last;
+            *last = NULL;
+        }
+    }
 
-    if (p == NULL) {
-        ok = 0;
-        goto cleanup;
+    if (entry != NULL) {
+        entry->next = plan_cache;
+        plan_cache = entry;
+        entry->users++;
     }
 
-    for (i=0; i < asizes.complex; i++) {
-        in[i][0] = real[i];
-        in[i][1] = imag[i];
+    if (evicted != NULL) {
+        retire_plan (evicted);
     }
 
-    fftwf_execute(p);
-    memcpy (array, out, sizeof(float)*asizes.real);
+    pthread_mutex_unlock (&planner_lock);
+    return entry;
+}
 
-cleanup:
-    if (p != NULL) {
-        fftwf_destroy_plan (p);
+static void
+release_plan (struct cached_plan *entry) {
+    pthread_mutex_lock (&planner_lock);
+    entry->users--;
+    if (entry->users == 0) {
+        pthread_cond_broadcast (&plan_released);
     }
+    pthread_mutex_unlock (&planner_lock);
+}
 
-    fftwf_free (in);
-    fftwf_free (out);
+int an_fft_set_planning (enum an_fft_planning planning) {
+    unsigned int flags;
+
+    switch (planning) {
+    case AN_FFT_ESTIMATE:
+        flags = FFTW_ESTIMATE;
+        break;
+    case AN_FFT_MEASURE:
+        flags = FFTW_MEASURE;
+        break;
+    case AN_FFT_PATIENT:
+        flags = FFTW_PATIENT;
+        break;
+    default:
+        return 0;
+    }
+
+    pthread_mutex_lock (&planner_lock);
+    if (flags != planner_flags) {
+        planner_flags = flags;
+        clear_plans ();
+    }
+    pthread_mutex_unlock (&planner_lock);
+
+    return 1;
+}
+
+int an_fft_set_threads (int nthreads) {
+    if (nthreads < 1) {
+        return 0;
+    }
+
+#ifdef AN_HAVE_FFTW_THREADS
+    static int initialized = 0;
+    static int planner_threads = 1;
+    pthread_mutex_lock (&planner_lock);
+
+    if (!initialized) {
+        initialized = fftwf_init_threads ();
+    }
+
+    if (initialized && nthreads != planner_threads) {
+        planner_threads = nthreads;
+        fftwf_plan_with_nthreads (nthreads);
+        clear_plans ();
+    }
+
+    pthread_mutex_unlock (&planner_lock);
+    return initialized;
+#else
+    return nthreads == 1;
+#endif
+}
+
+int an_fft_import_wisdom (const char *path) {
+    pthread_mutex_lock (&planner_lock);
+    int ok = fftwf_import_wisdom_from_filename (path);
+    pthread_mutex_unlock (&planner_lock);
+
+    return ok;
+}
+
+int an_fft_export_wisdom (const char *path) {
+    pthread_mutex_lock (&planner_lock);
+    int ok = fftwf_export_wisdom_to_filename (path);
+    pthread_mutex_unlock (&planner_lock);
 
     return ok;
 }
+
+void an_fft_forget_plans (void) {
+    pthread_mutex_lock (&planner_lock);
+    clear_plans ();
+    pthread_mutex_unlock (&planner_lock);
+}
+
+int an_rfft (const float *array,
+             float       *real,
+             float       *imag,
+             const unsigned int  *dimensions,
+             unsigned int    ndims) {
+    /* r2c transforms do not modify their input */
+    float *in = (float*)array;
+    struct cached_plan *entry = acquire_plan (FFT_FORWARD, dimensions, ndims,
+                                              in, real, imag);
+
+    if (entry == NULL) {
+        return 0;
+    }
+
+    fftwf_execute_split_dft_r2c (entry->plan, in, real, imag);
+    release_plan (entry);
+
+    return 1;
+}
+
+int an_irfft (float       *array,
+              const float *real,
+              const float *imag,
+              const unsigned int  *dimensions,
+              unsigned int    ndims) {
+    float *re = (float*)real;
+    float *im = (float*)imag;
+    float *copy = NULL;
+    struct cached_plan *entry = acquire_plan (FFT_INVERSE, dimensions, ndims,
+                                              array, re, im);
+
+    if (entry == NULL) {
+        return 0;
+    }
+
+    if (entry->destroysInput) {
+        /*
+         * Do not overwrite the caller's spectrum. The copy has the
+         * layout the plan was made for, and it is aligned, which suits
+         * both kinds of plans.
+         */
+        struct an_array_sizes asizes = an_get_array_sizes (dimensions, ndims);
+        ptrdiff_t separation = copy_separation (asizes.complex);
+        copy = fftwf_malloc (sizeof (float) * (separation + asizes.complex));
+        if (copy == NULL) {
+            release_plan (entry);
+            return 0;
+        }
+
+        re = copy;
+        im = copy + separation;
+        memcpy (re, real, sizeof (float) * asizes.complex);
+        memcpy (im, imag, sizeof (float) * asizes.complex);
+    }
+
+    fftwf_execute_split_dft_c2r (entry->plan, re, im, array);
+    release_plan (entry);
+
+    fftwf_free (copy);
+
+    return 1;
+}
@@ -0,0 +1,385 @@
+/* Real-to-complex and complex-to-real FFT on the device */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <vulkan/vulkan.h>
+
+#include "annealing-lowlevel.h"
+#include "internal.h"
+
+#define FFT_GRP_SIZE 64
+#define FFT_MAX_GROUPS 65535
+#define FFT_MAX_STAGES 32
+#define FFT_MAX_DISPATCHES (MAX_DIMENSIONS * FFT_MAX_STAGES + 1)
+
+/*
+ * Radices of Stockham stages for a transform of length n (4 first,
+ * then 2, 3 and 5). Returns the number of stages or -1 if n has other
+ * prime factors.
+ */
+static int
+factor (unsigned int n, unsigned int *radices) {
+    static const unsigned int supported[] = { 4, 2, 3, 5 };
+    int count = 0;
+
+    for (int i = 0; i < 4; i++) {
+        while (n % supported[i] == 0 && count < FFT_MAX_STAGES) {
+            radices[count++] = supported[i];
+            n /= supported[i];
+        }
+    }
+
+    return (n == 1) ? count : -1;
+}
+
+/*
+ * The fastest axis must have even length (it is transformed as a
+ * complex sequence of half the length) and all lengths must factor
+ * into supported radices.
+ */
+int
+an_gpu_fft_supported (const struct CFUpdateDataConst *data) {
+    unsigned int radices[FFT_MAX_STAGES];
+    unsigned int n = data->logical_dimensions[0];
+
+    if (n % 2 != 0 || factor (n / 2, radices) < 0) {
+        return 0;
+    }
+
+    for (int i = 1; i < data->ndim; i++) {
+        if (factor (data->logical_dimensions[i], radices) < 0) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+struct fft_buffer {
+    struct an_image_memory *memory;
+    size_t size;
+};
+
+/* Descriptor sets are allocated for each dispatch and freed when the work is done */
+struct fft_recorder {
+    struct an_image *image;
+    VkCommandBuffer commandBuffer;
+    VkDescriptorSet sets[FFT_MAX_DISPATCHES];
+    VkDescriptorPool pools[FFT_MAX_DISPATCHES];
+    unsigned int nsets;
+    int failed;
+};
+
+static void
+record_dispatch (struct fft_recorder *rec, enum pipeline_type type,
+                 struct fft_buffer input, struct fft_buffer output,
+                 const void *params, size_t paramsSize, size_t total) {
+    struct an_image *image = rec->image;
+    struct an_gpu_context *ctx = image->ctx;
+    struct pipeline *pipeline = ctx->pipelines[type];
+
+    if (rec->failed || rec->nsets == FFT_MAX_DISPATCHES) {
+        rec->failed = 1;
+        return;
+    }
+
+    VkDescriptorSet *set = &rec->sets[rec->nsets];
+    VkResult result = an_allocate_descriptor_set (ctx, pipeline, &rec->pools[rec->nsets], set);
+    if (result != VK_SUCCESS) {
+        fprintf (stderr, "Cannot allocate descriptor set, code = %i\n", result);
+        rec->failed = 1;
+        return;
+    }
+    rec->nsets++;
+
+    struct an_image_memory *buffers[3] = {
+        input.memory, output.memory, image->twiddleMemory
+    };
+    size_t sizes[3] = {
+        input.size, output.size, sizeof (mycomplex) * image->twiddle_size
+    };
+    an_write_storage_descriptors (ctx, *set, buffers, sizes, 3);
+
+    size_t groups = (total + FFT_GRP_SIZE - 1) / FFT_GRP_SIZE;
+    if (groups > FFT_MAX_GROUPS) {
+        groups = FFT_MAX_GROUPS;
+    }
+
+    vkCmdBindPipeline (rec->commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                       an_get_pipeline (ctx, type, image->updateData.ndim));
+    vkCmdBindDescriptorSets (rec->commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                             pipeline->pipelineLayout,
+                             0, 1, set, 0, NULL);
+    vkCmdPushConstants (rec->commandBuffer, pipeline->pipelineLayout,
+                        VK_SHADER_STAGE_COMPUTE_BIT, 0, paramsSize, params);
+    vkCmdDispatch (rec->commandBuffer, groups, 1, 1);
+    an_record_barrier (rec->commandBuffer);
+}
+
+static void
+record_copy (struct fft_recorder *rec, struct fft_buffer source,
+             struct fft_buffer destination, size_t size) {
+    VkMemoryBarrier memoryBarrier;
+    ZERO (memoryBarrier);
+    memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    memoryBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+    vkCmdPipelineBarrier (rec->commandBuffer,
+                          VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                          VK_PIPELINE_STAGE_TRANSFER_BIT,
+                          0, 1, &memoryBarrier, 0, NULL, 0, NULL);
+
+    VkBufferCopy copyRegion;
+    ZERO(copyRegion);
+    copyRegion.size = size;
+    vkCmdCopyBuffer (rec->commandBuffer, source.memory->buffer,
+                     destination.memory->buffer, 1, &copyRegion);
+    an_record_barrier (rec->commandBuffer);
+}
+
+/*
+ * Transform all lines along one axis. Stages go back and forth between
+ * buffers[0] and buffers[1], *current is where the data is.
+ */
+static void
+record_axis (struct fft_recorder *rec, unsigned int length, unsigned int stride,
+             unsigned int lines, unsigned int twiddleOffset, unsigned int twiddleStep,
+             int inverse, struct fft_buffer *buffers, int *current) {
+    static const enum pipeline_type pipelines[] = {
+        [2] = PIPELINE_FFT_RADIX2,
+        [3] = PIPELINE_FFT_RADIX3,
+        [4] = PIPELINE_FFT_RADIX4,
+        [5] = PIPELINE_FFT_RADIX5
+    };
+
+    unsigned int radices[FFT_MAX_STAGES];
+    int nstages = factor (length, radices);
+    assert (nstages >= 0);
+
+    struct FFTStageData params;
+    params.length = length;
+    params.stride = stride;
+    params.lines = lines;
+    params.p = 1;
+    params.twiddleOffset = twiddleOffset;
+    params.twiddleStep = twiddleStep;
+    params.inverse = inverse;
+
+    for (int i = 0; i < nstages; i++) {
+        record_dispatch (rec, pipelines[radices[i]],
+                         buffers[*current], buffers[1 - *current],
+                         &params, sizeof (params),
+                         (size_t)lines * length / radices[i]);
+        params.p *= radices[i];
+        *current = 1 - *current;
+    }
+}
+
+/* Offset of the twiddle table for the axis, see an_make_twiddle() */
+static unsigned int
+twiddle_offset (const struct CFUpdateDataConst *data, int axis) {
+    unsigned int offset = 0;
+    for (int i = 0; i < axis; i++) {
+        offset += data->logical_dimensions[i];
+    }
+
+    return offset;
+}
+
+static int
+begin (struct fft_recorder *rec, struct an_image *image) {
+    memset (rec, 0, sizeof (struct fft_recorder));
+    rec->image = image;
+
+    VkResult result = an_create_command_buffer (image->ctx, &rec->commandBuffer);
+    if (result != VK_SUCCESS) {
+        fprintf (stderr, "Cannot allocate command buffer, code = %i\n", result);
+        return 0;
+    }
+
+    VkCommandBufferBeginInfo beginInfo;
+    ZERO(beginInfo);
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+    vkBeginCommandBuffer (rec->commandBuffer, &beginInfo);
+    an_record_barrier (rec->commandBuffer);
+    return 1;
+}
+
+/* Submit, wait and release resources */
+static int
+finish (struct fft_recorder *rec) {
+    struct an_gpu_context *ctx = rec->image->ctx;
+
+    if (rec->commandBuffer == VK_NULL_HANDLE) {
+        return 0;
+    }
+
+    vkEndCommandBuffer (rec->commandBuffer);
+    if (!rec->failed) {
+        an_wait_ticket (ctx, an_submit (ctx, rec->commandBuffer));
+    }
+
+    for (unsigned int i = 0; i < rec->nsets; i++) {
+        an_free_descriptor_set (ctx, rec->pools[i], &rec->sets[i]);
+    }
+
+    vkFreeCommandBuffers (ctx->device, ctx->cmdPool, 1, &rec->commandBuffer);
+    return !rec->failed;
+}
+
+static struct fft_buffer
+create_work_buffer (struct an_gpu_context *ctx, size_t size) {
+    struct fft_buffer buffer;
+
+    buffer.size = size;
+    buffer.memory =
+        an_create_buffer (ctx, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                          VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                          VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                          size);
+    if (buffer.memory == NULL) {
+        fprintf (stderr, "Cannot create FFT work buffer\n");
+    }
+
+    return buffer;
+}
+
+/*
+ * Calculate the spectrum of the image from a real volume in
+ * realMemory. Real volume is transformed along the fastest axis as
+ * complex rows of half the length and post-processed into the
+ * half-spectrum, then the other axes are transformed in place.
+ */
+int
+an_gpu_rfft (struct an_image *image, struct an_image_memory *realMemory) {
+    struct an_gpu_context *ctx = image->ctx;
+    const struct CFUpdateDataConst *data = &image->updateData;
+    unsigned int h = data->logical_dimensions[0] / 2;
+    unsigned int rows = image->actual_size / (h + 1);
+    size_t spectrumSize = sizeof (mycomplex) * image->actual_size;
+    struct fft_recorder rec;
+    int ok = 0;
+
+    assert (an_gpu_fft_supported (data));
+
+    struct fft_buffer work = create_work_buffer (ctx, spectrumSize);
+    if (work.memory == NULL) {
+        return 0;
+    }
+
+    if (!begin (&rec, image)) {
+        goto cleanup;
+    }
+
+    struct fft_buffer spectrum = { image->imageMemory, spectrumSize };
+    struct fft_buffer buffers[2] = {
+        { realMemory, sizeof (mycomplex) * rows * h }, work
+    };
+    int current = 0;
+
+    /* The fastest axis, twiddles for length h are every other in the table for 2h */
+    record_axis (&rec, h, 1, rows, 0, 2, 0, buffers, &current);
+
+    struct FFTRealData params;
+    params.half = h;
+    params.rows = rows;
+    params.inverse = 0;
+    record_dispatch (&rec, PIPELINE_FFT_REAL, buffers[current], spectrum,
+                     &params, sizeof (params), (size_t)rows * (h + 1));
+
+    /* Other axes */
+    buffers[0] = spectrum;
+    buffers[1] = work;
+    current = 0;
+
+    for (int i = 1; i < data->ndim; i++) {
+        unsigned int length = data->logical_dimensions[i];
+        record_axis (&rec, length, data->stride[i], image->actual_size / length,
+                     twiddle_offset (data, i), 1, 0, buffers, &current);
+    }
+
+    if (current != 0) {
+        record_copy (&rec, work, spectrum, spectrumSize);
+    }
+
+    ok = finish (&rec);
+
+cleanup:
+    an_destroy_buffer (ctx, work.memory);
+    return ok;
+}
+
+/*
+ * Calculate a real volume from the spectrum of the image (not
+ * normalized, like FFTW does). The spectrum is left untouched.
+ */
+int
+an_gpu_irfft (struct an_image *image, struct an_image_memory *realMemory) {
+    struct an_gpu_context *ctx = image->ctx;
+    const struct CFUpdateDataConst *data = &image->updateData;
+    unsigned int h = data->logical_dimensions[0] / 2;
+    unsigned int rows = image->actual_size / (h + 1);
+    size_t spectrumSize = sizeof (mycomplex) * image->actual_size;
+    struct fft_recorder rec;
+    int ok = 0;
+
+    assert (an_gpu_fft_supported (data));
+
+    struct fft_buffer buffers[2];
+    buffers[0] = create_work_buffer (ctx, spectrumSize);
+    buffers[1] = create_work_buffer (ctx, spectrumSize);
+    if (buffers[0].memory == NULL || buffers[1].memory == NULL) {
+        goto cleanup;
+    }
+
+    if (!begin (&rec, image)) {
+        goto cleanup;
+    }
+
+    /* Slower axes on a copy of the spectrum */
+    struct fft_buffer spectrum = { image->imageMemory, spectrumSize };
+    record_copy (&rec, spectrum, buffers[0], spectrumSize);
+    int current = 0;
+
+    for (int i = 1; i < data->ndim; i++) {
+        unsigned int length = data->logical_dimensions[i];
+        record_axis (&rec, length, data->stride[i], image->actual_size / length,
+                     twiddle_offset (data, i), 1, 1, buffers, &current);
+    }
+
+    /* Rows of half the length, then the fastest axis */
+    struct fft_buffer output = { realMemory, sizeof (mycomplex) * rows * h };
+    struct fft_buffer rowBuffers[2] = {
+        { buffers[1 - current].memory, sizeof (mycomplex) * rows * h }, output
+    };
+
+    struct FFTRealData params;
+    params.half = h;
+    params.rows = rows;
+    params.inverse = 1;
+    record_dispatch (&rec, PIPELINE_FFT_REAL, buffers[current], rowBuffers[0],
+                     &params, sizeof (params), (size_t)rows * h);
+
+    current = 0;
+    record_axis (&rec, h, 1, rows, 0, 2, 1, rowBuffers, &current);
+
+    if (current == 0) {
+        record_copy (&rec, rowBuffers[0], output, output.size);
+    }
+
+    ok = finish (&rec);
+
+cleanup:
+    for (int i = 0; i < 2; i++) {
+        if (buffers[i].memory != NULL) {
+            an_destroy_buffer (ctx, buffers[i].memory);
+        }
+    }
+
+    return ok;
+}
@@ -9,6 +9,11 @@
 #include "annealing-lowlevel.h"
 #include "internal.h"
 
+/* See update-s2-subset.comp */
+#define SUBSET_GRP_SIZE 64
+/* The guaranteed limit of maxComputeWorkGroupCount */
+#define SUBSET_MAX_GROUPS 65535
+
 static void
 update_descriptors (struct an_image *image) {
     struct an_gpu_context *ctx = image->ctx;
@@ -19,13 +24,19 @@ update_descriptors (struct an_image *image) {
     memoryInfo.offset = 0;
     memoryInfo.range = sizeof (mycomplex) * image->actual_size;
 
+    VkDescriptorBufferInfo twiddleInfo;
+    ZERO(twiddleInfo);
+    twiddleInfo.buffer = image->twiddleMemory->buffer;
+    twiddleInfo.offset = 0;
+    twiddleInfo.range = sizeof (mycomplex) * image->twiddle_size;
+
     VkDescriptorBufferInfo uniInfo;
     ZERO(uniInfo);
     uniInfo.buffer = image->uniformMemory->buffer;
     uniInfo.offset = 0;
     uniInfo.range = sizeof (struct CFUpdateDataUni);
 
-    VkWriteDescriptorSet dsSets[2];
+    VkWriteDescriptorSet dsSets[3];
     memset (dsSets, 0, sizeof (dsSets));
     dsSets[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
     dsSets[0].dstSet = image->descriptorSet;
@@ -39,67 +50,325 @@ update_descriptors (struct an_image *image) {
     dsSets[1].dstBinding = 1; // binding #
     dsSets[1].dstArrayElement = 0;
     dsSets[1].descriptorCount = 1;
-    dsSets[1].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    dsSets[1].pBufferInfo = &uniInfo;
+    dsSets[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    dsSets[1].pBufferInfo = &twiddleInfo;
+    dsSets[2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    dsSets[2].dstSet = image->descriptorSet;
+    dsSets[2].dstBinding = 2; // binding #
+    dsSets[2].dstArrayElement = 0;
+    dsSets[2].descriptorCount = 1;
+    dsSets[2].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    dsSets[2].pBufferInfo = &uniInfo;
+
+    vkUpdateDescriptorSets (ctx->device, 3, dsSets, 0, NULL);
+}
+
+/*
+ * Tables of roots of unity exp(-2 pi i k / n) for each axis, stored
+ * one after another. Calculated in double precision.
+ */
+mycomplex*
+an_make_twiddle (const struct CFUpdateDataConst *data, size_t *size) {
+    *size = 0;
+    for (int i = 0; i < data->ndim; i++) {
+        *size += data->logical_dimensions[i];
+    }
 
-    vkUpdateDescriptorSets (ctx->device, 2, dsSets, 0, NULL);
+    mycomplex *twiddle = malloc (sizeof (mycomplex) * *size);
+    mycomplex *table = twiddle;
+    for (int i = 0; i < data->ndim; i++) {
+        unsigned int n = data->logical_dimensions[i];
+        for (unsigned int k = 0; k < n; k++) {
+            double angle = 2 * M_PI * (double)k / (double)n;
+            table[k].re =  cos (angle);
+            table[k].im = -sin (angle);
+        }
+        table += n;
+    }
+
+    return twiddle;
 }
 
-static void
-record_command_buffer (struct an_image *image) {
-    struct an_gpu_context *ctx = image->ctx;
-    struct pipeline *updPipeline = ctx->pipelines[PIPELINE_CFUPDATE];
+/*
+ * Fill dimensions of a half-spectrum. The order of dimensions is
+ * reversed, so that the first one is the fastest. Returns the number
+ * of elements in the spectrum.
+ */
+size_t
+an_init_update_data (struct CFUpdateDataConst *data,
+                     const unsigned int       *dimensions,
+                     unsigned int              ndim) {
+    size_t actual_size = 1;
+
+    memset (data, 0, sizeof (struct CFUpdateDataConst));
+    data->ndim = ndim;
+
+    for (int i = 0; i < data->ndim; i++) {
+        data->logical_dimensions[i] = dimensions[data->ndim - i - 1];
+        data->actual_dimensions[i] = dimensions[data->ndim - i - 1];
+    }
+
+    data->actual_dimensions[0] = data->actual_dimensions[0] / 2 + 1;
+
+    for (int i = 0; i < data->ndim; i++) {
+        data->stride[i] = 1;
+    }
+
+    for (int i = 1; i < data->ndim; i++) {
+        data->stride[i] = data->stride[i-1] * data->actual_dimensions[i-1];
+    }
+
+    for (int i = 0; i < data->ndim; i++) {
+        actual_size *= data->actual_dimensions[i];
+    }
+
+    return actual_size;
+}
 
+static void
+record_command_buffer (struct an_image *image, VkCommandBuffer commandBuffer,
+                       enum pipeline_type type, VkDescriptorSet descriptorSet) {
+    struct pipeline *updPipeline = image->ctx->pipelines[type];
     VkCommandBufferBeginInfo beginInfo;
     ZERO(beginInfo);
     beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
 
-    vkBeginCommandBuffer (image->commandBuffer, &beginInfo);
-    vkCmdBindPipeline (image->commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
-                       updPipeline->pipeline);
-    vkCmdBindDescriptorSets (image->commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+    vkBeginCommandBuffer (commandBuffer, &beginInfo);
+    /* Wait for previous submissions which use the image */
+    an_record_barrier (commandBuffer);
+    an_stats_register (image->ctx, commandBuffer, AN_STAGE_UPDATE);
+    vkCmdBindPipeline (commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                       an_get_pipeline (image->ctx, type, image->updateData.ndim));
+    vkCmdBindDescriptorSets (commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
                              updPipeline->pipelineLayout,
-                             0, 1, &image->descriptorSet, 0, NULL);
-    vkCmdPushConstants (image->commandBuffer, updPipeline->pipelineLayout,
+                             0, 1, &descriptorSet, 0, NULL);
+    vkCmdPushConstants (commandBuffer, updPipeline->pipelineLayout,
                         VK_SHADER_STAGE_COMPUTE_BIT, 0,
                         sizeof (struct CFUpdateDataConst), &image->updateData);
-    vkCmdDispatch (image->commandBuffer,
+    vkCmdDispatch (commandBuffer,
                    image->ngroups[0], image->ngroups[1], image->ngroups[2]);
-    vkEndCommandBuffer (image->commandBuffer);
+    vkEndCommandBuffer (commandBuffer);
 }
 
-void
-an_image_synchronize (struct an_image *image) {
+/* Updates of a frequency subset run over the list of retained frequencies */
+static void
+record_subset_command_buffer (struct an_image *image) {
+    struct pipeline *pipeline = image->ctx->pipelines[PIPELINE_CFUPDATE_SUBSET];
+    VkCommandBuffer commandBuffer = image->batchCommandBuffer;
+
+    struct SubsetUpdateData params;
+    params.dims = image->updateData;
+    params.count = image->actual_size;
+
+    VkCommandBufferBeginInfo beginInfo;
+    ZERO(beginInfo);
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+
+    vkBeginCommandBuffer (commandBuffer, &beginInfo);
+    an_record_barrier (commandBuffer);
+    an_stats_register (image->ctx, commandBuffer, AN_STAGE_UPDATE);
+    vkCmdBindPipeline (commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                       an_get_pipeline (image->ctx, PIPELINE_CFUPDATE_SUBSET,
+                                        image->updateData.ndim));
+    vkCmdBindDescriptorSets (commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                             pipeline->pipelineLayout,
+                             0, 1, &image->batchDescriptorSet, 0, NULL);
+    vkCmdPushConstants (commandBuffer, pipeline->pipelineLayout,
+                        VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                        sizeof (struct SubsetUpdateData), &params);
+    /* The shader loops over frequencies which do not fit in the groups */
+    size_t groups = ceil((double) image->actual_size / (double)SUBSET_GRP_SIZE);
+    if (groups > SUBSET_MAX_GROUPS) {
+        groups = SUBSET_MAX_GROUPS;
+    }
+    vkCmdDispatch (commandBuffer, groups, 1, 1);
+    vkEndCommandBuffer (commandBuffer);
+}
+
+static void
+update_subset_descriptors (struct an_image *image) {
+    struct an_image_memory *buffers[4] = {
+        image->imageMemory, image->batchMemory, image->twiddleMemory,
+        image->subset->indicesMemory
+    };
+    size_t sizes[4] = {
+        sizeof (mycomplex) * image->actual_size,
+        sizeof (struct CFUpdateBatchHeader) +
+        sizeof (struct CFUpdateBatchPoint) * image->batchCapacity,
+        sizeof (mycomplex) * image->twiddle_size,
+        sizeof (unsigned int) * image->actual_size
+    };
+
+    an_write_storage_descriptors (image->ctx, image->batchDescriptorSet, buffers, sizes, 4);
+}
+
+static void
+update_batch_descriptors (struct an_image *image) {
     struct an_gpu_context *ctx = image->ctx;
 
-    if (image->computationLaunched) {
-        image->computationLaunched = 0;
+    VkDescriptorBufferInfo memoryInfo;
+    ZERO(memoryInfo);
+    memoryInfo.buffer = image->imageMemory->buffer;
+    memoryInfo.offset = 0;
+    memoryInfo.range = sizeof (mycomplex) * image->actual_size;
+
+    VkDescriptorBufferInfo batchInfo;
+    ZERO(batchInfo);
+    batchInfo.buffer = image->batchMemory->buffer;
+    batchInfo.offset = 0;
+    batchInfo.range = sizeof (struct CFUpdateBatchHeader) +
+        sizeof (struct CFUpdateBatchPoint) * image->batchCapacity;
+
+    VkDescriptorBufferInfo twiddleInfo;
+    ZERO(twiddleInfo);
+    twiddleInfo.buffer = image->twiddleMemory->buffer;
+    twiddleInfo.offset = 0;
+    twiddleInfo.range = sizeof (mycomplex) * image->twiddle_size;
+
+    VkWriteDescriptorSet dsSets[3];
+    memset (dsSets, 0, sizeof (dsSets));
+    dsSets[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    dsSets[0].dstSet = image->batchDescriptorSet;
+    dsSets[0].dstBinding = 0; // binding #
+    dsSets[0].dstArrayElement = 0;
+    dsSets[0].descriptorCount = 1;
+    dsSets[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    dsSets[0].pBufferInfo = &memoryInfo;
+    dsSets[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    dsSets[1].dstSet = image->batchDescriptorSet;
+    dsSets[1].dstBinding = 1; // binding #
+    dsSets[1].dstArrayElement = 0;
+    dsSets[1].descriptorCount = 1;
+    dsSets[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    dsSets[1].pBufferInfo = &batchInfo;
+    dsSets[2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    dsSets[2].dstSet = image->batchDescriptorSet;
+    dsSets[2].dstBinding = 2; // binding #
+    dsSets[2].dstArrayElement = 0;
+    dsSets[2].descriptorCount = 1;
+    dsSets[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    dsSets[2].pBufferInfo = &twiddleInfo;
+
+    vkUpdateDescriptorSets (ctx->device, 3, dsSets, 0, NULL);
+}
 
-        vkWaitForFences (ctx->device, 1, &image->fence, VK_TRUE, -1);
-        vkResetFences (ctx->device, 1, &image->fence);
+static void
+destroy_batch_memory (struct an_image *image) {
+    struct an_gpu_context *ctx = image->ctx;
+
+    image->batchPtr = NULL;
+
+    if (image->batchMemory != NULL) {
+        an_destroy_buffer (ctx, image->batchMemory);
+        image->batchMemory = NULL;
     }
+
+    image->batchCapacity = 0;
+}
+
+/*
+ * Make sure that the batch buffer can hold at least npoints
+ * updates. Resources for batched updates are created on the first
+ * call. The buffer grows geometrically, so reallocations are rare.
+ */
+static int
+ensure_batch_capacity (struct an_image *image, unsigned int npoints) {
+    struct an_gpu_context *ctx = image->ctx;
+    VkResult result;
+
+    if (npoints <= image->batchCapacity) {
+        return 1;
+    }
+
+    /* The old buffer may still be in use */
+    an_image_synchronize (image);
+
+    if (image->batchCommandBuffer == VK_NULL_HANDLE) {
+        result = an_create_command_buffer (ctx, &image->batchCommandBuffer);
+        if (result != VK_SUCCESS) {
+            fprintf (stderr, "Cannot allocate command buffer, code = %i\n", result);
+            return 0;
+        }
+    }
+
+    if (image->batchDescriptorSet == VK_NULL_HANDLE) {
+        enum pipeline_type type = (image->subset != NULL) ?
+            PIPELINE_CFUPDATE_SUBSET : PIPELINE_CFUPDATE_BATCH;
+        result = an_allocate_descriptor_set (ctx, ctx->pipelines[type],
+                                             &image->batchDescriptorPool,
+                                             &image->batchDescriptorSet);
+        if (result != VK_SUCCESS) {
+            fprintf (stderr, "Cannot allocate descriptor set, code = %i\n", result);
+            return 0;
+        }
+    }
+
+    unsigned int capacity = 2 * image->batchCapacity;
+    if (capacity < npoints) {
+        capacity = npoints;
+    }
+
+    destroy_batch_memory (image);
+    size_t size = sizeof (struct CFUpdateBatchHeader) +
+        sizeof (struct CFUpdateBatchPoint) * capacity;
+
+    image->batchMemory =
+        an_create_buffer (ctx, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                          size);
+    if (image->batchMemory == NULL) {
+        fprintf (stderr, "Cannot create batch buffer\n");
+        return 0;
+    }
+
+    image->batchPtr = image->batchMemory->mapped;
+    image->batchCapacity = capacity;
+
+    if (image->subset != NULL) {
+        update_subset_descriptors (image);
+        record_subset_command_buffer (image);
+    } else {
+        update_batch_descriptors (image);
+        record_command_buffer (image, image->batchCommandBuffer,
+                               PIPELINE_CFUPDATE_BATCH, image->batchDescriptorSet);
+    }
+    return 1;
+}
+
+void
+an_image_synchronize (struct an_image *image) {
+    double start = an_trace_begin (image->ctx);
+    an_wait_ticket (image->ctx, image->ticket);
+    an_trace_end (image->ctx, "an_image_synchronize", start);
 }
 
 void
 an_destroy_image (struct an_image *image) {
     struct an_gpu_context *ctx = image->ctx;
 
-    if (image->fence != VK_NULL_HANDLE) {
-        vkDestroyFence (ctx->device, image->fence, NULL);
+    an_resync_destroy (image);
+
+    if (ctx->backend != AN_BACKEND_CPU) {
+        an_image_synchronize (image);
     }
 
-    if (image->descriptorSet != VK_NULL_HANDLE) {
-        vkFreeDescriptorSets (ctx->device, ctx->descPool, 1, &image->descriptorSet);
+    an_free_descriptor_set (ctx, image->batchDescriptorPool, &image->batchDescriptorSet);
+
+    if (image->batchCommandBuffer != VK_NULL_HANDLE) {
+        an_stats_forget (ctx, image->batchCommandBuffer);
+        vkFreeCommandBuffers (ctx->device, ctx->cmdPool, 1, &image->batchCommandBuffer);
     }
 
+    destroy_batch_memory (image);
+
+    an_free_descriptor_set (ctx, image->descriptorPool, &image->descriptorSet);
+
     if (image->commandBuffer != VK_NULL_HANDLE) {
+        an_stats_forget (ctx, image->commandBuffer);
         vkFreeCommandBuffers (ctx->device, ctx->cmdPool, 1, &image->commandBuffer);
     }
 
-    if (image->uniformPtr != NULL) {
-        vkUnmapMemory (ctx->device, image->uniformMemory->memory);
-    }
-
     if (image->uniformMemory != NULL) {
         an_destroy_buffer (ctx, image->uniformMemory);
     }
@@ -107,49 +376,53 @@ an_destroy_image (struct an_image *image) {
     if (image->imageMemory != NULL) {
         an_destroy_buffer (ctx, image->imageMemory);
     }
-        
+
+    if (image->twiddleMemory != NULL) {
+        an_destroy_buffer (ctx, image->twiddleMemory);
+    }
+
+    free (image->twiddle);
+    free (image->cpuData);
     free (image);
 }
 
-struct an_image*
-an_create_image (struct an_gpu_context *ctx,
-                 const float           *real,
-                 const float           *imag,
-                 const unsigned int    *dimensions,
-                 unsigned int           ndim) {
-    if (ndim != ctx->ndim) {
-        fprintf (stderr, "Context dimensions must match image dimensions\n");
+/*
+ * Create an image with uninitialized spectrum. If SUBSET is not NULL,
+ * only its frequencies are stored and all updates are batched.
+ */
+static struct an_image*
+create_image (struct an_gpu_context         *ctx,
+              const unsigned int            *dimensions,
+              unsigned int                   ndim,
+              const struct an_frequency_set *subset) {
+    if (ndim == 0 || ndim > MAX_DIMENSIONS) {
+        fprintf (stderr, "Wrong number of dimensions\n");
         return NULL;
     }
 
-    mycomplex *data = NULL;
     VkResult result;
     struct an_image *image = malloc (sizeof (struct an_image));
     memset (image, 0, sizeof (struct an_image));
 
     image->ctx = ctx;
-    image->updateData.ndim = ndim;
-    image->actual_size = 1;
+    image->subset = subset;
+    image->actual_size = an_init_update_data (&image->updateData, dimensions, ndim);
+    image->twiddle = an_make_twiddle (&image->updateData, &image->twiddle_size);
 
-    for (int i = 0; i < image->updateData.ndim; i++) {
-        image->updateData.logical_dimensions[i] = dimensions[image->updateData.ndim - i - 1];
-        image->updateData.actual_dimensions[i] = dimensions[image->updateData.ndim - i - 1];
+    if (subset != NULL) {
+        image->actual_size = subset->count;
     }
 
-    image->updateData.actual_dimensions[0] =
-        image->updateData.actual_dimensions[0] / 2 + 1;
-
-    for (int i = 0; i < image->updateData.ndim; i++) {
-        image->updateData.stride[i] = 1;
+    if (ctx->backend == AN_BACKEND_CPU) {
+        image->cpuData = malloc (image->actual_size * sizeof (mycomplex));
+        return image;
     }
 
-    for (int i = 1; i < image->updateData.ndim; i++) {
-        image->updateData.stride[i] = image->updateData.stride[i-1] *
-            image->updateData.actual_dimensions[i-1];
-    }
-
-    for (int i = 0; i < image->updateData.ndim; i++) {
-        image->actual_size *= image->updateData.actual_dimensions[i];
+    /* Built on the first use of this number of dimensions */
+    result = an_prepare_pipelines (ctx, ndim);
+    if (result != VK_SUCCESS) {
+        fprintf (stderr, "Cannot create pipelines, code = %i\n", result);
+        goto cleanup;
     }
 
     image->imageMemory =
@@ -163,19 +436,25 @@ an_create_image (struct an_gpu_context *ctx,
         goto cleanup;
     }
 
-    data = malloc (image->actual_size * sizeof (mycomplex));
-    for (int i = 0; i < image->actual_size; i++) {
-        data[i].re = real[i];
-        data[i].im = imag[i];
+    image->twiddleMemory =
+        an_create_buffer (ctx, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                          VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                          image->twiddle_size * sizeof(mycomplex));
+    if (image->twiddleMemory == NULL) {
+        fprintf (stderr, "Cannot create twiddle buffer\n");
+        goto cleanup;
     }
 
-    if (!an_write_data (ctx, image->imageMemory, data,
-                        sizeof (mycomplex) * image->actual_size)) {
-        fprintf (stderr, "Cannot write data to image memory\n");
-        free (data);
+    if (!an_write_data (ctx, image->twiddleMemory, image->twiddle,
+                        sizeof (mycomplex) * image->twiddle_size)) {
+        fprintf (stderr, "Cannot write data to twiddle memory\n");
         goto cleanup;
     }
-    free (data);
+
+    if (subset != NULL) {
+        return image;
+    }
 
     image->uniformMemory =
         an_create_buffer (ctx, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
@@ -187,14 +466,7 @@ an_create_image (struct an_gpu_context *ctx,
         goto cleanup;
     }
 
-    void *ptr;
-    result = vkMapMemory (ctx->device, image->uniformMemory->memory, 0,
-                          sizeof (struct CFUpdateDataUni), 0, &ptr);
-    if (result != VK_SUCCESS) {
-        fprintf (stderr, "Cannot map uniform buffer, code = %i\n", result);
-        goto cleanup;
-    }
-    image->uniformPtr = ptr;
+    image->uniformPtr = image->uniformMemory->mapped;
 
     /* Number of work groups */
     const unsigned int *grpSize = &update_group_sizes[MAX_DIMENSIONS * (ndim - 1)];
@@ -210,20 +482,16 @@ an_create_image (struct an_gpu_context *ctx,
     }
 
     result = an_allocate_descriptor_set (ctx, ctx->pipelines[PIPELINE_CFUPDATE],
+                                         &image->descriptorPool,
                                          &image->descriptorSet);
     if (result != VK_SUCCESS) {
         fprintf (stderr, "Cannot allocate descriptor set, code = %i\n", result);
         goto cleanup;
     }
 
-    result = an_create_fence (ctx, &image->fence);
-    if (result != VK_SUCCESS) {
-        fprintf (stderr, "Cannot create a fence, code = %i\n", result);
-        goto cleanup;
-    }
-
     update_descriptors (image);
-    record_command_buffer (image);
+    record_command_buffer (image, image->commandBuffer,
+                           PIPELINE_CFUPDATE, image->descriptorSet);
     return image;
 
 cleanup:
@@ -231,48 +499,460 @@ cleanup:
     return NULL;
 }
 
+struct split_data {
+    float *real;
+    float *imag;
+};
+
+static void
+fill_split (void *staging, size_t offset, size_t size, void *arg) {
+    const struct split_data *data = arg;
+    size_t start = offset / sizeof (mycomplex);
+
+    assert (offset % sizeof (mycomplex) == 0);
+    an_interleave (staging, data->real + start, data->imag + start,
+                   size / sizeof (mycomplex));
+}
+
+static void
+drain_split (const void *staging, size_t offset, size_t size, void *arg) {
+    const struct split_data *data = arg;
+    size_t start = offset / sizeof (mycomplex);
+
+    assert (offset % sizeof (mycomplex) == 0);
+    an_deinterleave (data->real + start, data->imag + start, staging,
+                     size / sizeof (mycomplex));
+}
+
+/* Interleave split arrays straight into the staging memory */
+int
+an_image_write_spectrum (struct an_image *image, const float *real, const float *imag) {
+    struct an_gpu_context *ctx = image->ctx;
+
+    if (ctx->backend == AN_BACKEND_CPU) {
+        an_interleave (image->cpuData, real, imag, image->actual_size);
+        return 1;
+    }
+
+    struct split_data data = { (float*)real, (float*)imag };
+    return an_write_data_with (ctx, image->imageMemory,
+                               sizeof (mycomplex) * image->actual_size,
+                               fill_split, &data);
+}
+
+struct an_image*
+an_create_image (struct an_gpu_context *ctx,
+                 const float           *real,
+                 const float           *imag,
+                 const unsigned int    *dimensions,
+                 unsigned int           ndim) {
+    struct an_image *image = create_image (ctx, dimensions, ndim, NULL);
+    if (image == NULL) {
+        return NULL;
+    }
+
+    if (!an_image_write_spectrum (image, real, imag)) {
+        fprintf (stderr, "Cannot write data to image memory\n");
+        an_destroy_image (image);
+        return NULL;
+    }
+
+    return image;
+}
+
+struct an_image*
+an_create_image_interleaved (struct an_gpu_context *ctx,
+                             const float           *data,
+                             const unsigned int    *dimensions,
+                             unsigned int           ndim) {
+    struct an_image *image = create_image (ctx, dimensions, ndim, NULL);
+    if (image == NULL) {
+        return NULL;
+    }
+
+    size_t size = sizeof (mycomplex) * image->actual_size;
+    if (ctx->backend == AN_BACKEND_CPU) {
+        memcpy (image->cpuData, data, size);
+    } else if (!an_write_data (ctx, image->imageMemory, data, size)) {
+        fprintf (stderr, "Cannot write data to image memory\n");
+        an_destroy_image (image);
+        return NULL;
+    }
+
+    return image;
+}
+
+/* Dimensions of the full volume in the order of the public interface */
+static unsigned int
+subset_dimensions (const struct an_frequency_set *set, unsigned int *dimensions) {
+    unsigned int ndim = set->updateData.ndim;
+
+    for (int i = 0; i < ndim; i++) {
+        dimensions[i] = set->updateData.logical_dimensions[ndim - i - 1];
+    }
+
+    return ndim;
+}
+
+struct an_image*
+an_create_image_subset (struct an_gpu_context         *ctx,
+                        const struct an_frequency_set *set,
+                        const float                   *real,
+                        const float                   *imag) {
+    unsigned int dimensions[MAX_DIMENSIONS];
+
+    if (set->ctx != ctx) {
+        fprintf (stderr, "The frequency set belongs to another context\n");
+        return NULL;
+    }
+
+    unsigned int ndim = subset_dimensions (set, dimensions);
+    struct an_image *image = create_image (ctx, dimensions, ndim, set);
+    if (image == NULL) {
+        return NULL;
+    }
+
+    float *compactReal = malloc (sizeof (float) * set->count);
+    float *compactImag = malloc (sizeof (float) * set->count);
+    an_subset_gather (set, real, compactReal);
+    an_subset_gather (set, imag, compactImag);
+
+    int ok = an_image_write_spectrum (image, compactReal, compactImag);
+    free (compactReal);
+    free (compactImag);
+
+    if (!ok) {
+        fprintf (stderr, "Cannot write data to image memory\n");
+        an_destroy_image (image);
+        return NULL;
+    }
+
+    return image;
+}
+
+struct an_image*
+an_create_image_subset_from_real (struct an_gpu_context         *ctx,
+                                  const struct an_frequency_set *set,
+                                  const float                   *array) {
+    unsigned int dimensions[MAX_DIMENSIONS];
+    unsigned int ndim = subset_dimensions (set, dimensions);
+    struct an_image *image = NULL;
+
+    float *real = malloc (sizeof (float) * set->full_size);
+    float *imag = malloc (sizeof (float) * set->full_size);
+
+    if (an_rfft (array, real, imag, dimensions, ndim)) {
+        image = an_create_image_subset (ctx, set, real, imag);
+    } else {
+        fprintf (stderr, "Cannot initialize the image\n");
+    }
+
+    free (real);
+    free (imag);
+    return image;
+}
+
+/* Size of the real volume */
+static size_t
+real_size (const struct an_image *image) {
+    size_t size = 1;
+    for (int i = 0; i < image->updateData.ndim; i++) {
+        size *= image->updateData.logical_dimensions[i];
+    }
+
+    return size;
+}
+
+struct an_image*
+an_create_image_from_real (struct an_gpu_context *ctx,
+                           const float           *array,
+                           const unsigned int    *dimensions,
+                           unsigned int           ndim) {
+    struct an_image *image = create_image (ctx, dimensions, ndim, NULL);
+    if (image == NULL) {
+        return NULL;
+    }
+
+    if (ctx->backend != AN_BACKEND_CPU && an_gpu_fft_supported (&image->updateData)) {
+        size_t size = real_size (image);
+        struct an_image_memory *realMemory =
+            an_create_buffer (ctx, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                              VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                              VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                              size * sizeof (float));
+        int ok = realMemory != NULL &&
+            an_write_data (ctx, realMemory, array, size * sizeof (float)) &&
+            an_gpu_rfft (image, realMemory);
+
+        if (realMemory != NULL) {
+            an_destroy_buffer (ctx, realMemory);
+        }
+
+        if (!ok) {
+            fprintf (stderr, "Cannot calculate FFT on the device\n");
+            an_destroy_image (image);
+            return NULL;
+        }
+
+        return image;
+    }
+
+    /* Transform on the host */
+    float *real = malloc (sizeof (float) * image->actual_size);
+    float *imag = malloc (sizeof (float) * image->actual_size);
+    int ok = an_rfft (array, real, imag, dimensions, ndim);
+    if (ok) {
+        ok = an_image_write_spectrum (image, real, imag);
+    }
+
+    free (real);
+    free (imag);
+
+    if (!ok) {
+        fprintf (stderr, "Cannot initialize the image\n");
+        an_destroy_image (image);
+        return NULL;
+    }
+
+    return image;
+}
+
+int
+an_image_get_real (struct an_image *image,
+                   float           *array) {
+    struct an_gpu_context *ctx = image->ctx;
+    unsigned int dimensions[MAX_DIMENSIONS];
+    unsigned int ndim = image->updateData.ndim;
+    size_t size = real_size (image);
+    int ok;
+
+    if (image->subset != NULL) {
+        fprintf (stderr, "Cannot recover the volume from a frequency subset\n");
+        return 0;
+    }
+
+    for (int i = 0; i < ndim; i++) {
+        dimensions[i] = image->updateData.logical_dimensions[ndim - i - 1];
+    }
+
+    if (ctx->backend != AN_BACKEND_CPU && an_gpu_fft_supported (&image->updateData)) {
+        an_image_synchronize (image);
+        struct an_image_memory *realMemory =
+            an_create_buffer (ctx, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                              VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                              VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                              VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                              size * sizeof (float));
+        ok = realMemory != NULL &&
+            an_gpu_irfft (image, realMemory) &&
+            an_read_data (ctx, realMemory, array, size * sizeof (float));
+
+        if (realMemory != NULL) {
+            an_destroy_buffer (ctx, realMemory);
+        }
+    } else {
+        float *real = malloc (sizeof (float) * image->actual_size);
+        float *imag = malloc (sizeof (float) * image->actual_size);
+        ok = an_image_get (image, real, imag) &&
+            an_irfft (array, real, imag, dimensions, ndim);
+        free (real);
+        free (imag);
+    }
+
+    /* Both transforms are not normalized */
+    if (ok) {
+        for (size_t i = 0; i < size; i++) {
+            array[i] /= size;
+        }
+    }
+
+    return ok;
+}
+
 int
 an_image_get (struct an_image *image,
               float           *real,
               float           *imag) {
     struct an_gpu_context *ctx = image->ctx;
 
-    an_image_synchronize (image);
-    mycomplex *data = malloc (sizeof (mycomplex) * image->actual_size);
-    int res = an_read_data (ctx, image->imageMemory, data,
-                            sizeof (mycomplex) * image->actual_size);
-    for (int i = 0; i < image->actual_size; i++) {
-        real[i] = data[i].re;
-        imag[i] = data[i].im;
+    if (ctx->backend == AN_BACKEND_CPU) {
+        an_deinterleave (real, imag, image->cpuData, image->actual_size);
+        return 1;
     }
-    free (data);
-    return res;
+
+    /* De-interleave straight from the staging memory */
+    struct split_data data = { real, imag };
+    an_image_synchronize (image);
+    return an_read_data_with (ctx, image->imageMemory,
+                              sizeof (mycomplex) * image->actual_size,
+                              drain_split, &data);
 }
 
 int
-an_image_update_fft (struct an_image    *image,
-                     const unsigned int *coord,
-                     unsigned int        ndim,
-                     float               delta) {
+an_image_get_interleaved (struct an_image *image,
+                          float           *data) {
+    struct an_gpu_context *ctx = image->ctx;
+    size_t size = sizeof (mycomplex) * image->actual_size;
+
+    if (ctx->backend == AN_BACKEND_CPU) {
+        memcpy (data, image->cpuData, size);
+        return 1;
+    }
+
+    an_image_synchronize (image);
+    return an_read_data (ctx, image->imageMemory, data, size);
+}
+
+static int
+update_fft (struct an_image    *image,
+            const unsigned int *coord,
+            unsigned int        ndim,
+            float               delta) {
     if (ndim != image->updateData.ndim) {
         fprintf (stderr, "Wrong dimensions\n");
         return 0;
     }
 
+    /* There is no single point pipeline for subsets */
+    if (image->subset != NULL) {
+        return an_image_update_fft_batch (image, coord, &delta, 1, ndim);
+    }
+
     struct an_gpu_context *ctx = image->ctx;
+    if (ctx->backend == AN_BACKEND_CPU) {
+        struct CFUpdateBatchPoint point;
+        an_fill_batch_points (&point, coord, &delta, 1, ndim);
+        an_cpu_update (image, &point, 1);
+        image->generation++;
+        return an_resync_record (image, &point, 1);
+    }
+
     an_image_synchronize (image);
     image->uniformPtr->c = delta;
     for (int i = 0; i < image->updateData.ndim; i++) {
         image->uniformPtr->point[i] = coord[image->updateData.ndim - i - 1];
     }
 
-    VkSubmitInfo submitInfo;
-    ZERO(submitInfo);
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &image->commandBuffer;
-    vkQueueSubmit (ctx->queue, 1, &submitInfo, image->fence);
-    image->computationLaunched = 1;
+    image->ticket = an_submit (ctx, image->commandBuffer);
+    image->generation++;
+
+    if (image->resync != NULL) {
+        struct CFUpdateBatchPoint point;
+        an_fill_batch_points (&point, coord, &delta, 1, ndim);
+        return an_resync_record (image, &point, 1);
+    }
+
+    return 1;
+}
+
+int
+an_image_update_fft (struct an_image    *image,
+                     const unsigned int *coord,
+                     unsigned int        ndim,
+                     float               delta) {
+    double start = an_trace_begin (image->ctx);
+    int ok = update_fft (image, coord, ndim, delta);
+    an_trace_end (image->ctx, "an_image_update_fft", start);
+    return ok;
+}
+
+void
+an_fill_batch_points (struct CFUpdateBatchPoint *points,
+                      const unsigned int        *coords,
+                      const float               *deltas,
+                      unsigned int               npoints,
+                      unsigned int               ndim) {
+    for (unsigned int k = 0; k < npoints; k++) {
+        const unsigned int *coord = coords + k * ndim;
+        for (int i = 0; i < ndim; i++) {
+            points[k].point[i] = coord[ndim - i - 1];
+        }
+        points[k].c = deltas[k];
+    }
+}
+
+static int
+submit_batch (struct an_image *image) {
+    struct an_gpu_context *ctx = image->ctx;
+
+    image->ticket = an_submit (ctx, image->batchCommandBuffer);
+    image->generation++;
 
     return 1;
 }
+
+int
+an_image_submit_batch (struct an_image                 *image,
+                       const struct CFUpdateBatchPoint *points,
+                       unsigned int                     npoints) {
+    if (npoints == 0) {
+        return 1;
+    }
+
+    if (image->ctx->backend == AN_BACKEND_CPU) {
+        an_cpu_update (image, points, npoints);
+        image->generation++;
+        return an_resync_record (image, points, npoints);
+    }
+
+    if (!ensure_batch_capacity (image, npoints)) {
+        return 0;
+    }
+
+    an_image_synchronize (image);
+    memcpy (image->batchPtr + 1, points, sizeof (struct CFUpdateBatchPoint) * npoints);
+    image->batchPtr->npoints = npoints;
+
+    return submit_batch (image) && an_resync_record (image, points, npoints);
+}
+
+static int
+update_fft_batch (struct an_image    *image,
+                  const unsigned int *coords,
+                  const float        *deltas,
+                  unsigned int        npoints,
+                  unsigned int        ndim) {
+    if (ndim != image->updateData.ndim) {
+        fprintf (stderr, "Wrong dimensions\n");
+        return 0;
+    }
+
+    if (npoints == 0) {
+        return 1;
+    }
+
+    if (image->ctx->backend == AN_BACKEND_CPU) {
+        struct CFUpdateBatchPoint *points =
+            malloc (sizeof (struct CFUpdateBatchPoint) * npoints);
+        an_fill_batch_points (points, coords, deltas, npoints, ndim);
+        an_cpu_update (image, points, npoints);
+        image->generation++;
+        int ok = an_resync_record (image, points, npoints);
+        free (points);
+        return ok;
+    }
+
+    if (!ensure_batch_capacity (image, npoints)) {
+        return 0;
+    }
+
+    an_image_synchronize (image);
+    struct CFUpdateBatchPoint *points = (struct CFUpdateBatchPoint*)(image->batchPtr + 1);
+    an_fill_batch_points (points, coords, deltas, npoints, ndim);
+    image->batchPtr->npoints = npoints;
+
+    /* The batch memory is host-visible and not touched until the next batch */
+    return submit_batch (image) && an_resync_record (image, points, npoints);
+}
+
+int
+an_image_update_fft_batch (struct an_image    *image,
+                           const unsigned int *coords,
+                           const float        *deltas,
+                           unsigned int        npoints,
+                           unsigned int        ndim) {
+    double start = an_trace_begin (image->ctx);
+    int ok = update_fft_batch (image, coords, deltas, npoints, ndim);
+    an_trace_end (image->ctx, "an_image_update_fft_batch", start);
+    return ok;
+}
@@ -0,0 +1,131 @@
+/* Conversion between split and interleaved complex arrays */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <vulkan/vulkan.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AN_X86 1
+#include <immintrin.h>
+#endif
+
+#include "annealing-lowlevel.h"
+#include "internal.h"
+
+typedef void (*interleave_fn) (mycomplex *dst, const float *re, const float *im, size_t n);
+typedef void (*deinterleave_fn) (float *re, float *im, const mycomplex *src, size_t n);
+
+static void
+interleave_scalar (mycomplex *dst, const float *re, const float *im, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        dst[i].re = re[i];
+        dst[i].im = im[i];
+    }
+}
+
+static void
+deinterleave_scalar (float *re, float *im, const mycomplex *src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        re[i] = src[i].re;
+        im[i] = src[i].im;
+    }
+}
+
+#ifdef AN_X86
+__attribute__((target("sse2"))) static void
+interleave_sse2 (mycomplex *dst, const float *re, const float *im, size_t n) {
+    size_t i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m128 r = _mm_loadu_ps (re + i);
+        __m128 c = _mm_loadu_ps (im + i);
+        _mm_storeu_ps (dst[i].s,     _mm_unpacklo_ps (r, c));
+        _mm_storeu_ps (dst[i + 2].s, _mm_unpackhi_ps (r, c));
+    }
+
+    interleave_scalar (dst + i, re + i, im + i, n - i);
+}
+
+__attribute__((target("sse2"))) static void
+deinterleave_sse2 (float *re, float *im, const mycomplex *src, size_t n) {
+    size_t i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m128 a = _mm_loadu_ps (src[i].s);
+        __m128 b = _mm_loadu_ps (src[i + 2].s);
+        _mm_storeu_ps (re + i, _mm_shuffle_ps (a, b, _MM_SHUFFLE (2, 0, 2, 0)));
+        _mm_storeu_ps (im + i, _mm_shuffle_ps (a, b, _MM_SHUFFLE (3, 1, 3, 1)));
+    }
+
+    deinterleave_scalar (re + i, im + i, src + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+interleave_avx2 (mycomplex *dst, const float *re, const float *im, size_t n) {
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m256 r  = _mm256_loadu_ps (re + i);
+        __m256 c  = _mm256_loadu_ps (im + i);
+        /* r0 c0 r1 c1 | r4 c4 r5 c5 and r2 c2 r3 c3 | r6 c6 r7 c7 */
+        __m256 lo = _mm256_unpacklo_ps (r, c);
+        __m256 hi = _mm256_unpackhi_ps (r, c);
+        _mm256_storeu_ps (dst[i].s,     _mm256_permute2f128_ps (lo, hi, 0x20));
+        _mm256_storeu_ps (dst[i + 4].s, _mm256_permute2f128_ps (lo, hi, 0x31));
+    }
+
+    interleave_scalar (dst + i, re + i, im + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+deinterleave_avx2 (float *re, float *im, const mycomplex *src, size_t n) {
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m256 a = _mm256_loadu_ps (src[i].s);
+        __m256 b = _mm256_loadu_ps (src[i + 4].s);
+        /* r0 r1 r4 r5 | r2 r3 r6 r7, put 64-bit pairs in order */
+        __m256 r = _mm256_shuffle_ps (a, b, _MM_SHUFFLE (2, 0, 2, 0));
+        __m256 c = _mm256_shuffle_ps (a, b, _MM_SHUFFLE (3, 1, 3, 1));
+        r = _mm256_castpd_ps (_mm256_permute4x64_pd (_mm256_castps_pd (r),
+                                                     _MM_SHUFFLE (3, 1, 2, 0)));
+        c = _mm256_castpd_ps (_mm256_permute4x64_pd (_mm256_castps_pd (c),
+                                                     _MM_SHUFFLE (3, 1, 2, 0)));
+        _mm256_storeu_ps (re + i, r);
+        _mm256_storeu_ps (im + i, c);
+    }
+
+    deinterleave_scalar (re + i, im + i, src + i, n - i);
+}
+#endif
+
+static interleave_fn interleave_kernel = interleave_scalar;
+static deinterleave_fn deinterleave_kernel = deinterleave_scalar;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void
+select_kernels (void) {
+#ifdef AN_X86
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("avx2")) {
+        interleave_kernel = interleave_avx2;
+        deinterleave_kernel = deinterleave_avx2;
+    } else if (__builtin_cpu_supports ("sse2")) {
+        interleave_kernel = interleave_sse2;
+        deinterleave_kernel = deinterleave_sse2;
+    }
+#endif
+}
+
+void
+an_interleave (mycomplex *dst, const float *re, const float *im, size_t n) {
+    pthread_once (&kernels_once, select_kernels);
+    interleave_kernel (dst, re, im, n);
+}
+
+void
+an_deinterleave (float *re, float *im, const mycomplex *src, size_t n) {
+    pthread_once (&kernels_once, select_kernels);
+    deinterleave_kernel (re, im, src, n);
+}
@@ -1,7 +1,10 @@
 #pragma once
 
 #define ZERO(x) memset(&(x), 0, sizeof(x))
-#define DESCRIPTORS_IN_POOL 15
+/* Descriptor pools, see an_allocate_descriptor_set() */
+#define DESCRIPTOR_SETS_IN_POOL 16
+#define MAX_DESCRIPTOR_SETS_IN_POOL 1024
+#define MAX_STORAGE_BUFFERS_IN_SET 8
 
 extern const unsigned int update_group_sizes[];
 
@@ -18,16 +21,100 @@ struct CFUpdateDataUni {
     float c;
 };
 
+/* Storage buffer with a batch of updates. Layout matches std430 */
+struct CFUpdateBatchPoint {
+    unsigned int point[MAX_DIMENSIONS];
+    float c;
+};
+
+struct CFUpdateBatchHeader {
+    unsigned int npoints;
+    unsigned int unused[3];
+};
+
 struct MetricUpdateData {
     unsigned int length;
+    unsigned int target;
+    unsigned int accumulate;
+    unsigned int format;
+};
+
+/* Updates (or moves) which also reduce into a slot of the result buffer */
+struct CFUpdateReduceData {
+    struct CFUpdateDataConst dims;
+    unsigned int target;
+    unsigned int accumulate;
+    unsigned int format;
+};
+
+/* See metric-multi.comp */
+#define MULTI_METRIC_MAX_TARGETS 8
+
+struct MultiMetricData {
+    unsigned int length;
+    unsigned int ntargets;
+    unsigned int stride;
+    unsigned int format;
+    unsigned int weighted;
+};
+
+/* See update-s2-subset.comp */
+struct SubsetUpdateData {
+    struct CFUpdateDataConst dims;
+    unsigned int count;
+};
+
+struct ReplicasUpdateData {
+    struct CFUpdateDataConst dims;
+    unsigned int length;
+    unsigned int maxpoints;
+};
+
+/* Stockham FFT stage, see fft-stockham.comp */
+struct FFTStageData {
+    unsigned int length;
+    unsigned int stride;
+    unsigned int lines;
+    unsigned int p;
+    unsigned int twiddleOffset;
+    unsigned int twiddleStep;
+    int inverse;
+};
+
+/* Conversion between real rows and half-spectrum, see fft-real.comp */
+struct FFTRealData {
+    unsigned int half;
+    unsigned int rows;
+    int inverse;
+};
+
+/* Single pass reduction, see shaders/reduce.glsl */
+#define METRIC_GRP_SIZE 256
+#define METRIC_MAX_GROUPS 256
+
+/* Slots in the result buffer of a metric */
+enum metric_result {
+    METRIC_RESULT_DISTANCE = 0,
+    METRIC_RESULT_MOVE,
+    METRIC_RESULT_COUNT
 };
 
 /* Pipelines */
 
 enum pipeline_type {
     PIPELINE_CFUPDATE = 0,
+    PIPELINE_CFUPDATE_BATCH,
+    PIPELINE_CFUPDATE_SUBSET,
+    PIPELINE_CFUPDATE_TRACKED,
     PIPELINE_METRIC,
-    PIPELINE_REDUCE,
+    PIPELINE_METRIC_MOVE,
+    PIPELINE_METRIC_MULTI,
+    PIPELINE_REPLICAS_UPDATE,
+    PIPELINE_FFT_RADIX2,
+    PIPELINE_FFT_RADIX3,
+    PIPELINE_FFT_RADIX4,
+    PIPELINE_FFT_RADIX5,
+    PIPELINE_FFT_REAL,
     PIPELINE_COUNT
 };
 
@@ -35,36 +122,210 @@ struct pipeline {
     VkShaderModule shader;
     VkDescriptorSetLayout descriptorSetLayout;
     VkPipelineLayout pipelineLayout;
-    VkPipeline pipeline;
+    /* Indexed by ndim - 1 if the pipeline is specialized for ndim, see an_get_pipeline() */
+    VkPipeline variants[MAX_DIMENSIONS];
 };
 
+struct an_cpu_pool;
+struct an_staging;
+struct an_memory_block;
+struct an_stats_state;
+struct an_trace;
+
 struct an_gpu_context {
-    uint32_t ndim;
+    enum an_backend backend;
+    struct an_cpu_pool *pool;
+
     VkInstance instance;
     uint32_t queueFamilyID;
     VkPhysicalDevice physDev;
     VkDevice device;
     VkPipelineCache cache;
-    VkDescriptorPool descPool;
+    /* Size of the cache data on disk, see pipeline-cache.c */
+    size_t cacheSize;
+    VkDescriptorPool *descPools;
+    int nDescPools;
+    uint32_t descPoolSets;
     VkCommandPool cmdPool;
     VkQueue queue;
+    uint32_t apiVersion;
+    int hasSubgroups;
+    /* VK_EXT_calibrated_timestamps is enabled, see trace.c */
+    int hasCalibratedTimestamps;
+
+    /* Memory blocks for each memory type, see allocator.c */
+    VkPhysicalDeviceMemoryProperties memProperties;
+    struct an_memory_block *memBlocks[VK_MAX_MEMORY_TYPES];
+
+    /* Submission tickets, see an_submit() */
+    int hasTimeline;
+    VkSemaphore timeline;
+    VkFence submitFence;
+    uint64_t ticket;
+    uint64_t completed;
+
+    /* Staging buffers for transfers, see buffer.c */
+    struct an_staging *staging;
+
+    /* Timings and counters or NULL, see stats.c */
+    struct an_stats_state *stats;
+    /* Recorded events or NULL, see trace.c */
+    struct an_trace *trace;
 
     struct pipeline *pipelines[PIPELINE_COUNT];
 };
 
-/* Fences */
-VkResult
-an_create_fence (struct an_gpu_context *ctx, VkFence *fence);
+/* Submissions */
+uint64_t
+an_submit (struct an_gpu_context *ctx, VkCommandBuffer commandBuffer);
+
+int
+an_ticket_completed (struct an_gpu_context *ctx, uint64_t ticket);
+
+void
+an_wait_ticket (struct an_gpu_context *ctx, uint64_t ticket);
 
 void
 an_image_synchronize (struct an_image *image);
 
+/*
+ * Statistics, see stats.c. All of these return immediately if
+ * statistics are not enabled.
+ */
+enum stats_counter {
+    STATS_SUBMITS,
+    STATS_WAITS,
+    STATS_ALLOCATIONS,
+    STATS_BYTES_UPLOADED,
+    STATS_BYTES_DOWNLOADED
+};
+
+/* Monotonic host time in seconds */
+double
+an_clock (void);
+
+/* Create the state and the query pool without enabling statistics */
+int
+an_stats_prepare (struct an_gpu_context *ctx);
+
+int
+an_stats_has_timestamps (struct an_gpu_context *ctx);
+
+/* Nanoseconds between two device timestamps */
+double
+an_stats_ticks_ns (struct an_gpu_context *ctx, uint64_t from, uint64_t to);
+
+/* Read timestamps of all finished submissions */
+void
+an_stats_collect (struct an_gpu_context *ctx);
+
+void
+an_stats_destroy (struct an_gpu_context *ctx);
+
+/* Time submissions of a command buffer as STAGE, called when it is recorded */
+void
+an_stats_register (struct an_gpu_context *ctx, VkCommandBuffer commandBuffer,
+                   enum an_stat_stage stage);
+
+/* The command buffer is about to be freed */
+void
+an_stats_forget (struct an_gpu_context *ctx, VkCommandBuffer commandBuffer);
+
+/*
+ * The command buffer is about to be submitted. Fills COMMANDBUFFERS
+ * (up to 3) with what to submit instead and returns their number.
+ */
+uint32_t
+an_stats_submitted (struct an_gpu_context *ctx, VkCommandBuffer commandBuffer,
+                    uint64_t ticket, VkCommandBuffer *commandBuffers);
+
+/* Host side timings: the start time (0 if disabled) and the sample */
+double
+an_stats_start (struct an_gpu_context *ctx);
+
+void
+an_stats_time (struct an_gpu_context *ctx, enum an_stat_stage stage, double start);
+
+void
+an_stats_count (struct an_gpu_context *ctx, enum stats_counter counter, uint64_t n);
+
+/*
+ * Tracing, see trace.c. an_trace_begin() returns the start time of a
+ * span or 0 if there is no trace.
+ */
+double
+an_trace_begin (struct an_gpu_context *ctx);
+
+void
+an_trace_end (struct an_gpu_context *ctx, const char *name, double start);
+
+/* Execution of a stage on the device between two timestamps */
+void
+an_trace_device (struct an_gpu_context *ctx, enum an_stat_stage stage,
+                 uint64_t begin, uint64_t end);
+
+void
+an_trace_destroy (struct an_gpu_context *ctx);
+
+/* Spectrum geometry */
+size_t
+an_init_update_data (struct CFUpdateDataConst *data,
+                     const unsigned int       *dimensions,
+                     unsigned int              ndim);
+
+/*
+ * Offsets of NPOINTS points of a real volume with row-major STRIDES,
+ * 0 if some of them are out of it. See directional.c
+ */
+int
+an_real_positions (const unsigned int *dimensions,
+                   const size_t       *strides,
+                   unsigned int        ndim,
+                   const unsigned int *coords,
+                   unsigned int        npoints,
+                   size_t             *result);
+
+/* Batched updates */
+struct CFUpdateBatchPoint;
+
+void
+an_fill_batch_points (struct CFUpdateBatchPoint *points,
+                      const unsigned int        *coords,
+                      const float               *deltas,
+                      unsigned int               npoints,
+                      unsigned int               ndim);
+
+int
+an_image_submit_batch (struct an_image                 *image,
+                       const struct CFUpdateBatchPoint *points,
+                       unsigned int                     npoints);
+
 /* Descriptor sets */
 VkResult
 an_allocate_descriptor_set (struct an_gpu_context *ctx,
                             struct pipeline *pipeline,
+                            VkDescriptorPool *pool,
                             VkDescriptorSet *descriptorSet);
 
+void
+an_free_descriptor_set (struct an_gpu_context *ctx,
+                        VkDescriptorPool pool,
+                        VkDescriptorSet *descriptorSet);
+
+/* Pipelines for a given number of dimensions */
+VkResult
+an_prepare_pipelines (struct an_gpu_context *ctx, unsigned int ndim);
+
+VkPipeline
+an_get_pipeline (struct an_gpu_context *ctx, enum pipeline_type type, unsigned int ndim);
+
+/* Pipeline cache */
+VkResult
+an_create_pipeline_cache (struct an_gpu_context *ctx);
+
+void
+an_save_pipeline_cache (struct an_gpu_context *ctx);
+
 /* Command buffers */
 VkResult
 an_create_command_buffer (struct an_gpu_context *ctx, VkCommandBuffer *buffer);
@@ -74,49 +335,258 @@ an_create_command_buffer (struct an_gpu_context *ctx, VkCommandBuffer *buffer);
 struct an_image_memory {
     VkBuffer buffer;
     VkDeviceMemory memory;
+
+    /* Placement in a memory block, see an_allocate_memory() */
+    struct an_memory_block *block;
+    VkDeviceSize offset;
+    VkDeviceSize size;
+    /* Host address of the buffer if it is host-visible, NULL otherwise */
+    void *mapped;
 };
 
+int
+an_allocate_memory (struct an_gpu_context         *ctx,
+                    const VkMemoryRequirements    *requirements,
+                    VkMemoryPropertyFlags          properties,
+                    struct an_image_memory        *imemory);
+
+void
+an_free_memory (struct an_gpu_context *ctx, struct an_image_memory *imemory);
+
+void
+an_destroy_allocator (struct an_gpu_context *ctx);
+
+/* Write storage buffer descriptors for bindings 0 ... count-1 */
+void
+an_write_storage_descriptors (struct an_gpu_context        *ctx,
+                              VkDescriptorSet               set,
+                              struct an_image_memory *const *buffers,
+                              const size_t                 *sizes,
+                              unsigned int                  count);
+
 typedef union
 {
     float __attribute__((aligned (8))) s[2];
     __extension__ struct{ float  re, im; };
 } mycomplex;
 
+/* Split <-> interleaved complex arrays (SIMD when available) */
+void
+an_interleave (mycomplex *dst, const float *re, const float *im, size_t n);
+
+void
+an_deinterleave (float *re, float *im, const mycomplex *src, size_t n);
+
+mycomplex*
+an_make_twiddle (const struct CFUpdateDataConst *data, size_t *size);
+
 struct an_image {
     struct an_gpu_context *ctx;
     VkCommandBuffer commandBuffer;
     VkDescriptorSet descriptorSet;
-    VkFence fence;
-    int computationLaunched;
+    VkDescriptorPool descriptorPool;
+    /* The last submission which modifies the image */
+    uint64_t ticket;
+    /* Incremented on each modification of the spectrum */
+    unsigned long generation;
 
     struct CFUpdateDataConst updateData;
     size_t actual_size;
     uint32_t ngroups[MAX_DIMENSIONS];
 
     struct an_image_memory *imageMemory;
+    /* Spectrum for the CPU backend */
+    mycomplex *cpuData;
+    /* Roots of unity for each axis, see an_make_twiddle() */
+    mycomplex *twiddle;
+    size_t twiddle_size;
+    struct an_image_memory *twiddleMemory;
     struct an_image_memory *uniformMemory;
     struct CFUpdateDataUni *uniformPtr;
+
+    /* Batched updates (created on demand) */
+    VkCommandBuffer batchCommandBuffer;
+    VkDescriptorSet batchDescriptorSet;
+    VkDescriptorPool batchDescriptorPool;
+    unsigned int batchCapacity;
+    struct an_image_memory *batchMemory;
+    struct CFUpdateBatchHeader *batchPtr;
+
+    /* Drift resynchronization (see resync.c) */
+    struct an_resync *resync;
+
+    /* Stored frequencies or NULL for the whole spectrum (see subset.c) */
+    const struct an_frequency_set *subset;
+};
+
+int
+an_image_write_spectrum (struct an_image *image, const float *real, const float *imag);
+
+/* Track updated points, may resynchronize the spectrum */
+int
+an_resync_record (struct an_image                 *image,
+                  const struct CFUpdateBatchPoint *points,
+                  unsigned int                     npoints);
+
+/* The spectrum was replaced, recover the real volume from it */
+int
+an_resync_reload (struct an_image *image);
+
+void
+an_resync_destroy (struct an_image *image);
+
+/*
+ * Frequencies retained in a compact spectrum. The geometry is that of
+ * the full half-spectrum, indices are positions in it.
+ */
+struct an_frequency_set {
+    struct an_gpu_context *ctx;
+    struct CFUpdateDataConst updateData;
+    size_t full_size;
+    size_t count;
+    unsigned int *indices;
+    struct an_image_memory *indicesMemory;
 };
 
+/* Pick values of retained frequencies from a full half-spectrum */
+void
+an_subset_gather (const struct an_frequency_set *set,
+                  const float                   *full,
+                  float                         *compact);
+
 struct an_corrfn {
     struct an_gpu_context *ctx;
     size_t actual_size;
+    /* Layout of corrfnMemory, see shaders/target.glsl */
+    enum an_storage_format format;
+    size_t storage_size;
+    /* Stored frequencies or NULL for the whole spectrum */
+    const struct an_frequency_set *subset;
     struct an_image_memory *corrfnMemory;
+    /* Correlation function for the CPU backend */
+    float *cpuData;
 };
 
 struct an_metric {
     struct an_gpu_context *ctx;
     VkCommandBuffer commandBuffer;
-    struct an_image_memory *metricMemory;
     struct an_image_memory *resultMemory;
+    /* Partial sums and counters of finished work groups */
+    struct an_image_memory *partialsMemory;
+    struct an_image_memory *countersMemory;
     VkDescriptorSet metricSet;
-    VkDescriptorSet reduceSet;
+    VkDescriptorPool metricPool;
 
     float *resultPtr;
     struct an_corrfn *target;
     struct an_image  *recon;
+
+    /* The last submission of this metric */
+    uint64_t ticket;
+    /* The submission which calculates the distance, see an_distance_async() */
+    uint64_t distanceTicket;
+
+    /* Speculative moves (created on demand) */
+    VkCommandBuffer moveCommandBuffer;
+    VkDescriptorSet moveSet;
+    VkDescriptorPool movePool;
+    unsigned int moveCapacity;
+    struct an_image_memory *moveMemory;
+    struct CFUpdateBatchHeader *movePtr;
+    int movePending;
+    /* Points of the pending move, may be zero */
+    unsigned int movePoints;
+    unsigned long moveGeneration;
+
+    /* Incrementally maintained distance (created on demand) */
+    VkCommandBuffer trackCommandBuffer;
+    VkDescriptorSet trackSet;
+    VkDescriptorPool trackPool;
+    int distanceValid;
+    unsigned long distanceGeneration;
 };
 
+struct an_multi_metric {
+    struct an_gpu_context *ctx;
+    struct an_image *recon;
+    unsigned int ntargets;
+    float weights[MULTI_METRIC_MAX_TARGETS];
+    int weighted;
+    /* Targets for the CPU backend (not owned) */
+    const float *cpuTargets[MULTI_METRIC_MAX_TARGETS];
+    float *cpuWeights;
+
+    /* All targets in one buffer, targetSize bytes each */
+    struct an_image_memory *targetsMemory;
+    size_t targetSize;
+    struct an_image_memory *weightsMemory;
+    struct an_image_memory *partialsMemory;
+    struct an_image_memory *countersMemory;
+    struct an_image_memory *resultMemory;
+    float *resultPtr;
+
+    VkCommandBuffer commandBuffer;
+    VkDescriptorSet set;
+    VkDescriptorPool pool;
+    uint64_t ticket;
+};
+
+struct an_replicas {
+    struct an_gpu_context *ctx;
+    struct an_corrfn *target;
+    unsigned int nreplicas;
+    unsigned int maxpoints;
+
+    struct CFUpdateDataConst updateData;
+    size_t actual_size;
+    mycomplex *twiddle;
+    size_t twiddle_size;
+
+    /* Replica i is stored at position slots[i] */
+    unsigned int *slots;
+    /* Distances in slots[] are up to date or being calculated */
+    int distancesValid;
+
+    VkCommandBuffer updateCommandBuffer;
+    VkCommandBuffer distanceCommandBuffer;
+    VkDescriptorSet updateSet;
+    VkDescriptorSet metricSet;
+    VkDescriptorPool updatePool;
+    VkDescriptorPool metricPool;
+    uint64_t ticket;
+
+    /* nreplicas spectra one after another */
+    struct an_image_memory *spectraMemory;
+    struct an_image_memory *twiddleMemory;
+    struct an_image_memory *countsMemory;
+    struct an_image_memory *pointsMemory;
+    struct an_image_memory *partialsMemory;
+    struct an_image_memory *countersMemory;
+    struct an_image_memory *resultMemory;
+    unsigned int *countsPtr;
+    struct CFUpdateBatchPoint *pointsPtr;
+    float *resultPtr;
+
+    /* Spectra for the CPU backend, viewed as images */
+    mycomplex *cpuData;
+    struct an_image *cpuImages;
+};
+
+/* Recording of common commands */
+void
+an_record_barrier (VkCommandBuffer commandBuffer);
+
+/* Single pass reduction */
+unsigned int
+an_metric_groups (size_t length);
+
+int
+an_create_reduce_memory (struct an_gpu_context   *ctx,
+                         size_t                   npartials,
+                         unsigned int             ncounters,
+                         struct an_image_memory **partials,
+                         struct an_image_memory **counters);
+
 /* Buffer management */
 
 struct an_image_memory*
@@ -126,6 +596,17 @@ an_create_buffer (struct an_gpu_context *ctx, VkBufferUsageFlags usage,
 void
 an_destroy_buffer (struct an_gpu_context *ctx, struct an_image_memory *imemory);
 
+typedef void (*an_fill_fn) (void *staging, size_t offset, size_t size, void *arg);
+typedef void (*an_drain_fn) (const void *staging, size_t offset, size_t size, void *arg);
+
+int
+an_write_data_with (struct an_gpu_context *ctx, struct an_image_memory *imageMemory,
+                    size_t size, an_fill_fn fill, void *arg);
+
+int
+an_read_data_with (struct an_gpu_context *ctx, struct an_image_memory *imageMemory,
+                   size_t size, an_drain_fn drain, void *arg);
+
 int
 an_write_data (struct an_gpu_context *ctx, struct an_image_memory *imageMemory,
                const void *data, size_t size);
@@ -133,3 +614,57 @@ an_write_data (struct an_gpu_context *ctx, struct an_image_memory *imageMemory,
 int
 an_read_data (struct an_gpu_context *ctx, struct an_image_memory *imageMemory,
               void *data, size_t size);
+
+void
+an_destroy_staging (struct an_gpu_context *ctx);
+
+/* Device to device copy */
+int
+an_copy_data (struct an_gpu_context *ctx,
+              struct an_image_memory *source, size_t srcOffset,
+              struct an_image_memory *destination, size_t dstOffset,
+              size_t size);
+
+/* FFT on the device, see gpufft.c */
+int
+an_gpu_fft_supported (const struct CFUpdateDataConst *data);
+
+int
+an_gpu_rfft (struct an_image *image, struct an_image_memory *realMemory);
+
+int
+an_gpu_irfft (struct an_image *image, struct an_image_memory *realMemory);
+
+/* CPU backend */
+int
+an_cpu_create_context (struct an_gpu_context *ctx);
+
+void
+an_cpu_destroy_context (struct an_gpu_context *ctx);
+
+void
+an_cpu_update (struct an_image                 *image,
+               const struct CFUpdateBatchPoint *points,
+               unsigned int                     npoints);
+
+/* Returns change of the distance */
+double
+an_cpu_update_tracked (struct an_image                 *image,
+                       const struct an_corrfn          *target,
+                       const struct CFUpdateBatchPoint *points,
+                       unsigned int                     npoints);
+
+/* Distance with the updates applied on the fly */
+double
+an_cpu_distance (struct an_image                 *image,
+                 const struct an_corrfn          *target,
+                 const struct CFUpdateBatchPoint *points,
+                 unsigned int                     npoints);
+
+/* Weighted distances to NTARGETS targets (WEIGHTS may be NULL) */
+void
+an_cpu_multi_distance (const struct an_image *image,
+                       const float *const    *targets,
+                       const float           *weights,
+                       unsigned int           ntargets,
+                       double                *distances);
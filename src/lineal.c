@@ -0,0 +1,382 @@
+/* Lineal-path function and chord lengths, maintained with run tables */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <vulkan/vulkan.h>
+
+#include "annealing-lowlevel.h"
+#include "internal.h"
+
+/*
+ * Each line along an axis is a sequence of runs of the phase (chords).
+ * The lineal-path function L(r) along an axis is the fraction of
+ * positions where r consecutive pixels all belong to the phase, so a
+ * chord of length c adds c - r + 1 segments to it. Flipping a pixel
+ * joins or splits at most two chords, which are found by walking from
+ * the pixel, and the tables are corrected for them in O(maxLength).
+ * A line which is entirely in the phase has no ends (lines are
+ * periodic), it adds n segments for every r and is counted as a
+ * chord of length n.
+ */
+struct an_lineal {
+    unsigned char *phases;
+    size_t size;
+    unsigned int dimensions[MAX_DIMENSIONS];
+    size_t strides[MAX_DIMENSIONS];
+    unsigned int ndim;
+    unsigned int maxLength;
+    unsigned int maxChord;
+
+    /* Per axis: chords of each length (up to the dimension), segments for each r */
+    long *chords[MAX_DIMENSIONS];
+    long *segments[MAX_DIMENSIONS];
+    long nchords[MAX_DIMENSIONS];
+
+    /* ndim rows of maxLength and maxChord values or NULL */
+    float *linealTarget;
+    float *chordTarget;
+    float linealWeight;
+    float chordWeight;
+
+    /* The last evaluated move */
+    size_t *movePositions;
+    unsigned int moveCapacity;
+    unsigned int npoints;
+    int movePending;
+};
+
+static size_t
+step (const struct an_lineal *lineal, size_t pos, unsigned int axis, int dir) {
+    unsigned int n = lineal->dimensions[axis];
+    size_t stride = lineal->strides[axis];
+    unsigned int coord = (pos / stride) % n;
+
+    if (dir > 0) {
+        return (coord == n - 1) ? pos - coord * stride : pos + stride;
+    } else {
+        return (coord == 0) ? pos + (n - 1) * stride : pos - stride;
+    }
+}
+
+/* Number of pixels of the phase next to POS in the direction DIR */
+static unsigned int
+walk (const struct an_lineal *lineal, size_t pos, unsigned int axis, int dir) {
+    unsigned int n = lineal->dimensions[axis];
+    unsigned int count = 0;
+
+    for (pos = step (lineal, pos, axis, dir);
+         count < n - 1 && lineal->phases[pos];
+         pos = step (lineal, pos, axis, dir)) {
+        count++;
+    }
+
+    return count;
+}
+
+static void
+count_chord (struct an_lineal *lineal, unsigned int axis, unsigned int length,
+             int ring, int sign) {
+    unsigned int nr = (length < lineal->maxLength) ? length : lineal->maxLength;
+
+    if (length == 0) {
+        return;
+    }
+
+    lineal->chords[axis][length] += sign;
+    lineal->nchords[axis] += sign;
+    for (unsigned int r = 1; r <= nr; r++) {
+        lineal->segments[axis][r - 1] += sign * (long)(ring ? length : length - r + 1);
+    }
+}
+
+static void
+flip (struct an_lineal *lineal, size_t pos) {
+    int set = !lineal->phases[pos];
+
+    for (unsigned int a = 0; a < lineal->ndim; a++) {
+        unsigned int n = lineal->dimensions[a];
+        unsigned int left = walk (lineal, pos, a, -1);
+        unsigned int right = (left == n - 1) ? 0 : walk (lineal, pos, a, 1);
+        /* The rest of the line is one chord, reached from both sides */
+        int ring = left == n - 1;
+        int sign = set ? 1 : -1;
+
+        if (ring) {
+            count_chord (lineal, a, n - 1, 0, -sign);
+            count_chord (lineal, a, n, 1, sign);
+        } else {
+            count_chord (lineal, a, left, 0, -sign);
+            count_chord (lineal, a, right, 0, -sign);
+            count_chord (lineal, a, left + right + 1, 0, sign);
+        }
+    }
+
+    lineal->phases[pos] = set;
+}
+
+/* Tables from scratch, one line at a time */
+static void
+recompute (struct an_lineal *lineal) {
+    for (unsigned int a = 0; a < lineal->ndim; a++) {
+        unsigned int n = lineal->dimensions[a];
+        size_t stride = lineal->strides[a];
+
+        for (size_t start = 0; start < lineal->size; start++) {
+            /* The first pixel of each line */
+            if ((start / stride) % n != 0) {
+                continue;
+            }
+
+            /* Begin after a pixel not in the phase, if there is one */
+            unsigned int first = 0;
+            while (first < n && lineal->phases[start + first * stride]) {
+                first++;
+            }
+
+            if (first == n) {
+                count_chord (lineal, a, n, 1, 1);
+                continue;
+            }
+
+            unsigned int run = 0;
+            for (unsigned int k = 1; k <= n; k++) {
+                size_t pos = start + ((first + k) % n) * stride;
+                if (lineal->phases[pos]) {
+                    run++;
+                } else {
+                    count_chord (lineal, a, run, 0, 1);
+                    run = 0;
+                }
+            }
+        }
+    }
+}
+
+static double
+distance (const struct an_lineal *lineal) {
+    double linealSum = 0, chordSum = 0;
+
+    for (unsigned int a = 0; a < lineal->ndim; a++) {
+        if (lineal->linealTarget != NULL) {
+            const float *target = lineal->linealTarget + a * lineal->maxLength;
+            for (unsigned int r = 0; r < lineal->maxLength; r++) {
+                double diff = target[r] - (double)lineal->segments[a][r] / lineal->size;
+                linealSum += diff * diff;
+            }
+        }
+
+        if (lineal->chordTarget != NULL) {
+            const float *target = lineal->chordTarget + a * lineal->maxChord;
+            long total = lineal->nchords[a];
+            for (unsigned int c = 0; c < lineal->maxChord; c++) {
+                double p = (total > 0) ? (double)lineal->chords[a][c + 1] / total : 0;
+                double diff = target[c] - p;
+                chordSum += diff * diff;
+            }
+        }
+    }
+
+    return lineal->linealWeight * linealSum + lineal->chordWeight * chordSum;
+}
+
+static int
+positions (const struct an_lineal *lineal, const unsigned int *coords,
+           unsigned int npoints, size_t *result) {
+    return an_real_positions (lineal->dimensions, lineal->strides, lineal->ndim,
+                              coords, npoints, result);
+}
+
+void
+an_destroy_lineal (struct an_lineal *lineal) {
+    for (unsigned int a = 0; a < lineal->ndim; a++) {
+        free (lineal->chords[a]);
+        free (lineal->segments[a]);
+    }
+
+    free (lineal->phases);
+    free (lineal->linealTarget);
+    free (lineal->chordTarget);
+    free (lineal->movePositions);
+    free (lineal);
+}
+
+struct an_lineal*
+an_create_lineal (const unsigned char *phases,
+                  const unsigned int  *dimensions,
+                  unsigned int         ndim,
+                  unsigned int         maxLength,
+                  unsigned int         maxChord) {
+    if (ndim == 0 || ndim > MAX_DIMENSIONS) {
+        fprintf (stderr, "Wrong number of dimensions\n");
+        return NULL;
+    }
+
+    /* Tables only count segments and chords which fit in a line */
+    for (unsigned int i = 0; i < ndim; i++) {
+        if (maxLength > dimensions[i] || maxChord > dimensions[i]) {
+            fprintf (stderr, "Lengths must not exceed dimensions\n");
+            return NULL;
+        }
+    }
+
+    struct an_lineal *lineal = malloc (sizeof (struct an_lineal));
+    memset (lineal, 0, sizeof (struct an_lineal));
+
+    lineal->ndim = ndim;
+    lineal->maxLength = maxLength;
+    lineal->maxChord = maxChord;
+    lineal->linealWeight = 1;
+    lineal->chordWeight = 1;
+    lineal->size = 1;
+    for (int i = ndim - 1; i >= 0; i--) {
+        lineal->dimensions[i] = dimensions[i];
+        lineal->strides[i] = lineal->size;
+        lineal->size *= dimensions[i];
+    }
+
+    for (unsigned int a = 0; a < ndim; a++) {
+        lineal->chords[a] = calloc (dimensions[a] + 1, sizeof (long));
+        lineal->segments[a] = calloc (maxLength, sizeof (long));
+    }
+
+    lineal->phases = malloc (lineal->size);
+    for (size_t i = 0; i < lineal->size; i++) {
+        lineal->phases[i] = phases[i] != 0;
+    }
+
+    recompute (lineal);
+    return lineal;
+}
+
+void
+an_lineal_set_targets (struct an_lineal *lineal,
+                       const float      *linealTarget,
+                       const float      *chordTarget,
+                       float             linealWeight,
+                       float             chordWeight) {
+    free (lineal->linealTarget);
+    free (lineal->chordTarget);
+    lineal->linealTarget = NULL;
+    lineal->chordTarget = NULL;
+
+    if (linealTarget != NULL) {
+        size_t size = sizeof (float) * lineal->ndim * lineal->maxLength;
+        lineal->linealTarget = malloc (size);
+        memcpy (lineal->linealTarget, linealTarget, size);
+    }
+
+    if (chordTarget != NULL) {
+        size_t size = sizeof (float) * lineal->ndim * lineal->maxChord;
+        lineal->chordTarget = malloc (size);
+        memcpy (lineal->chordTarget, chordTarget, size);
+    }
+
+    lineal->linealWeight = linealWeight;
+    lineal->chordWeight = chordWeight;
+}
+
+void
+an_lineal_get (struct an_lineal *lineal,
+               float            *linealPath,
+               float            *chords) {
+    for (unsigned int a = 0; a < lineal->ndim; a++) {
+        if (linealPath != NULL) {
+            for (unsigned int r = 0; r < lineal->maxLength; r++) {
+                linealPath[a * lineal->maxLength + r] =
+                    (double)lineal->segments[a][r] / lineal->size;
+            }
+        }
+
+        if (chords != NULL) {
+            long total = lineal->nchords[a];
+            for (unsigned int c = 0; c < lineal->maxChord; c++) {
+                chords[a * lineal->maxChord + c] = (total > 0) ?
+                    (double)lineal->chords[a][c + 1] / total : 0;
+            }
+        }
+    }
+}
+
+int
+an_lineal_flip (struct an_lineal   *lineal,
+                const unsigned int *coords,
+                unsigned int        npoints,
+                unsigned int        ndim) {
+    if (ndim != lineal->ndim) {
+        fprintf (stderr, "Wrong dimensions\n");
+        return 0;
+    }
+
+    size_t *pos = malloc (sizeof (size_t) * npoints);
+    int ok = positions (lineal, coords, npoints, pos);
+    if (ok) {
+        for (unsigned int k = 0; k < npoints; k++) {
+            flip (lineal, pos[k]);
+        }
+    }
+
+    free (pos);
+    return ok;
+}
+
+int
+an_lineal_distance (struct an_lineal *lineal,
+                    float            *result) {
+    *result = distance (lineal);
+    return 1;
+}
+
+int
+an_lineal_evaluate_move (struct an_lineal   *lineal,
+                         const unsigned int *coords,
+                         unsigned int        npoints,
+                         unsigned int        ndim,
+                         float              *result) {
+    if (ndim != lineal->ndim) {
+        fprintf (stderr, "Wrong dimensions\n");
+        return 0;
+    }
+
+    lineal->movePending = 0;
+    if (npoints > lineal->moveCapacity) {
+        lineal->moveCapacity = (2 * lineal->moveCapacity > npoints) ?
+            2 * lineal->moveCapacity : npoints;
+        lineal->movePositions = realloc (lineal->movePositions,
+                                         sizeof (size_t) * lineal->moveCapacity);
+    }
+
+    if (!positions (lineal, coords, npoints, lineal->movePositions)) {
+        return 0;
+    }
+
+    /* Flips are undone exactly by flipping back in the reverse order */
+    for (unsigned int k = 0; k < npoints; k++) {
+        flip (lineal, lineal->movePositions[k]);
+    }
+
+    *result = distance (lineal);
+
+    for (unsigned int k = npoints; k > 0; k--) {
+        flip (lineal, lineal->movePositions[k - 1]);
+    }
+
+    lineal->npoints = npoints;
+    lineal->movePending = 1;
+    return 1;
+}
+
+int
+an_lineal_commit_move (struct an_lineal *lineal) {
+    if (!lineal->movePending) {
+        fprintf (stderr, "No move to commit\n");
+        return 0;
+    }
+
+    lineal->movePending = 0;
+    for (unsigned int k = 0; k < lineal->npoints; k++) {
+        flip (lineal, lineal->movePositions[k]);
+    }
+
+    return 1;
+}
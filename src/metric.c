@@ -9,185 +9,404 @@
 #include "annealing-lowlevel.h"
 #include "internal.h"
 
-#define METRIC_GRP_SIZE 64
+static unsigned int
+ngroups_total (struct an_image *image) {
+    return image->ngroups[0] * image->ngroups[1] * image->ngroups[2];
+}
+
+unsigned int
+an_metric_groups (size_t length) {
+    unsigned int groups = ceil ((double)length / (double)METRIC_GRP_SIZE);
+    return (groups < METRIC_MAX_GROUPS) ? groups : METRIC_MAX_GROUPS;
+}
+
+int
+an_create_reduce_memory (struct an_gpu_context   *ctx,
+                         size_t                   npartials,
+                         unsigned int             ncounters,
+                         struct an_image_memory **partials,
+                         struct an_image_memory **counters) {
+    *partials =
+        an_create_buffer (ctx, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                          npartials * sizeof (float));
+    if (*partials == NULL) {
+        fprintf (stderr, "Cannot create buffer for partial sums\n");
+        return 0;
+    }
+
+    *counters =
+        an_create_buffer (ctx, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                          VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                          ncounters * sizeof (unsigned int));
+    if (*counters == NULL) {
+        fprintf (stderr, "Cannot create buffer for counters\n");
+        return 0;
+    }
+
+    /* The last work group resets its counter, so this is done once */
+    unsigned int *zeros = calloc (ncounters, sizeof (unsigned int));
+    int res = an_write_data (ctx, *counters, zeros, ncounters * sizeof (unsigned int));
+    free (zeros);
+
+    return res;
+}
+
+/* Size of the partial sums buffer */
+static size_t
+npartials (struct an_image *recon) {
+    unsigned int groups = ngroups_total (recon);
+    return (groups > METRIC_MAX_GROUPS) ? groups : METRIC_MAX_GROUPS;
+}
 
 static void
 update_metric_descriptors (struct an_metric *metric) {
-    struct an_gpu_context *ctx = metric->ctx;
     struct an_corrfn *target = metric->target;
     struct an_image *recon = metric->recon;
 
-    VkDescriptorBufferInfo cfInfo;
-    ZERO(cfInfo);
-    cfInfo.buffer = target->corrfnMemory->buffer;
-    cfInfo.offset = 0;
-    cfInfo.range = sizeof (float) * target->actual_size;
-
-    VkDescriptorBufferInfo reconInfo;
-    ZERO(reconInfo);
-    reconInfo.buffer = recon->imageMemory->buffer;
-    reconInfo.offset = 0;
-    reconInfo.range = sizeof (mycomplex) * recon->actual_size;
-
-    VkDescriptorBufferInfo outputInfo;
-    ZERO(outputInfo);
-    outputInfo.buffer = metric->metricMemory->buffer;
-    outputInfo.offset = 0;
-    outputInfo.range = sizeof (float) * target->actual_size;
-
-    VkWriteDescriptorSet dsSets[3];
-    memset (dsSets, 0, sizeof (dsSets));
-    dsSets[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    dsSets[0].dstSet = metric->metricSet;
-    dsSets[0].dstBinding = 0; // binding #
-    dsSets[0].dstArrayElement = 0;
-    dsSets[0].descriptorCount = 1;
-    dsSets[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-    dsSets[0].pBufferInfo = &cfInfo;
-
-    dsSets[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    dsSets[1].dstSet = metric->metricSet;
-    dsSets[1].dstBinding = 1; // binding #
-    dsSets[1].dstArrayElement = 0;
-    dsSets[1].descriptorCount = 1;
-    dsSets[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-    dsSets[1].pBufferInfo = &reconInfo;
-
-    dsSets[2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    dsSets[2].dstSet = metric->metricSet;
-    dsSets[2].dstBinding = 2; // binding #
-    dsSets[2].dstArrayElement = 0;
-    dsSets[2].descriptorCount = 1;
-    dsSets[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-    dsSets[2].pBufferInfo = &outputInfo;
-
-    vkUpdateDescriptorSets (ctx->device, 3, dsSets, 0, NULL);
+    struct an_image_memory *buffers[5] = {
+        target->corrfnMemory, recon->imageMemory,
+        metric->partialsMemory, metric->countersMemory, metric->resultMemory
+    };
+    size_t sizes[5] = {
+        target->storage_size,
+        sizeof (mycomplex) * recon->actual_size,
+        sizeof (float) * npartials (recon),
+        sizeof (unsigned int),
+        sizeof (float) * METRIC_RESULT_COUNT
+    };
+
+    an_write_storage_descriptors (metric->ctx, metric->metricSet, buffers, sizes, 5);
 }
 
 static void
-update_reduce_descriptors (struct an_metric *metric) {
-    struct an_gpu_context *ctx = metric->ctx;
+update_move_descriptors (struct an_metric *metric) {
+    struct an_corrfn *target = metric->target;
+    struct an_image *recon = metric->recon;
+
+    struct an_image_memory *buffers[7] = {
+        target->corrfnMemory, recon->imageMemory, metric->moveMemory,
+        recon->twiddleMemory,
+        metric->partialsMemory, metric->countersMemory, metric->resultMemory
+    };
+    size_t sizes[7] = {
+        target->storage_size,
+        sizeof (mycomplex) * recon->actual_size,
+        sizeof (struct CFUpdateBatchHeader) +
+        sizeof (struct CFUpdateBatchPoint) * metric->moveCapacity,
+        sizeof (mycomplex) * recon->twiddle_size,
+        sizeof (float) * npartials (recon),
+        sizeof (unsigned int),
+        sizeof (float) * METRIC_RESULT_COUNT
+    };
+
+    an_write_storage_descriptors (metric->ctx, metric->moveSet, buffers, sizes, 7);
+}
+
+static void
+update_track_descriptors (struct an_metric *metric) {
+    struct an_corrfn *target = metric->target;
+    struct an_image *recon = metric->recon;
+
+    struct an_image_memory *buffers[7] = {
+        recon->imageMemory, metric->moveMemory, target->corrfnMemory,
+        recon->twiddleMemory,
+        metric->partialsMemory, metric->countersMemory, metric->resultMemory
+    };
+    size_t sizes[7] = {
+        sizeof (mycomplex) * recon->actual_size,
+        sizeof (struct CFUpdateBatchHeader) +
+        sizeof (struct CFUpdateBatchPoint) * metric->moveCapacity,
+        target->storage_size,
+        sizeof (mycomplex) * recon->twiddle_size,
+        sizeof (float) * npartials (recon),
+        sizeof (unsigned int),
+        sizeof (float) * METRIC_RESULT_COUNT
+    };
+
+    an_write_storage_descriptors (metric->ctx, metric->trackSet, buffers, sizes, 7);
+}
 
-    VkDescriptorBufferInfo mInfo;
-    ZERO(mInfo);
-    mInfo.buffer = metric->metricMemory->buffer;
-    mInfo.offset = 0;
-    mInfo.range = sizeof (float) * metric->target->actual_size;
-
-    VkDescriptorBufferInfo rInfo;
-    ZERO(rInfo);
-    rInfo.buffer = metric->resultMemory->buffer;
-    rInfo.offset = 0;
-    rInfo.range = sizeof (float);
-
-    VkWriteDescriptorSet dsSets[2];
-    memset (dsSets, 0, sizeof (dsSets));
-    dsSets[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    dsSets[0].dstSet = metric->reduceSet;
-    dsSets[0].dstBinding = 0; // binding #
-    dsSets[0].dstArrayElement = 0;
-    dsSets[0].descriptorCount = 1;
-    dsSets[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-    dsSets[0].pBufferInfo = &mInfo;
-    dsSets[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    dsSets[1].dstSet = metric->reduceSet;
-    dsSets[1].dstBinding = 1; // binding #
-    dsSets[1].dstArrayElement = 0;
-    dsSets[1].descriptorCount = 1;
-    dsSets[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-    dsSets[1].pBufferInfo = &rInfo;
-
-    vkUpdateDescriptorSets (ctx->device, 2, dsSets, 0, NULL);
+void
+an_record_barrier (VkCommandBuffer commandBuffer) {
+    VkMemoryBarrier memoryBarrier;
+    ZERO (memoryBarrier);
+    memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+    memoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+
+    /*
+     * Also used at the beginning of command buffers to order them
+     * after previous submissions and copies.
+     */
+    vkCmdPipelineBarrier(commandBuffer,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                         VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         0, 1, &memoryBarrier, 0, NULL, 0, NULL);
 }
 
 static void
 record_command_buffer (struct an_metric *metric) {
     struct an_gpu_context *ctx = metric->ctx;
     struct pipeline *metricPipeline = ctx->pipelines[PIPELINE_METRIC];
-    struct pipeline *reducePipeline = ctx->pipelines[PIPELINE_REDUCE];
     unsigned int actual_size = metric->recon->actual_size;
 
     struct MetricUpdateData params;
     params.length = actual_size;
-
-    VkMemoryBarrier memoryBarrier;
-    ZERO (memoryBarrier);
-    memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
-    memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
-    memoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    params.target = METRIC_RESULT_DISTANCE;
+    params.accumulate = 0;
+    params.format = metric->target->format;
 
     VkCommandBufferBeginInfo beginInfo;
     ZERO(beginInfo);
     beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
 
     vkBeginCommandBuffer (metric->commandBuffer, &beginInfo);
-    /* Calculate squared difference */
+    an_record_barrier (metric->commandBuffer);
+    an_stats_register (ctx, metric->commandBuffer, AN_STAGE_METRIC);
+    /* Calculate squared difference and reduce it in one dispatch */
     vkCmdBindPipeline (metric->commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
-                       metricPipeline->pipeline);
+                       an_get_pipeline (ctx, PIPELINE_METRIC,
+                                        metric->recon->updateData.ndim));
     vkCmdBindDescriptorSets (metric->commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
                              metricPipeline->pipelineLayout,
                              0, 1, &metric->metricSet, 0, NULL);
     vkCmdPushConstants (metric->commandBuffer, metricPipeline->pipelineLayout,
                         VK_SHADER_STAGE_COMPUTE_BIT, 0,
                         sizeof (struct MetricUpdateData), &params);
-    vkCmdDispatch (metric->commandBuffer,
-                   ceil((double) actual_size / (double)METRIC_GRP_SIZE), 1, 1);
-    vkCmdPipelineBarrier(metric->commandBuffer,
-                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-                         0, 1, &memoryBarrier, 0, NULL, 0, NULL);
+    vkCmdDispatch (metric->commandBuffer, an_metric_groups (actual_size), 1, 1);
+    vkEndCommandBuffer (metric->commandBuffer);
+}
 
-    /* Reduce */
-    vkCmdBindPipeline (metric->commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
-                       reducePipeline->pipeline);
-    vkCmdBindDescriptorSets (metric->commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
-                             reducePipeline->pipelineLayout,
-                             0, 1, &metric->reduceSet, 0, NULL);
-    while (params.length > 0) {
-        int groups = ceil((double)params.length / (double)METRIC_GRP_SIZE);
-        vkCmdPushConstants (metric->commandBuffer, reducePipeline->pipelineLayout,
-                            VK_SHADER_STAGE_COMPUTE_BIT, 0,
-                            sizeof (struct MetricUpdateData), &params);
-        vkCmdDispatch (metric->commandBuffer, groups, 1, 1);
-        params.length = (groups == 1) ? 0 : groups;
-        if (params.length > 0) {
-            vkCmdPipelineBarrier(metric->commandBuffer,
-                                 VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-                                 VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-                                 0, 1, &memoryBarrier, 0, NULL, 0, NULL);
+/* Record a dispatch of a shader which updates (or moves) and reduces */
+static void
+record_update_reduce (struct an_metric *metric, VkCommandBuffer commandBuffer,
+                      enum pipeline_type type, VkDescriptorSet set,
+                      enum metric_result target, int accumulate) {
+    struct an_gpu_context *ctx = metric->ctx;
+    struct pipeline *pipeline = ctx->pipelines[type];
+    struct an_image *recon = metric->recon;
+
+    struct CFUpdateReduceData params;
+    params.dims = recon->updateData;
+    params.target = target;
+    params.accumulate = accumulate;
+    params.format = metric->target->format;
+
+    VkCommandBufferBeginInfo beginInfo;
+    ZERO(beginInfo);
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+
+    vkBeginCommandBuffer (commandBuffer, &beginInfo);
+    an_record_barrier (commandBuffer);
+    an_stats_register (ctx, commandBuffer,
+                       (type == PIPELINE_METRIC_MOVE) ? AN_STAGE_MOVE : AN_STAGE_TRACKED);
+    vkCmdBindPipeline (commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                       an_get_pipeline (ctx, type, recon->updateData.ndim));
+    vkCmdBindDescriptorSets (commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                             pipeline->pipelineLayout,
+                             0, 1, &set, 0, NULL);
+    vkCmdPushConstants (commandBuffer, pipeline->pipelineLayout,
+                        VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                        sizeof (struct CFUpdateReduceData), &params);
+    vkCmdDispatch (commandBuffer,
+                   recon->ngroups[0], recon->ngroups[1], recon->ngroups[2]);
+    vkEndCommandBuffer (commandBuffer);
+}
+
+static void
+record_move_command_buffer (struct an_metric *metric) {
+    /* Calculate the distance with the move applied */
+    record_update_reduce (metric, metric->moveCommandBuffer, PIPELINE_METRIC_MOVE,
+                          metric->moveSet, METRIC_RESULT_MOVE, 0);
+}
+
+static void
+record_track_command_buffer (struct an_metric *metric) {
+    /* Update the image and add the change to the distance */
+    record_update_reduce (metric, metric->trackCommandBuffer, PIPELINE_CFUPDATE_TRACKED,
+                          metric->trackSet, METRIC_RESULT_DISTANCE, 1);
+}
+
+static void
+destroy_move_memory (struct an_metric *metric) {
+    struct an_gpu_context *ctx = metric->ctx;
+
+    if (metric->movePtr != NULL) {
+        if (ctx->backend == AN_BACKEND_CPU) {
+            free (metric->movePtr);
         }
+        metric->movePtr = NULL;
     }
-    vkEndCommandBuffer (metric->commandBuffer);
+
+    if (metric->moveMemory != NULL) {
+        an_destroy_buffer (ctx, metric->moveMemory);
+        metric->moveMemory = NULL;
+    }
+
+    metric->moveCapacity = 0;
+}
+
+/* Like ensure_batch_capacity() in images.c */
+static int
+ensure_move_capacity (struct an_metric *metric, unsigned int npoints) {
+    struct an_gpu_context *ctx = metric->ctx;
+    VkResult result;
+
+    if (npoints <= metric->moveCapacity) {
+        return 1;
+    }
+
+    if (ctx->backend == AN_BACKEND_CPU) {
+        unsigned int capacity = 2 * metric->moveCapacity;
+        if (capacity < npoints) {
+            capacity = npoints;
+        }
+
+        free (metric->movePtr);
+        metric->movePtr = malloc (sizeof (struct CFUpdateBatchHeader) +
+                                  sizeof (struct CFUpdateBatchPoint) * capacity);
+        metric->moveCapacity = capacity;
+        metric->movePending = 0;
+        return 1;
+    }
+
+    /* Moves or tracked updates may still use the old buffer */
+    an_wait_ticket (ctx, metric->ticket);
+
+    if (metric->moveCommandBuffer == VK_NULL_HANDLE) {
+        result = an_create_command_buffer (ctx, &metric->moveCommandBuffer);
+        if (result != VK_SUCCESS) {
+            fprintf (stderr, "Cannot allocate command buffer, code = %i\n", result);
+            return 0;
+        }
+    }
+
+    if (metric->moveSet == VK_NULL_HANDLE) {
+        result = an_allocate_descriptor_set (ctx, ctx->pipelines[PIPELINE_METRIC_MOVE],
+                                             &metric->movePool, &metric->moveSet);
+        if (result != VK_SUCCESS) {
+            fprintf (stderr, "Cannot allocate descriptor set, code = %i\n", result);
+            return 0;
+        }
+    }
+
+    unsigned int capacity = 2 * metric->moveCapacity;
+    if (capacity < npoints) {
+        capacity = npoints;
+    }
+
+    destroy_move_memory (metric);
+    metric->movePending = 0;
+    size_t size = sizeof (struct CFUpdateBatchHeader) +
+        sizeof (struct CFUpdateBatchPoint) * capacity;
+
+    metric->moveMemory =
+        an_create_buffer (ctx, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                          size);
+    if (metric->moveMemory == NULL) {
+        fprintf (stderr, "Cannot create move buffer\n");
+        return 0;
+    }
+
+    metric->movePtr = metric->moveMemory->mapped;
+    metric->moveCapacity = capacity;
+
+    update_move_descriptors (metric);
+    record_move_command_buffer (metric);
+
+    if (metric->trackCommandBuffer != VK_NULL_HANDLE) {
+        update_track_descriptors (metric);
+        record_track_command_buffer (metric);
+    }
+
+    return 1;
+}
+
+/*
+ * Create resources for incremental updates of the distance. Must be
+ * called after ensure_move_capacity().
+ */
+static int
+ensure_tracking (struct an_metric *metric) {
+    struct an_gpu_context *ctx = metric->ctx;
+    VkResult result;
+
+    if (metric->trackCommandBuffer != VK_NULL_HANDLE) {
+        return 1;
+    }
+
+    if (metric->trackSet == VK_NULL_HANDLE) {
+        result = an_allocate_descriptor_set (ctx, ctx->pipelines[PIPELINE_CFUPDATE_TRACKED],
+                                             &metric->trackPool, &metric->trackSet);
+        if (result != VK_SUCCESS) {
+            fprintf (stderr, "Cannot allocate descriptor set, code = %i\n", result);
+            return 0;
+        }
+    }
+
+    result = an_create_command_buffer (ctx, &metric->trackCommandBuffer);
+    if (result != VK_SUCCESS) {
+        fprintf (stderr, "Cannot allocate command buffer, code = %i\n", result);
+        return 0;
+    }
+
+    update_track_descriptors (metric);
+    record_track_command_buffer (metric);
+    return 1;
 }
 
 void
 an_destroy_metric (struct an_metric *metric) {
     struct an_gpu_context *ctx = metric->ctx;
 
-    if (metric->metricSet != VK_NULL_HANDLE) {
-        vkFreeDescriptorSets (ctx->device, ctx->descPool, 1, &metric->metricSet);
+    if (ctx->backend != AN_BACKEND_CPU) {
+        an_wait_ticket (ctx, metric->ticket);
     }
 
-    if (metric->reduceSet != VK_NULL_HANDLE) {
-        vkFreeDescriptorSets (ctx->device, ctx->descPool, 1, &metric->reduceSet);
-    }
+    an_free_descriptor_set (ctx, metric->metricPool, &metric->metricSet);
 
     if (metric->commandBuffer != VK_NULL_HANDLE) {
+        an_stats_forget (ctx, metric->commandBuffer);
         vkFreeCommandBuffers (ctx->device, ctx->cmdPool, 1, &metric->commandBuffer);
     }
 
-    if (metric->resultPtr != NULL) {
-        vkUnmapMemory (ctx->device, metric->resultMemory->memory);
+    an_free_descriptor_set (ctx, metric->movePool, &metric->moveSet);
+
+    if (metric->moveCommandBuffer != VK_NULL_HANDLE) {
+        an_stats_forget (ctx, metric->moveCommandBuffer);
+        vkFreeCommandBuffers (ctx->device, ctx->cmdPool, 1, &metric->moveCommandBuffer);
+    }
+
+    destroy_move_memory (metric);
+
+    an_free_descriptor_set (ctx, metric->trackPool, &metric->trackSet);
+
+    if (metric->trackCommandBuffer != VK_NULL_HANDLE) {
+        an_stats_forget (ctx, metric->trackCommandBuffer);
+        vkFreeCommandBuffers (ctx->device, ctx->cmdPool, 1, &metric->trackCommandBuffer);
+    }
+
+    if (metric->partialsMemory != NULL) {
+        an_destroy_buffer (ctx, metric->partialsMemory);
+    }
+
+    if (ctx->backend == AN_BACKEND_CPU) {
+        free (metric->resultPtr);
     }
 
     if (metric->resultMemory != NULL) {
         an_destroy_buffer (ctx, metric->resultMemory);
     }
 
-    if (metric->metricMemory != NULL) {
-        an_destroy_buffer (ctx, metric->metricMemory);
+    if (metric->countersMemory != NULL) {
+        an_destroy_buffer (ctx, metric->countersMemory);
     }
-        
+
     free (metric);
 }
 
@@ -197,7 +416,8 @@ an_create_metric (struct an_gpu_context *ctx,
                   struct an_image       *recon) {
     if (target->ctx != recon->ctx ||
         target->ctx != ctx ||
-        target->actual_size != recon->actual_size) {
+        target->actual_size != recon->actual_size ||
+        target->subset != recon->subset) {
         fprintf (stderr, "Incompatible images\n");
         return 0;
     }
@@ -209,12 +429,13 @@ an_create_metric (struct an_gpu_context *ctx,
     metric->recon  = recon;
     metric->target = target;
 
-    metric->metricMemory =
-        an_create_buffer (ctx,VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-                          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                          recon->actual_size * sizeof(float));
-    if (metric->metricMemory == NULL) {
-        fprintf (stderr, "Cannot create metric buffer\n");
+    if (ctx->backend == AN_BACKEND_CPU) {
+        metric->resultPtr = calloc (METRIC_RESULT_COUNT, sizeof (float));
+        return metric;
+    }
+
+    if (!an_create_reduce_memory (ctx, npartials (recon), 1,
+                                  &metric->partialsMemory, &metric->countersMemory)) {
         goto cleanup;
     }
 
@@ -222,20 +443,13 @@ an_create_metric (struct an_gpu_context *ctx,
         an_create_buffer (ctx,VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
                           VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
                           VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                          sizeof(float));
+                          sizeof(float) * METRIC_RESULT_COUNT);
     if (metric->resultMemory == NULL) {
         fprintf (stderr, "Cannot create result buffer\n");
         goto cleanup;
     }
 
-    void *ptr;
-    result = vkMapMemory (ctx->device, metric->resultMemory->memory, 0,
-                          sizeof(float), 0, &ptr);
-    metric->resultPtr = ptr;
-    if (result != VK_SUCCESS) {
-        fprintf (stderr, "Cannot map result memory\n");
-        goto cleanup;
-    }
+    metric->resultPtr = metric->resultMemory->mapped;
 
     result = an_create_command_buffer (ctx, &metric->commandBuffer);
     if (result != VK_SUCCESS) {
@@ -244,21 +458,13 @@ an_create_metric (struct an_gpu_context *ctx,
     }
 
     result = an_allocate_descriptor_set (ctx, ctx->pipelines[PIPELINE_METRIC],
-                                         &metric->metricSet);
-    if (result != VK_SUCCESS) {
-        fprintf (stderr, "Cannot allocate descriptor set, code = %i\n", result);
-        goto cleanup;
-    }
-
-    result = an_allocate_descriptor_set (ctx, ctx->pipelines[PIPELINE_REDUCE],
-                                         &metric->reduceSet);
+                                         &metric->metricPool, &metric->metricSet);
     if (result != VK_SUCCESS) {
         fprintf (stderr, "Cannot allocate descriptor set, code = %i\n", result);
         goto cleanup;
     }
 
     update_metric_descriptors (metric);
-    update_reduce_descriptors (metric);
     record_command_buffer (metric);
 
     return metric;
@@ -268,24 +474,307 @@ cleanup:
     return NULL;
 }
 
-static void
-invoke_kernels (struct an_metric *metric) {
+/*
+ * Command buffers of a metric start with a barrier, so there is no
+ * need to wait for updates of the image here.
+ */
+static uint64_t
+invoke_kernels (struct an_metric *metric, VkCommandBuffer commandBuffer) {
     struct an_gpu_context *ctx = metric->ctx;
-    an_image_synchronize (metric->recon);
-
-    VkSubmitInfo submitInfo;
-    ZERO(submitInfo);
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &metric->commandBuffer;
-    vkQueueSubmit (ctx->queue, 1, &submitInfo, VK_NULL_HANDLE);
-    vkQueueWaitIdle(ctx->queue);
+
+    /* Command buffers and results may be in use by the previous submission */
+    an_wait_ticket (ctx, metric->ticket);
+    metric->ticket = an_submit (ctx, commandBuffer);
+    return metric->ticket;
+}
+
+int
+an_distance_async (struct an_metric *metric,
+                   uint64_t         *ticket) {
+    double start = an_trace_begin (metric->ctx);
+    if (metric->ctx->backend == AN_BACKEND_CPU) {
+        metric->resultPtr[METRIC_RESULT_DISTANCE] =
+            an_cpu_distance (metric->recon, metric->target, NULL, 0);
+        metric->distanceTicket = ++metric->ticket;
+    } else {
+        metric->distanceTicket = invoke_kernels (metric, metric->commandBuffer);
+    }
+
+    *ticket = metric->distanceTicket;
+    metric->distanceValid = 1;
+    metric->distanceGeneration = metric->recon->generation;
+    an_trace_end (metric->ctx, "an_distance_async", start);
+    return 1;
+}
+
+static int
+check_ticket (struct an_metric *metric, uint64_t ticket) {
+    if (ticket != metric->distanceTicket) {
+        fprintf (stderr, "The distance was overwritten by a later request\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+int
+an_distance_poll (struct an_metric *metric,
+                  uint64_t          ticket,
+                  int              *ready) {
+    if (!check_ticket (metric, ticket)) {
+        return 0;
+    }
+
+    *ready = metric->ctx->backend == AN_BACKEND_CPU ||
+        an_ticket_completed (metric->ctx, ticket);
+    return 1;
+}
+
+int
+an_distance_wait (struct an_metric *metric,
+                  uint64_t          ticket,
+                  float            *distance) {
+    if (!check_ticket (metric, ticket)) {
+        return 0;
+    }
+
+    double start = an_trace_begin (metric->ctx);
+    if (metric->ctx->backend != AN_BACKEND_CPU) {
+        an_wait_ticket (metric->ctx, ticket);
+    }
+
+    *distance = metric->resultPtr[METRIC_RESULT_DISTANCE];
+    an_trace_end (metric->ctx, "an_distance_wait", start);
+    return 1;
 }
 
 int
 an_distance (struct an_metric *metric,
              float            *distance) {
-    invoke_kernels (metric);
-    *distance = *(metric->resultPtr);
+    uint64_t ticket;
+
+    double start = an_trace_begin (metric->ctx);
+    int ok = an_distance_async (metric, &ticket) &&
+        an_distance_wait (metric, ticket, distance);
+    an_trace_end (metric->ctx, "an_distance", start);
+    return ok;
+}
+
+/* Moves and tracking need the whole spectrum */
+static int
+check_whole (struct an_metric *metric) {
+    if (metric->recon->subset != NULL) {
+        fprintf (stderr, "Not supported for frequency subsets\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+static int
+evaluate_move (struct an_metric   *metric,
+               const unsigned int *coords,
+               const float        *deltas,
+               unsigned int        npoints,
+               unsigned int        ndim,
+               float              *distance) {
+    if (!check_whole (metric)) {
+        return 0;
+    }
+
+    if (ndim != metric->recon->updateData.ndim) {
+        fprintf (stderr, "Wrong dimensions\n");
+        return 0;
+    }
+
+    /* An empty move does not change the distance */
+    if (npoints == 0) {
+        if (!an_metric_current_distance (metric, distance)) {
+            return 0;
+        }
+
+        metric->movePending = 1;
+        metric->movePoints = 0;
+        metric->moveGeneration = metric->recon->generation;
+        return 1;
+    }
+
+    if (!ensure_move_capacity (metric, npoints)) {
+        return 0;
+    }
+
+    if (metric->ctx->backend != AN_BACKEND_CPU) {
+        an_wait_ticket (metric->ctx, metric->ticket);
+    }
+
+    an_fill_batch_points ((struct CFUpdateBatchPoint*)(metric->movePtr + 1),
+                          coords, deltas, npoints, ndim);
+    metric->movePtr->npoints = npoints;
+
+    if (metric->ctx->backend == AN_BACKEND_CPU) {
+        metric->resultPtr[METRIC_RESULT_MOVE] =
+            an_cpu_distance (metric->recon, metric->target,
+                             (struct CFUpdateBatchPoint*)(metric->movePtr + 1), npoints);
+    } else {
+        an_wait_ticket (metric->ctx, invoke_kernels (metric, metric->moveCommandBuffer));
+    }
+
+    *distance = metric->resultPtr[METRIC_RESULT_MOVE];
+    metric->movePending = 1;
+    metric->movePoints = npoints;
+    metric->moveGeneration = metric->recon->generation;
+    return 1;
+}
+
+int
+an_metric_evaluate_move (struct an_metric   *metric,
+                         const unsigned int *coords,
+                         const float        *deltas,
+                         unsigned int        npoints,
+                         unsigned int        ndim,
+                         float              *distance) {
+    double start = an_trace_begin (metric->ctx);
+    int ok = evaluate_move (metric, coords, deltas, npoints, ndim, distance);
+    an_trace_end (metric->ctx, "an_metric_evaluate_move", start);
+    return ok;
+}
+
+static int
+commit_move (struct an_metric *metric) {
+    if (!metric->movePending) {
+        fprintf (stderr, "No move to commit\n");
+        return 0;
+    }
+
+    struct an_image *recon = metric->recon;
+    int fresh = metric->moveGeneration == recon->generation;
+    /* Resynchronization of the image also changes the generation */
+    unsigned long expected = recon->generation + 1;
+
+    metric->movePending = 0;
+    if (metric->movePoints == 0) {
+        return 1;
+    }
+
+    if (!an_image_submit_batch (recon,
+                                (struct CFUpdateBatchPoint*)(metric->movePtr + 1),
+                                metric->movePoints)) {
+        return 0;
+    }
+
+    /*
+     * If the image has not changed since the evaluation, the
+     * evaluated distance is the distance of the updated image.
+     */
+    if (fresh && recon->generation == expected) {
+        if (metric->ctx->backend != AN_BACKEND_CPU) {
+            an_wait_ticket (metric->ctx, metric->ticket);
+        }
+
+        /* Pending asynchronous requests are superseded */
+        metric->distanceTicket = 0;
+        metric->resultPtr[METRIC_RESULT_DISTANCE] = metric->resultPtr[METRIC_RESULT_MOVE];
+        metric->distanceValid = 1;
+        metric->distanceGeneration = recon->generation;
+    }
+
+    return 1;
+}
+
+int
+an_metric_commit_move (struct an_metric *metric) {
+    double start = an_trace_begin (metric->ctx);
+    int ok = commit_move (metric);
+    an_trace_end (metric->ctx, "an_metric_commit_move", start);
+    return ok;
+}
+
+static int
+update_fft (struct an_metric   *metric,
+            const unsigned int *coords,
+            const float        *deltas,
+            unsigned int        npoints,
+            unsigned int        ndim) {
+    struct an_gpu_context *ctx = metric->ctx;
+    struct an_image *recon = metric->recon;
+
+    if (!check_whole (metric)) {
+        return 0;
+    }
+
+    if (ndim != recon->updateData.ndim) {
+        fprintf (stderr, "Wrong dimensions\n");
+        return 0;
+    }
+
+    if (npoints == 0) {
+        return 1;
+    }
+
+    /* Start from the exact value if the image was changed elsewhere */
+    if (!metric->distanceValid || metric->distanceGeneration != recon->generation) {
+        float distance;
+        an_distance (metric, &distance);
+    }
+
+    if (ctx->backend == AN_BACKEND_CPU) {
+        struct CFUpdateBatchPoint *points =
+            malloc (sizeof (struct CFUpdateBatchPoint) * npoints);
+        an_fill_batch_points (points, coords, deltas, npoints, ndim);
+        metric->resultPtr[METRIC_RESULT_DISTANCE] +=
+            an_cpu_update_tracked (recon, metric->target, points, npoints);
+        recon->generation++;
+        metric->distanceTicket = ++metric->ticket;
+        metric->distanceGeneration = recon->generation;
+        int ok = an_resync_record (recon, points, npoints);
+        free (points);
+        return ok;
+    }
+
+    if (!ensure_move_capacity (metric, npoints) || !ensure_tracking (metric)) {
+        return 0;
+    }
+
+    an_wait_ticket (ctx, metric->ticket);
+    an_fill_batch_points ((struct CFUpdateBatchPoint*)(metric->movePtr + 1),
+                          coords, deltas, npoints, ndim);
+    metric->movePtr->npoints = npoints;
+    metric->movePending = 0;
+
+    recon->ticket = invoke_kernels (metric, metric->trackCommandBuffer);
+    metric->distanceTicket = recon->ticket;
+    recon->generation++;
+    metric->distanceGeneration = recon->generation;
+
+    return an_resync_record (recon, (struct CFUpdateBatchPoint*)(metric->movePtr + 1),
+                             npoints);
+}
+
+int
+an_metric_update_fft (struct an_metric   *metric,
+                      const unsigned int *coords,
+                      const float        *deltas,
+                      unsigned int        npoints,
+                      unsigned int        ndim) {
+    double start = an_trace_begin (metric->ctx);
+    int ok = update_fft (metric, coords, deltas, npoints, ndim);
+    an_trace_end (metric->ctx, "an_metric_update_fft", start);
+    return ok;
+}
+
+int
+an_metric_current_distance (struct an_metric *metric,
+                            float            *distance) {
+    struct an_image *recon = metric->recon;
+
+    if (!metric->distanceValid || metric->distanceGeneration != recon->generation) {
+        return an_distance (metric, distance);
+    }
+
+    if (metric->ctx->backend != AN_BACKEND_CPU) {
+        an_wait_ticket (metric->ctx, metric->ticket);
+    }
+
+    *distance = metric->resultPtr[METRIC_RESULT_DISTANCE];
     return 1;
 }
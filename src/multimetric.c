@@ -0,0 +1,253 @@
+/* Distance to several targets in one pass */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <vulkan/vulkan.h>
+
+#include "annealing-lowlevel.h"
+#include "internal.h"
+
+static void
+update_descriptors (struct an_multi_metric *metric) {
+    struct an_gpu_context *ctx = metric->ctx;
+    size_t actual_size = metric->recon->actual_size;
+
+    struct an_image_memory *buffers[6] = {
+        metric->targetsMemory, metric->recon->imageMemory, metric->weightsMemory,
+        metric->partialsMemory, metric->countersMemory, metric->resultMemory
+    };
+    size_t sizes[6] = {
+        metric->targetSize * metric->ntargets,
+        sizeof (mycomplex) * actual_size,
+        sizeof (float) * (metric->weighted ? actual_size : 1),
+        sizeof (float) * METRIC_MAX_GROUPS * metric->ntargets,
+        sizeof (unsigned int) * metric->ntargets,
+        sizeof (float) * metric->ntargets
+    };
+
+    an_write_storage_descriptors (ctx, metric->set, buffers, sizes, 6);
+}
+
+static void
+record_command_buffer (struct an_multi_metric *metric, const struct an_corrfn *target) {
+    struct an_gpu_context *ctx = metric->ctx;
+    struct pipeline *pipeline = ctx->pipelines[PIPELINE_METRIC_MULTI];
+    unsigned int actual_size = metric->recon->actual_size;
+
+    struct MultiMetricData params;
+    params.length = actual_size;
+    params.ntargets = metric->ntargets;
+    params.stride = (target->format == AN_STORAGE_FLOAT32) ?
+        target->storage_size / sizeof (float) :
+        target->storage_size / sizeof (uint16_t);
+    params.format = target->format;
+    params.weighted = metric->weighted;
+
+    VkCommandBufferBeginInfo beginInfo;
+    ZERO(beginInfo);
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+
+    vkBeginCommandBuffer (metric->commandBuffer, &beginInfo);
+    an_record_barrier (metric->commandBuffer);
+    an_stats_register (ctx, metric->commandBuffer, AN_STAGE_METRIC);
+    vkCmdBindPipeline (metric->commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                       an_get_pipeline (ctx, PIPELINE_METRIC_MULTI,
+                                        metric->recon->updateData.ndim));
+    vkCmdBindDescriptorSets (metric->commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                             pipeline->pipelineLayout,
+                             0, 1, &metric->set, 0, NULL);
+    vkCmdPushConstants (metric->commandBuffer, pipeline->pipelineLayout,
+                        VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                        sizeof (struct MultiMetricData), &params);
+    vkCmdDispatch (metric->commandBuffer, an_metric_groups (actual_size), 1, 1);
+    vkEndCommandBuffer (metric->commandBuffer);
+}
+
+void
+an_destroy_multi_metric (struct an_multi_metric *metric) {
+    struct an_gpu_context *ctx = metric->ctx;
+
+    if (ctx->backend != AN_BACKEND_CPU) {
+        an_wait_ticket (ctx, metric->ticket);
+    }
+
+    an_free_descriptor_set (ctx, metric->pool, &metric->set);
+
+    if (metric->commandBuffer != VK_NULL_HANDLE) {
+        an_stats_forget (ctx, metric->commandBuffer);
+        vkFreeCommandBuffers (ctx->device, ctx->cmdPool, 1, &metric->commandBuffer);
+    }
+
+    struct an_image_memory *buffers[5] = {
+        metric->targetsMemory, metric->weightsMemory, metric->partialsMemory,
+        metric->countersMemory, metric->resultMemory
+    };
+
+    for (int i = 0; i < 5; i++) {
+        if (buffers[i] != NULL) {
+            an_destroy_buffer (ctx, buffers[i]);
+        }
+    }
+
+    free (metric->cpuWeights);
+    free (metric);
+}
+
+struct an_multi_metric*
+an_create_multi_metric (struct an_gpu_context  *ctx,
+                        struct an_corrfn      **targets,
+                        const float            *weights,
+                        unsigned int            ntargets,
+                        const float            *frequencyWeights,
+                        struct an_image        *recon) {
+    if (ntargets == 0 || ntargets > MULTI_METRIC_MAX_TARGETS) {
+        fprintf (stderr, "Wrong number of targets\n");
+        return NULL;
+    }
+
+    for (unsigned int k = 0; k < ntargets; k++) {
+        if (targets[k]->ctx != ctx || recon->ctx != ctx ||
+            targets[k]->actual_size != recon->actual_size ||
+            targets[k]->subset != recon->subset ||
+            targets[k]->format != targets[0]->format) {
+            fprintf (stderr, "Incompatible images\n");
+            return NULL;
+        }
+    }
+
+    VkResult result;
+    size_t actual_size = recon->actual_size;
+    struct an_multi_metric *metric = malloc (sizeof (struct an_multi_metric));
+    memset (metric, 0, sizeof (struct an_multi_metric));
+    metric->ctx = ctx;
+    metric->recon = recon;
+    metric->ntargets = ntargets;
+    metric->weighted = frequencyWeights != NULL;
+    memcpy (metric->weights, weights, sizeof (float) * ntargets);
+
+    if (ctx->backend == AN_BACKEND_CPU) {
+        for (unsigned int k = 0; k < ntargets; k++) {
+            metric->cpuTargets[k] = targets[k]->cpuData;
+        }
+
+        if (frequencyWeights != NULL) {
+            metric->cpuWeights = malloc (sizeof (float) * actual_size);
+            memcpy (metric->cpuWeights, frequencyWeights, sizeof (float) * actual_size);
+        }
+
+        return metric;
+    }
+
+    /* Copies of the targets, so that one binding serves all of them */
+    size_t storageSize = targets[0]->storage_size;
+    metric->targetSize = storageSize;
+    metric->targetsMemory =
+        an_create_buffer (ctx, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                          VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                          storageSize * ntargets);
+    if (metric->targetsMemory == NULL) {
+        fprintf (stderr, "Cannot create buffer for targets\n");
+        goto cleanup;
+    }
+
+    for (unsigned int k = 0; k < ntargets; k++) {
+        if (!an_copy_data (ctx, targets[k]->corrfnMemory, 0,
+                           metric->targetsMemory, k * storageSize, storageSize)) {
+            fprintf (stderr, "Cannot copy the target\n");
+            goto cleanup;
+        }
+    }
+
+    /* A placeholder when there are no weights */
+    size_t weightsSize = sizeof (float) * ((frequencyWeights != NULL) ? actual_size : 1);
+    metric->weightsMemory =
+        an_create_buffer (ctx, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                          VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                          weightsSize);
+    if (metric->weightsMemory == NULL) {
+        fprintf (stderr, "Cannot create buffer for weights\n");
+        goto cleanup;
+    }
+
+    if (frequencyWeights != NULL &&
+        !an_write_data (ctx, metric->weightsMemory, frequencyWeights, weightsSize)) {
+        fprintf (stderr, "Cannot write weights\n");
+        goto cleanup;
+    }
+
+    if (!an_create_reduce_memory (ctx, METRIC_MAX_GROUPS * ntargets, ntargets,
+                                  &metric->partialsMemory, &metric->countersMemory)) {
+        goto cleanup;
+    }
+
+    metric->resultMemory =
+        an_create_buffer (ctx, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                          sizeof (float) * ntargets);
+    if (metric->resultMemory == NULL) {
+        fprintf (stderr, "Cannot create result buffer\n");
+        goto cleanup;
+    }
+
+    metric->resultPtr = metric->resultMemory->mapped;
+
+    result = an_create_command_buffer (ctx, &metric->commandBuffer);
+    if (result != VK_SUCCESS) {
+        fprintf (stderr, "Cannot allocate command buffer, code = %i\n", result);
+        goto cleanup;
+    }
+
+    result = an_allocate_descriptor_set (ctx, ctx->pipelines[PIPELINE_METRIC_MULTI],
+                                         &metric->pool, &metric->set);
+    if (result != VK_SUCCESS) {
+        fprintf (stderr, "Cannot allocate descriptor set, code = %i\n", result);
+        goto cleanup;
+    }
+
+    update_descriptors (metric);
+    record_command_buffer (metric, targets[0]);
+
+    return metric;
+
+cleanup:
+    an_destroy_multi_metric (metric);
+    return NULL;
+}
+
+int
+an_multi_distance (struct an_multi_metric *metric,
+                   float                  *distance,
+                   float                  *components) {
+    struct an_gpu_context *ctx = metric->ctx;
+    double values[MULTI_METRIC_MAX_TARGETS];
+
+    double start = an_trace_begin (ctx);
+    if (ctx->backend == AN_BACKEND_CPU) {
+        an_cpu_multi_distance (metric->recon, metric->cpuTargets, metric->cpuWeights,
+                               metric->ntargets, values);
+    } else {
+        an_wait_ticket (ctx, metric->ticket);
+        metric->ticket = an_submit (ctx, metric->commandBuffer);
+        an_wait_ticket (ctx, metric->ticket);
+
+        for (unsigned int k = 0; k < metric->ntargets; k++) {
+            values[k] = metric->resultPtr[k];
+        }
+    }
+
+    double sum = 0;
+    for (unsigned int k = 0; k < metric->ntargets; k++) {
+        sum += metric->weights[k] * values[k];
+        if (components != NULL) {
+            components[k] = values[k];
+        }
+    }
+
+    *distance = sum;
+    an_trace_end (ctx, "an_multi_distance", start);
+    return 1;
+}
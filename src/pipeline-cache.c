@@ -0,0 +1,199 @@
+/* Pipeline cache which persists between runs */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <vulkan/vulkan.h>
+
+#include "annealing-lowlevel.h"
+#include "internal.h"
+
+#define CACHE_DIRECTORY "annealing-lowlevel"
+
+/*
+ * The cache lives in $XDG_CACHE_HOME/annealing-lowlevel (or in
+ * ~/.cache/annealing-lowlevel). The name of the file contains the
+ * pipeline cache UUID and the driver version, so different devices and
+ * driver updates never share the data. The result must be freed.
+ */
+static char*
+cache_path (const VkPhysicalDeviceProperties *properties, int createDirectory) {
+    const char *home = getenv ("XDG_CACHE_HOME");
+    const char *suffix = "";
+
+    if (home == NULL || home[0] != '/') {
+        home = getenv ("HOME");
+        suffix = "/.cache";
+        if (home == NULL || home[0] != '/') {
+            return NULL;
+        }
+    }
+
+    size_t length = strlen (home) + strlen (suffix) + strlen (CACHE_DIRECTORY) +
+        2 * VK_UUID_SIZE + 64;
+    char *path = malloc (length);
+
+    if (createDirectory) {
+        snprintf (path, length, "%s%s", home, suffix);
+        mkdir (path, 0700);
+        snprintf (path, length, "%s%s/" CACHE_DIRECTORY, home, suffix);
+        mkdir (path, 0700);
+    }
+
+    int n = snprintf (path, length, "%s%s/" CACHE_DIRECTORY "/pipelines-", home, suffix);
+    for (int i = 0; i < VK_UUID_SIZE; i++) {
+        n += snprintf (path + n, length - n, "%02x", properties->pipelineCacheUUID[i]);
+    }
+    snprintf (path + n, length - n, "-%08x.bin", properties->driverVersion);
+
+    return path;
+}
+
+/* Check that the data was written by the same device */
+static int
+header_valid (const VkPhysicalDeviceProperties *properties,
+              const void *data, size_t size) {
+    VkPipelineCacheHeaderVersionOne header;
+
+    if (size < sizeof (header)) {
+        return 0;
+    }
+
+    memcpy (&header, data, sizeof (header));
+    return header.headerSize >= sizeof (header) &&
+        header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+        header.vendorID == properties->vendorID &&
+        header.deviceID == properties->deviceID &&
+        memcmp (header.pipelineCacheUUID, properties->pipelineCacheUUID,
+                VK_UUID_SIZE) == 0;
+}
+
+static void*
+read_cache (const char *path, size_t *size) {
+    FILE *stream = fopen (path, "rb");
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    void *data = NULL;
+    long length;
+    fseek (stream, 0, SEEK_END);
+    length = ftell (stream);
+    fseek (stream, 0, SEEK_SET);
+
+    if (length > 0) {
+        data = malloc (length);
+        if (fread (data, length, 1, stream) != 1) {
+            free (data);
+            data = NULL;
+        }
+    }
+
+    fclose (stream);
+    *size = (data != NULL) ? length : 0;
+    return data;
+}
+
+VkResult
+an_create_pipeline_cache (struct an_gpu_context *ctx) {
+    assert (ctx->device != VK_NULL_HANDLE);
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties (ctx->physDev, &properties);
+
+    void *data = NULL;
+    size_t size = 0;
+    char *path = cache_path (&properties, 0);
+    if (path != NULL) {
+        data = read_cache (path, &size);
+        free (path);
+    }
+
+    if (data != NULL && !header_valid (&properties, data, size)) {
+        free (data);
+        data = NULL;
+        size = 0;
+    }
+
+    VkPipelineCacheCreateInfo cacheInfo;
+    ZERO(cacheInfo);
+    cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    cacheInfo.initialDataSize = size;
+    cacheInfo.pInitialData = data;
+
+    VkResult result = vkCreatePipelineCache (ctx->device, &cacheInfo, NULL, &ctx->cache);
+    if (result != VK_SUCCESS && data != NULL) {
+        /* Try again with an empty cache */
+        cacheInfo.initialDataSize = 0;
+        cacheInfo.pInitialData = NULL;
+        size = 0;
+        result = vkCreatePipelineCache (ctx->device, &cacheInfo, NULL, &ctx->cache);
+    }
+
+    free (data);
+    ctx->cacheSize = size;
+    return result;
+}
+
+void
+an_save_pipeline_cache (struct an_gpu_context *ctx) {
+    assert (ctx->device != VK_NULL_HANDLE && ctx->cache != VK_NULL_HANDLE);
+
+    size_t size;
+    VkResult result = vkGetPipelineCacheData (ctx->device, ctx->cache, &size, NULL);
+    /* Nothing new since it was loaded */
+    if (result != VK_SUCCESS || size == ctx->cacheSize) {
+        return;
+    }
+
+    void *data = malloc (size);
+    result = vkGetPipelineCacheData (ctx->device, ctx->cache, &size, data);
+    if (result != VK_SUCCESS) {
+        free (data);
+        return;
+    }
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties (ctx->physDev, &properties);
+    char *path = cache_path (&properties, 1);
+    if (path == NULL) {
+        free (data);
+        return;
+    }
+
+    /*
+     * Write to a temporary file and rename it, so that concurrent
+     * processes never see a partially written cache.
+     */
+    size_t length = strlen (path) + 8;
+    char *tmpPath = malloc (length);
+    snprintf (tmpPath, length, "%s.XXXXXX", path);
+
+    int fd = mkstemp (tmpPath);
+    if (fd < 0) {
+        goto cleanup;
+    }
+
+    FILE *stream = fdopen (fd, "wb");
+    if (stream == NULL) {
+        close (fd);
+        unlink (tmpPath);
+        goto cleanup;
+    }
+
+    int written = fwrite (data, size, 1, stream) == 1;
+    if (fclose (stream) != 0 || !written || rename (tmpPath, path) != 0) {
+        unlink (tmpPath);
+        goto cleanup;
+    }
+
+    ctx->cacheSize = size;
+
+cleanup:
+    free (tmpPath);
+    free (path);
+    free (data);
+}
@@ -0,0 +1,516 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <vulkan/vulkan.h>
+
+#include "annealing-lowlevel.h"
+#include "internal.h"
+
+#define REPLICAS_GRP_SIZE 64
+/* The guaranteed limit of maxComputeWorkGroupCount */
+#define REPLICAS_MAX_GROUPS 65535
+
+static void
+update_descriptors (struct an_replicas *replicas) {
+    struct an_gpu_context *ctx = replicas->ctx;
+    size_t total = replicas->actual_size * replicas->nreplicas;
+
+    struct an_image_memory *updateBuffers[4] = {
+        replicas->spectraMemory, replicas->countsMemory,
+        replicas->pointsMemory, replicas->twiddleMemory
+    };
+    size_t updateSizes[4] = {
+        sizeof (mycomplex) * total,
+        sizeof (unsigned int) * replicas->nreplicas,
+        sizeof (struct CFUpdateBatchPoint) * replicas->maxpoints * replicas->nreplicas,
+        sizeof (mycomplex) * replicas->twiddle_size
+    };
+
+    struct an_image_memory *metricBuffers[5] = {
+        replicas->target->corrfnMemory, replicas->spectraMemory,
+        replicas->partialsMemory, replicas->countersMemory, replicas->resultMemory
+    };
+    size_t metricSizes[5] = {
+        replicas->target->storage_size,
+        sizeof (mycomplex) * total,
+        sizeof (float) * METRIC_MAX_GROUPS * replicas->nreplicas,
+        sizeof (unsigned int) * replicas->nreplicas,
+        sizeof (float) * replicas->nreplicas
+    };
+
+    an_write_storage_descriptors (ctx, replicas->updateSet, updateBuffers, updateSizes, 4);
+    an_write_storage_descriptors (ctx, replicas->metricSet, metricBuffers, metricSizes, 5);
+}
+
+/* Distances of all replicas in one dispatch, a row of work groups per replica */
+static void
+record_distances (struct an_replicas *replicas, VkCommandBuffer commandBuffer) {
+    struct an_gpu_context *ctx = replicas->ctx;
+    struct pipeline *metricPipeline = ctx->pipelines[PIPELINE_METRIC];
+    unsigned int actual_size = replicas->actual_size;
+
+    struct MetricUpdateData params;
+    params.length = actual_size;
+    params.target = 0;
+    params.accumulate = 0;
+    params.format = replicas->target->format;
+
+    vkCmdBindPipeline (commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                       an_get_pipeline (ctx, PIPELINE_METRIC,
+                                        replicas->updateData.ndim));
+    vkCmdBindDescriptorSets (commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                             metricPipeline->pipelineLayout,
+                             0, 1, &replicas->metricSet, 0, NULL);
+    vkCmdPushConstants (commandBuffer, metricPipeline->pipelineLayout,
+                        VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                        sizeof (struct MetricUpdateData), &params);
+    vkCmdDispatch (commandBuffer, an_metric_groups (actual_size), replicas->nreplicas, 1);
+}
+
+static void
+record_command_buffers (struct an_replicas *replicas) {
+    struct an_gpu_context *ctx = replicas->ctx;
+    struct pipeline *updatePipeline = ctx->pipelines[PIPELINE_REPLICAS_UPDATE];
+
+    struct ReplicasUpdateData params;
+    params.dims = replicas->updateData;
+    params.length = replicas->actual_size;
+    params.maxpoints = replicas->maxpoints;
+
+    VkCommandBufferBeginInfo beginInfo;
+    ZERO(beginInfo);
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+
+    /* Update all replicas, then calculate distances */
+    vkBeginCommandBuffer (replicas->updateCommandBuffer, &beginInfo);
+    an_record_barrier (replicas->updateCommandBuffer);
+    vkCmdBindPipeline (replicas->updateCommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                       an_get_pipeline (ctx, PIPELINE_REPLICAS_UPDATE,
+                                        replicas->updateData.ndim));
+    vkCmdBindDescriptorSets (replicas->updateCommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                             updatePipeline->pipelineLayout,
+                             0, 1, &replicas->updateSet, 0, NULL);
+    vkCmdPushConstants (replicas->updateCommandBuffer, updatePipeline->pipelineLayout,
+                        VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                        sizeof (struct ReplicasUpdateData), &params);
+    /* The shader loops over frequencies which do not fit in the groups */
+    size_t groups = ceil((double) replicas->actual_size / (double)REPLICAS_GRP_SIZE);
+    if (groups > REPLICAS_MAX_GROUPS) {
+        groups = REPLICAS_MAX_GROUPS;
+    }
+    vkCmdDispatch (replicas->updateCommandBuffer, groups, replicas->nreplicas, 1);
+    an_record_barrier (replicas->updateCommandBuffer);
+    record_distances (replicas, replicas->updateCommandBuffer);
+    vkEndCommandBuffer (replicas->updateCommandBuffer);
+
+    /* Only calculate distances */
+    vkBeginCommandBuffer (replicas->distanceCommandBuffer, &beginInfo);
+    an_record_barrier (replicas->distanceCommandBuffer);
+    record_distances (replicas, replicas->distanceCommandBuffer);
+    vkEndCommandBuffer (replicas->distanceCommandBuffer);
+}
+
+static void
+synchronize (struct an_replicas *replicas) {
+    an_wait_ticket (replicas->ctx, replicas->ticket);
+}
+
+static void
+submit (struct an_replicas *replicas, VkCommandBuffer commandBuffer) {
+    replicas->ticket = an_submit (replicas->ctx, commandBuffer);
+}
+
+static struct an_image_memory*
+create_storage (struct an_gpu_context *ctx, int hostVisible, size_t size) {
+    VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+    VkMemoryPropertyFlags properties = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+
+    if (hostVisible) {
+        properties = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+            VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    } else {
+        usage |= VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+    }
+
+    return an_create_buffer (ctx, usage, properties, size);
+}
+
+void
+an_destroy_replicas (struct an_replicas *replicas) {
+    struct an_gpu_context *ctx = replicas->ctx;
+
+    if (ctx->backend == AN_BACKEND_CPU) {
+        free (replicas->countsPtr);
+        free (replicas->pointsPtr);
+        free (replicas->resultPtr);
+        free (replicas->cpuImages);
+        free (replicas->cpuData);
+        free (replicas->twiddle);
+        free (replicas->slots);
+        free (replicas);
+        return;
+    }
+
+    synchronize (replicas);
+
+    an_free_descriptor_set (ctx, replicas->updatePool, &replicas->updateSet);
+    an_free_descriptor_set (ctx, replicas->metricPool, &replicas->metricSet);
+
+    if (replicas->updateCommandBuffer != VK_NULL_HANDLE) {
+        vkFreeCommandBuffers (ctx->device, ctx->cmdPool, 1, &replicas->updateCommandBuffer);
+    }
+
+    if (replicas->distanceCommandBuffer != VK_NULL_HANDLE) {
+        vkFreeCommandBuffers (ctx->device, ctx->cmdPool, 1, &replicas->distanceCommandBuffer);
+    }
+
+    struct an_image_memory *buffers[7] = {
+        replicas->spectraMemory, replicas->twiddleMemory, replicas->countsMemory,
+        replicas->pointsMemory, replicas->partialsMemory, replicas->countersMemory,
+        replicas->resultMemory
+    };
+    for (int i = 0; i < 7; i++) {
+        if (buffers[i] != NULL) {
+            an_destroy_buffer (ctx, buffers[i]);
+        }
+    }
+
+    free (replicas->twiddle);
+    free (replicas->slots);
+    free (replicas);
+}
+
+static struct an_replicas*
+create_cpu_replicas (struct an_replicas *replicas, struct an_image *image) {
+    unsigned int nreplicas = replicas->nreplicas;
+    size_t actual_size = replicas->actual_size;
+
+    replicas->countsPtr = calloc (nreplicas, sizeof (unsigned int));
+    replicas->pointsPtr = malloc (sizeof (struct CFUpdateBatchPoint) *
+                                  replicas->maxpoints * nreplicas);
+    replicas->resultPtr = calloc (nreplicas, sizeof (float));
+    replicas->cpuData = malloc (sizeof (mycomplex) * actual_size * nreplicas);
+    replicas->cpuImages = calloc (nreplicas, sizeof (struct an_image));
+
+    for (unsigned int i = 0; i < nreplicas; i++) {
+        struct an_image *view = &replicas->cpuImages[i];
+        view->ctx = replicas->ctx;
+        view->updateData = replicas->updateData;
+        view->actual_size = actual_size;
+        view->twiddle = replicas->twiddle;
+        view->twiddle_size = replicas->twiddle_size;
+        view->cpuData = replicas->cpuData + i * actual_size;
+
+        memcpy (view->cpuData, image->cpuData, sizeof (mycomplex) * actual_size);
+    }
+
+    return replicas;
+}
+
+struct an_replicas*
+an_create_replicas (struct an_gpu_context *ctx,
+                    struct an_corrfn      *target,
+                    struct an_image       *image,
+                    unsigned int           nreplicas,
+                    unsigned int           maxpoints) {
+    if (target->ctx != ctx || image->ctx != ctx ||
+        target->actual_size != image->actual_size) {
+        fprintf (stderr, "Incompatible images\n");
+        return NULL;
+    }
+
+    if (image->subset != NULL) {
+        fprintf (stderr, "Not supported for frequency subsets\n");
+        return NULL;
+    }
+
+    if (nreplicas == 0 || maxpoints == 0) {
+        fprintf (stderr, "Need at least one replica and one point\n");
+        return NULL;
+    }
+
+    VkResult result;
+    struct an_replicas *replicas = malloc (sizeof (struct an_replicas));
+    memset (replicas, 0, sizeof (struct an_replicas));
+
+    replicas->ctx = ctx;
+    replicas->target = target;
+    replicas->nreplicas = nreplicas;
+    replicas->maxpoints = maxpoints;
+    replicas->updateData = image->updateData;
+    replicas->actual_size = image->actual_size;
+    replicas->twiddle = an_make_twiddle (&replicas->updateData, &replicas->twiddle_size);
+
+    replicas->slots = malloc (sizeof (unsigned int) * nreplicas);
+    for (unsigned int i = 0; i < nreplicas; i++) {
+        replicas->slots[i] = i;
+    }
+
+    if (ctx->backend == AN_BACKEND_CPU) {
+        return create_cpu_replicas (replicas, image);
+    }
+
+    size_t spectrumSize = sizeof (mycomplex) * replicas->actual_size;
+    size_t total = replicas->actual_size * nreplicas;
+
+    replicas->spectraMemory = create_storage (ctx, 0, sizeof (mycomplex) * total);
+    replicas->twiddleMemory =
+        create_storage (ctx, 0, sizeof (mycomplex) * replicas->twiddle_size);
+    replicas->countsMemory =
+        create_storage (ctx, 1, sizeof (unsigned int) * nreplicas);
+    replicas->pointsMemory =
+        create_storage (ctx, 1, sizeof (struct CFUpdateBatchPoint) * maxpoints * nreplicas);
+    replicas->resultMemory = create_storage (ctx, 1, sizeof (float) * nreplicas);
+
+    if (replicas->spectraMemory == NULL || replicas->twiddleMemory == NULL ||
+        replicas->countsMemory  == NULL || replicas->pointsMemory  == NULL ||
+        replicas->resultMemory  == NULL) {
+        fprintf (stderr, "Cannot create replica buffers\n");
+        goto cleanup;
+    }
+
+    if (!an_create_reduce_memory (ctx, METRIC_MAX_GROUPS * nreplicas, nreplicas,
+                                  &replicas->partialsMemory, &replicas->countersMemory)) {
+        goto cleanup;
+    }
+
+    replicas->countsPtr = replicas->countsMemory->mapped;
+    replicas->pointsPtr = replicas->pointsMemory->mapped;
+    replicas->resultPtr = replicas->resultMemory->mapped;
+
+    if (!an_write_data (ctx, replicas->twiddleMemory, replicas->twiddle,
+                        sizeof (mycomplex) * replicas->twiddle_size)) {
+        fprintf (stderr, "Cannot write data to twiddle memory\n");
+        goto cleanup;
+    }
+
+    /* All replicas start from the same image */
+    an_image_synchronize (image);
+    for (unsigned int i = 0; i < nreplicas; i++) {
+        if (!an_copy_data (ctx, image->imageMemory, 0,
+                           replicas->spectraMemory, i * spectrumSize,
+                           spectrumSize)) {
+            goto cleanup;
+        }
+    }
+
+    result = an_create_command_buffer (ctx, &replicas->updateCommandBuffer);
+    if (result != VK_SUCCESS) {
+        fprintf (stderr, "Cannot allocate command buffer, code = %i\n", result);
+        goto cleanup;
+    }
+
+    result = an_create_command_buffer (ctx, &replicas->distanceCommandBuffer);
+    if (result != VK_SUCCESS) {
+        fprintf (stderr, "Cannot allocate command buffer, code = %i\n", result);
+        goto cleanup;
+    }
+
+    result = an_allocate_descriptor_set (ctx, ctx->pipelines[PIPELINE_REPLICAS_UPDATE],
+                                         &replicas->updatePool, &replicas->updateSet);
+    if (result != VK_SUCCESS) {
+        fprintf (stderr, "Cannot allocate descriptor set, code = %i\n", result);
+        goto cleanup;
+    }
+
+    result = an_allocate_descriptor_set (ctx, ctx->pipelines[PIPELINE_METRIC],
+                                         &replicas->metricPool, &replicas->metricSet);
+    if (result != VK_SUCCESS) {
+        fprintf (stderr, "Cannot allocate descriptor set, code = %i\n", result);
+        goto cleanup;
+    }
+
+    update_descriptors (replicas);
+    record_command_buffers (replicas);
+    return replicas;
+
+cleanup:
+    an_destroy_replicas (replicas);
+    return NULL;
+}
+
+static int
+check_index (struct an_replicas *replicas, unsigned int index) {
+    if (index >= replicas->nreplicas) {
+        fprintf (stderr, "Replica index out of range\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+static int
+check_image (struct an_replicas *replicas, struct an_image *image) {
+    if (image->ctx != replicas->ctx || image->actual_size != replicas->actual_size ||
+        image->subset != NULL) {
+        fprintf (stderr, "Incompatible images\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+int
+an_replicas_set_image (struct an_replicas *replicas,
+                       unsigned int        index,
+                       struct an_image    *image) {
+    if (!check_index (replicas, index) || !check_image (replicas, image)) {
+        return 0;
+    }
+
+    unsigned int slot = replicas->slots[index];
+    size_t spectrumSize = sizeof (mycomplex) * replicas->actual_size;
+    replicas->distancesValid = 0;
+
+    if (replicas->ctx->backend == AN_BACKEND_CPU) {
+        memcpy (replicas->cpuImages[slot].cpuData, image->cpuData, spectrumSize);
+        return 1;
+    }
+
+    synchronize (replicas);
+    an_image_synchronize (image);
+    return an_copy_data (replicas->ctx, image->imageMemory, 0,
+                         replicas->spectraMemory, slot * spectrumSize,
+                         spectrumSize);
+}
+
+int
+an_replicas_get_image (struct an_replicas *replicas,
+                       unsigned int        index,
+                       struct an_image    *image) {
+    if (!check_index (replicas, index) || !check_image (replicas, image)) {
+        return 0;
+    }
+
+    unsigned int slot = replicas->slots[index];
+    size_t spectrumSize = sizeof (mycomplex) * replicas->actual_size;
+    image->generation++;
+
+    if (replicas->ctx->backend == AN_BACKEND_CPU) {
+        memcpy (image->cpuData, replicas->cpuImages[slot].cpuData, spectrumSize);
+        return an_resync_reload (image);
+    }
+
+    synchronize (replicas);
+    an_image_synchronize (image);
+    return an_copy_data (replicas->ctx, replicas->spectraMemory, slot * spectrumSize,
+                         image->imageMemory, 0, spectrumSize) &&
+        an_resync_reload (image);
+}
+
+static void
+cpu_update (struct an_replicas *replicas) {
+    for (unsigned int slot = 0; slot < replicas->nreplicas; slot++) {
+        struct an_image *view = &replicas->cpuImages[slot];
+        struct CFUpdateBatchPoint *points =
+            replicas->pointsPtr + slot * replicas->maxpoints;
+        unsigned int npoints = replicas->countsPtr[slot];
+
+        if (npoints == 0) {
+            continue;
+        }
+
+        if (replicas->distancesValid) {
+            replicas->resultPtr[slot] +=
+                an_cpu_update_tracked (view, replicas->target, points, npoints);
+        } else {
+            an_cpu_update (view, points, npoints);
+        }
+    }
+}
+
+int
+an_replicas_update_fft (struct an_replicas *replicas,
+                        const unsigned int *npoints,
+                        const unsigned int *coords,
+                        const float        *deltas,
+                        unsigned int        ndim) {
+    struct an_gpu_context *ctx = replicas->ctx;
+
+    if (ndim != replicas->updateData.ndim) {
+        fprintf (stderr, "Wrong dimensions\n");
+        return 0;
+    }
+
+    for (unsigned int i = 0; i < replicas->nreplicas; i++) {
+        if (npoints[i] > replicas->maxpoints) {
+            fprintf (stderr, "Too many points for replica %u\n", i);
+            return 0;
+        }
+    }
+
+    double start = an_trace_begin (ctx);
+    if (ctx->backend != AN_BACKEND_CPU) {
+        synchronize (replicas);
+    }
+
+    size_t offset = 0;
+    for (unsigned int i = 0; i < replicas->nreplicas; i++) {
+        unsigned int slot = replicas->slots[i];
+        an_fill_batch_points (replicas->pointsPtr + slot * replicas->maxpoints,
+                              coords + offset * ndim, deltas + offset,
+                              npoints[i], ndim);
+        replicas->countsPtr[slot] = npoints[i];
+        offset += npoints[i];
+    }
+
+    if (ctx->backend == AN_BACKEND_CPU) {
+        cpu_update (replicas);
+    } else {
+        /* Distances are calculated in the same submission */
+        submit (replicas, replicas->updateCommandBuffer);
+        replicas->distancesValid = 1;
+    }
+
+    an_trace_end (ctx, "an_replicas_update_fft", start);
+    return 1;
+}
+
+int
+an_replicas_distances (struct an_replicas *replicas,
+                       float              *distances) {
+    struct an_gpu_context *ctx = replicas->ctx;
+
+    double start = an_trace_begin (ctx);
+    if (ctx->backend == AN_BACKEND_CPU) {
+        if (!replicas->distancesValid) {
+            for (unsigned int slot = 0; slot < replicas->nreplicas; slot++) {
+                replicas->resultPtr[slot] =
+                    an_cpu_distance (&replicas->cpuImages[slot], replicas->target,
+                                     NULL, 0);
+            }
+        }
+    } else {
+        if (!replicas->distancesValid) {
+            synchronize (replicas);
+            submit (replicas, replicas->distanceCommandBuffer);
+        }
+
+        synchronize (replicas);
+    }
+
+    replicas->distancesValid = 1;
+    for (unsigned int i = 0; i < replicas->nreplicas; i++) {
+        distances[i] = replicas->resultPtr[replicas->slots[i]];
+    }
+
+    an_trace_end (ctx, "an_replicas_distances", start);
+    return 1;
+}
+
+int
+an_replicas_swap (struct an_replicas *replicas,
+                  unsigned int        i,
+                  unsigned int        j) {
+    if (!check_index (replicas, i) || !check_index (replicas, j)) {
+        return 0;
+    }
+
+    unsigned int tmp = replicas->slots[i];
+    replicas->slots[i] = replicas->slots[j];
+    replicas->slots[j] = tmp;
+    return 1;
+}
@@ -0,0 +1,330 @@
+/* Resynchronization of incrementally updated spectra */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <vulkan/vulkan.h>
+
+#include "annealing-lowlevel.h"
+#include "internal.h"
+
+/*
+ * Each update of the spectrum adds a rounding error, so after many
+ * updates it drifts away from the transform of the real volume. The
+ * image keeps the real volume (the shadow) and every INTERVAL updated
+ * points replaces the spectrum with its exact transform.
+ *
+ * The transform runs in a separate thread while annealing goes on. It
+ * is done on a snapshot of the shadow, so updates made after the
+ * snapshot are logged and replayed on top of the new spectrum. The
+ * drift is measured against the spectrum read at the time of the
+ * snapshot.
+ */
+#define MIN_INTERVAL 1024
+#define REPLAY_CHUNK 4096
+
+struct an_resync {
+    float *shadow;
+    size_t size;
+    unsigned int dimensions[MAX_DIMENSIONS];
+    unsigned int strides[MAX_DIMENSIONS];
+    unsigned int ndim;
+
+    unsigned long interval;
+    unsigned long counter;
+    float threshold;
+    float drift;
+
+    /* The background transform */
+    pthread_t thread;
+    int running;
+    int done;
+    int ok;
+    float *snapshot;
+    float *exactReal, *exactImag;
+    float *currentReal, *currentImag;
+    size_t spectrumSize;
+    float measured;
+
+    /* Updates made after the snapshot */
+    struct CFUpdateBatchPoint *log;
+    size_t nlog, logCapacity;
+    int replaying;
+};
+
+static void*
+worker (void *arg) {
+    struct an_resync *resync = arg;
+    double error = 0, norm = 0;
+
+    resync->ok = an_rfft (resync->snapshot, resync->exactReal, resync->exactImag,
+                          resync->dimensions, resync->ndim);
+    if (resync->ok) {
+        for (size_t i = 0; i < resync->spectrumSize; i++) {
+            double dr = resync->currentReal[i] - resync->exactReal[i];
+            double di = resync->currentImag[i] - resync->exactImag[i];
+            error += dr * dr + di * di;
+            norm += (double)resync->exactReal[i] * resync->exactReal[i] +
+                (double)resync->exactImag[i] * resync->exactImag[i];
+        }
+
+        /* Relative RMS error */
+        resync->measured = (norm > 0) ? sqrt (error / norm) : sqrt (error);
+    }
+
+    __atomic_store_n (&resync->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static int
+finish (struct an_image *image, int wait);
+
+static int
+start (struct an_image *image) {
+    struct an_resync *resync = image->resync;
+
+    if (!an_image_get (image, resync->currentReal, resync->currentImag)) {
+        fprintf (stderr, "Cannot read the spectrum\n");
+        return 0;
+    }
+
+    memcpy (resync->snapshot, resync->shadow, sizeof (float) * resync->size);
+    resync->nlog = 0;
+    resync->counter = 0;
+    resync->done = 0;
+    resync->running = 1;
+
+    if (pthread_create (&resync->thread, NULL, worker, resync) != 0) {
+        /* Do it here then */
+        resync->running = 0;
+        worker (resync);
+        return finish (image, 1);
+    }
+
+    return 1;
+}
+
+static void
+adapt_interval (struct an_resync *resync) {
+    if (resync->threshold <= 0) {
+        return;
+    }
+
+    if (resync->measured > resync->threshold) {
+        resync->interval /= 2;
+        if (resync->interval < MIN_INTERVAL) {
+            resync->interval = MIN_INTERVAL;
+        }
+    } else if (resync->measured < resync->threshold / 4 &&
+               resync->interval < ULONG_MAX / 2) {
+        resync->interval *= 2;
+    }
+}
+
+/* Apply the result of the transform, waiting for it if WAIT is set */
+static int
+finish (struct an_image *image, int wait) {
+    struct an_resync *resync = image->resync;
+
+    if (resync->running) {
+        if (!wait && !__atomic_load_n (&resync->done, __ATOMIC_ACQUIRE)) {
+            return 1;
+        }
+
+        pthread_join (resync->thread, NULL);
+        resync->running = 0;
+    } else if (!resync->done) {
+        return 1;
+    }
+
+    resync->done = 0;
+    if (!resync->ok) {
+        fprintf (stderr, "Cannot transform the real volume\n");
+        return 0;
+    }
+
+    if (!an_image_write_spectrum (image, resync->exactReal, resync->exactImag)) {
+        fprintf (stderr, "Cannot write the spectrum\n");
+        return 0;
+    }
+    image->generation++;
+
+    int ok = 1;
+    resync->replaying = 1;
+    for (size_t i = 0; i < resync->nlog && ok; i += REPLAY_CHUNK) {
+        size_t n = (resync->nlog - i < REPLAY_CHUNK) ? resync->nlog - i : REPLAY_CHUNK;
+        ok = an_image_submit_batch (image, resync->log + i, n);
+    }
+    resync->replaying = 0;
+    resync->nlog = 0;
+
+    resync->drift = resync->measured;
+    adapt_interval (resync);
+    return ok;
+}
+
+static void
+destroy_resync (struct an_resync *resync) {
+    if (resync->running) {
+        pthread_join (resync->thread, NULL);
+    }
+
+    free (resync->shadow);
+    free (resync->snapshot);
+    free (resync->exactReal);
+    free (resync->exactImag);
+    free (resync->currentReal);
+    free (resync->currentImag);
+    free (resync->log);
+    free (resync);
+}
+
+void
+an_resync_destroy (struct an_image *image) {
+    if (image->resync != NULL) {
+        destroy_resync (image->resync);
+        image->resync = NULL;
+    }
+}
+
+int
+an_image_enable_resync (struct an_image *image,
+                        const float     *array,
+                        unsigned long    interval,
+                        float            threshold) {
+    const struct CFUpdateDataConst *data = &image->updateData;
+
+    if (image->subset != NULL) {
+        fprintf (stderr, "Not supported for frequency subsets\n");
+        return 0;
+    }
+
+    an_resync_destroy (image);
+
+    struct an_resync *resync = malloc (sizeof (struct an_resync));
+    memset (resync, 0, sizeof (struct an_resync));
+
+    resync->ndim = data->ndim;
+    resync->size = 1;
+    for (int i = 0; i < data->ndim; i++) {
+        resync->strides[i] = resync->size;
+        resync->size *= data->logical_dimensions[i];
+        resync->dimensions[i] = data->logical_dimensions[data->ndim - i - 1];
+    }
+
+    resync->interval = interval;
+    resync->threshold = threshold;
+    resync->drift = -1;
+    resync->spectrumSize = image->actual_size;
+    resync->shadow = malloc (sizeof (float) * resync->size);
+    resync->snapshot = malloc (sizeof (float) * resync->size);
+    resync->exactReal = malloc (sizeof (float) * image->actual_size);
+    resync->exactImag = malloc (sizeof (float) * image->actual_size);
+    resync->currentReal = malloc (sizeof (float) * image->actual_size);
+    resync->currentImag = malloc (sizeof (float) * image->actual_size);
+
+    if (array != NULL) {
+        memcpy (resync->shadow, array, sizeof (float) * resync->size);
+    } else if (!an_image_get_real (image, resync->shadow)) {
+        fprintf (stderr, "Cannot recover the real volume\n");
+        destroy_resync (resync);
+        return 0;
+    }
+
+    image->resync = resync;
+    return 1;
+}
+
+void
+an_image_disable_resync (struct an_image *image) {
+    an_resync_destroy (image);
+}
+
+int
+an_image_resync (struct an_image *image,
+                 float           *drift) {
+    if (image->resync == NULL) {
+        fprintf (stderr, "Resynchronization is not enabled\n");
+        return 0;
+    }
+
+    /* A transform in flight is superseded anyway */
+    if (!finish (image, 1) || !start (image) || !finish (image, 1)) {
+        return 0;
+    }
+
+    if (drift != NULL) {
+        *drift = image->resync->drift;
+    }
+
+    return 1;
+}
+
+float
+an_image_last_drift (struct an_image *image) {
+    return (image->resync != NULL) ? image->resync->drift : -1;
+}
+
+int
+an_resync_record (struct an_image                 *image,
+                  const struct CFUpdateBatchPoint *points,
+                  unsigned int                     npoints) {
+    struct an_resync *resync = image->resync;
+
+    if (resync == NULL || resync->replaying) {
+        return 1;
+    }
+
+    for (unsigned int k = 0; k < npoints; k++) {
+        size_t idx = 0;
+        for (int i = 0; i < resync->ndim; i++) {
+            idx += (size_t)points[k].point[i] * resync->strides[i];
+        }
+        resync->shadow[idx] += points[k].c;
+    }
+
+    if (resync->running) {
+        if (resync->nlog + npoints > resync->logCapacity) {
+            resync->logCapacity = 2 * (resync->nlog + npoints);
+            resync->log = realloc (resync->log,
+                                   sizeof (struct CFUpdateBatchPoint) * resync->logCapacity);
+        }
+
+        memcpy (resync->log + resync->nlog, points,
+                sizeof (struct CFUpdateBatchPoint) * npoints);
+        resync->nlog += npoints;
+    }
+
+    resync->counter += npoints;
+
+    if (resync->running) {
+        return finish (image, 0);
+    } else if (resync->interval != 0 && resync->counter >= resync->interval) {
+        return start (image);
+    }
+
+    return 1;
+}
+
+int
+an_resync_reload (struct an_image *image) {
+    struct an_resync *resync = image->resync;
+
+    if (resync == NULL) {
+        return 1;
+    }
+
+    /* The result would be for the old volume */
+    if (resync->running) {
+        pthread_join (resync->thread, NULL);
+        resync->running = 0;
+    }
+    resync->done = 0;
+    resync->nlog = 0;
+    resync->counter = 0;
+
+    return an_image_get_real (image, resync->shadow);
+}
@@ -0,0 +1,426 @@
+/* Timings and counters, see an_enable_stats() */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <vulkan/vulkan.h>
+
+#include "annealing-lowlevel.h"
+#include "internal.h"
+
+/*
+ * Command buffers of images and metrics are registered with their
+ * stage when they are recorded, and own a pair of queries while they
+ * exist. While statistics or the trace are on, an_submit() puts two
+ * small command buffers around them which write the timestamps, so
+ * nothing is recorded into the command buffers themselves and they
+ * need not be recorded again when statistics are switched. Results
+ * are read without waiting: when the command buffer is submitted again
+ * (the previous execution has finished by then) or when the statistics
+ * are requested. The same timestamps go to the trace, see trace.c.
+ */
+#define STATS_MAX_ENTRIES 128
+
+struct stats_entry {
+    VkCommandBuffer commandBuffer;
+    enum an_stat_stage stage;
+    int pending;
+    uint64_t ticket;
+    /* Reset the queries and write the first timestamp, write the second */
+    VkCommandBuffer timestamps[2];
+};
+
+struct an_stats_state {
+    int enabled;
+    struct an_stats stats;
+    double sums[AN_STAGE_COUNT];
+
+    /* NULL for the CPU backend or if the queue has no timestamps */
+    VkQueryPool queryPool;
+    int queryPoolChecked;
+    double timestampPeriod;
+    uint64_t timestampMask;
+    struct stats_entry entries[STATS_MAX_ENTRIES];
+};
+
+double
+an_clock (void) {
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Command buffers are instrumented for statistics or for the trace */
+static int
+recording (struct an_gpu_context *ctx) {
+    return ctx->stats->enabled || ctx->trace != NULL;
+}
+
+static void
+reset (struct an_stats_state *state) {
+    memset (&state->stats, 0, sizeof (struct an_stats));
+    memset (state->sums, 0, sizeof (state->sums));
+}
+
+static void
+add_sample (struct an_stats_state *state, enum an_stat_stage stage, double us) {
+    struct an_stage_stats *s = &state->stats.stages[stage];
+
+    if (s->count == 0 || us < s->min) {
+        s->min = us;
+    }
+    if (s->count == 0 || us > s->max) {
+        s->max = us;
+    }
+
+    s->count++;
+    state->sums[stage] += us;
+    s->mean = state->sums[stage] / s->count;
+}
+
+static VkResult
+create_query_pool (struct an_gpu_context *ctx, struct an_stats_state *state) {
+    uint32_t count;
+    vkGetPhysicalDeviceQueueFamilyProperties (ctx->physDev, &count, NULL);
+    VkQueueFamilyProperties *families = malloc (sizeof (VkQueueFamilyProperties) * count);
+    vkGetPhysicalDeviceQueueFamilyProperties (ctx->physDev, &count, families);
+    uint32_t validBits = families[ctx->queueFamilyID].timestampValidBits;
+    free (families);
+
+    if (validBits == 0) {
+        fprintf (stderr, "The queue does not support timestamps, "
+                 "only host side statistics are collected\n");
+        return VK_SUCCESS;
+    }
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties (ctx->physDev, &properties);
+    state->timestampPeriod = properties.limits.timestampPeriod;
+    state->timestampMask = (validBits >= 64) ? UINT64_MAX : ((uint64_t)1 << validBits) - 1;
+
+    VkQueryPoolCreateInfo poolInfo;
+    ZERO(poolInfo);
+    poolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    poolInfo.queryCount = 2 * STATS_MAX_ENTRIES;
+
+    return vkCreateQueryPool (ctx->device, &poolInfo, NULL, &state->queryPool);
+}
+
+static struct stats_entry*
+find_entry (struct an_stats_state *state, VkCommandBuffer commandBuffer) {
+    for (int i = 0; i < STATS_MAX_ENTRIES; i++) {
+        if (state->entries[i].commandBuffer == commandBuffer) {
+            return &state->entries[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Read the timestamps of the last execution if they are available */
+static void
+harvest (struct an_gpu_context *ctx, struct stats_entry *entry) {
+    struct an_stats_state *state = ctx->stats;
+    uint32_t slot = 2 * (entry - state->entries);
+    /* Pairs of a value and its availability */
+    uint64_t data[4];
+
+    if (!entry->pending) {
+        return;
+    }
+
+    entry->pending = 0;
+    if (!recording (ctx)) {
+        return;
+    }
+
+    VkResult result = vkGetQueryPoolResults (ctx->device, state->queryPool, slot, 2,
+                                             sizeof (data), data, 2 * sizeof (uint64_t),
+                                             VK_QUERY_RESULT_64_BIT |
+                                             VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+    if ((result != VK_SUCCESS && result != VK_NOT_READY) ||
+        data[1] == 0 || data[3] == 0) {
+        return;
+    }
+
+    if (state->enabled) {
+        add_sample (state, entry->stage, an_stats_ticks_ns (ctx, data[0], data[2]) * 1e-3);
+    }
+
+    if (ctx->trace != NULL) {
+        an_trace_device (ctx, entry->stage, data[0], data[2]);
+    }
+}
+
+/* The state is created on demand, without the query pool */
+static struct an_stats_state*
+get_state (struct an_gpu_context *ctx) {
+    if (ctx->stats == NULL) {
+        ctx->stats = malloc (sizeof (struct an_stats_state));
+        memset (ctx->stats, 0, sizeof (struct an_stats_state));
+    }
+
+    return ctx->stats;
+}
+
+int
+an_stats_prepare (struct an_gpu_context *ctx) {
+    struct an_stats_state *state = get_state (ctx);
+
+    if (ctx->backend != AN_BACKEND_CPU && !state->queryPoolChecked) {
+        VkResult result = create_query_pool (ctx, state);
+        if (result != VK_SUCCESS) {
+            fprintf (stderr, "Cannot create query pool, code = %i\n", result);
+            return 0;
+        }
+
+        state->queryPoolChecked = 1;
+    }
+
+    return 1;
+}
+
+int
+an_stats_has_timestamps (struct an_gpu_context *ctx) {
+    return ctx->stats != NULL && ctx->stats->queryPool != VK_NULL_HANDLE;
+}
+
+double
+an_stats_ticks_ns (struct an_gpu_context *ctx, uint64_t from, uint64_t to) {
+    struct an_stats_state *state = ctx->stats;
+    return ((to - from) & state->timestampMask) * state->timestampPeriod;
+}
+
+void
+an_stats_collect (struct an_gpu_context *ctx) {
+    struct an_stats_state *state = ctx->stats;
+
+    if (state == NULL || state->queryPool == VK_NULL_HANDLE || !recording (ctx)) {
+        return;
+    }
+
+    for (int i = 0; i < STATS_MAX_ENTRIES; i++) {
+        struct stats_entry *entry = &state->entries[i];
+        if (entry->pending && an_ticket_completed (ctx, entry->ticket)) {
+            harvest (ctx, entry);
+        }
+    }
+}
+
+int
+an_enable_stats (struct an_gpu_context *ctx, int enable) {
+    if (ctx->stats == NULL && !enable) {
+        return 1;
+    }
+
+    if (!an_stats_prepare (ctx)) {
+        return 0;
+    }
+
+    ctx->stats->enabled = enable;
+
+    /* Timestamps of submissions in flight are not needed any more */
+    if (!recording (ctx)) {
+        for (int i = 0; i < STATS_MAX_ENTRIES; i++) {
+            ctx->stats->entries[i].pending = 0;
+        }
+    }
+
+    return 1;
+}
+
+void
+an_get_stats (struct an_gpu_context *ctx, struct an_stats *stats) {
+    struct an_stats_state *state = ctx->stats;
+
+    if (state == NULL) {
+        memset (stats, 0, sizeof (struct an_stats));
+        return;
+    }
+
+    an_stats_collect (ctx);
+    *stats = state->stats;
+}
+
+void
+an_reset_stats (struct an_gpu_context *ctx) {
+    if (ctx->stats != NULL) {
+        reset (ctx->stats);
+    }
+}
+
+void
+an_stats_destroy (struct an_gpu_context *ctx) {
+    struct an_stats_state *state = ctx->stats;
+
+    if (state == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < STATS_MAX_ENTRIES; i++) {
+        if (state->entries[i].timestamps[0] != VK_NULL_HANDLE) {
+            vkFreeCommandBuffers (ctx->device, ctx->cmdPool, 2, state->entries[i].timestamps);
+        }
+    }
+
+    if (state->queryPool != VK_NULL_HANDLE) {
+        vkDestroyQueryPool (ctx->device, state->queryPool, NULL);
+    }
+
+    free (state);
+    ctx->stats = NULL;
+}
+
+void
+an_stats_register (struct an_gpu_context *ctx, VkCommandBuffer commandBuffer,
+                   enum an_stat_stage stage) {
+    if (ctx->backend == AN_BACKEND_CPU) {
+        return;
+    }
+
+    struct an_stats_state *state = get_state (ctx);
+    struct stats_entry *entry = find_entry (state, commandBuffer);
+    if (entry == NULL) {
+        entry = find_entry (state, VK_NULL_HANDLE);
+        if (entry == NULL) {
+            /* Too many command buffers, this one is not timed */
+            return;
+        }
+    }
+
+    entry->commandBuffer = commandBuffer;
+    entry->stage = stage;
+}
+
+/* Command buffers which write timestamps of an entry, created once */
+static int
+ensure_timestamps (struct an_gpu_context *ctx, struct stats_entry *entry) {
+    struct an_stats_state *state = ctx->stats;
+    uint32_t slot = 2 * (entry - state->entries);
+
+    if (entry->timestamps[0] != VK_NULL_HANDLE) {
+        return 1;
+    }
+
+    VkCommandBuffer timestamps[2];
+    VkResult result = an_create_command_buffer (ctx, &timestamps[0]);
+    if (result != VK_SUCCESS) {
+        fprintf (stderr, "Cannot allocate command buffer, code = %i\n", result);
+        return 0;
+    }
+
+    result = an_create_command_buffer (ctx, &timestamps[1]);
+    if (result != VK_SUCCESS) {
+        fprintf (stderr, "Cannot allocate command buffer, code = %i\n", result);
+        vkFreeCommandBuffers (ctx->device, ctx->cmdPool, 1, &timestamps[0]);
+        return 0;
+    }
+
+    entry->timestamps[0] = timestamps[0];
+    entry->timestamps[1] = timestamps[1];
+
+    VkCommandBufferBeginInfo beginInfo;
+    ZERO(beginInfo);
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+
+    vkBeginCommandBuffer (entry->timestamps[0], &beginInfo);
+    vkCmdResetQueryPool (entry->timestamps[0], state->queryPool, slot, 2);
+    vkCmdWriteTimestamp (entry->timestamps[0], VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         state->queryPool, slot);
+    vkEndCommandBuffer (entry->timestamps[0]);
+
+    vkBeginCommandBuffer (entry->timestamps[1], &beginInfo);
+    vkCmdWriteTimestamp (entry->timestamps[1], VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         state->queryPool, slot + 1);
+    vkEndCommandBuffer (entry->timestamps[1]);
+
+    return 1;
+}
+
+void
+an_stats_forget (struct an_gpu_context *ctx, VkCommandBuffer commandBuffer) {
+    struct an_stats_state *state = ctx->stats;
+
+    if (state == NULL || commandBuffer == VK_NULL_HANDLE) {
+        return;
+    }
+
+    struct stats_entry *entry = find_entry (state, commandBuffer);
+    if (entry != NULL) {
+        harvest (ctx, entry);
+        entry->commandBuffer = VK_NULL_HANDLE;
+    }
+}
+
+uint32_t
+an_stats_submitted (struct an_gpu_context *ctx, VkCommandBuffer commandBuffer,
+                    uint64_t ticket, VkCommandBuffer *commandBuffers) {
+    struct an_stats_state *state = ctx->stats;
+    commandBuffers[0] = commandBuffer;
+
+    if (state == NULL || state->queryPool == VK_NULL_HANDLE || !recording (ctx)) {
+        return 1;
+    }
+
+    struct stats_entry *entry = find_entry (state, commandBuffer);
+    if (entry == NULL) {
+        return 1;
+    }
+
+    /* Queries are reset by the new execution */
+    harvest (ctx, entry);
+    if (!ensure_timestamps (ctx, entry)) {
+        return 1;
+    }
+
+    entry->pending = 1;
+    entry->ticket = ticket;
+
+    commandBuffers[0] = entry->timestamps[0];
+    commandBuffers[1] = commandBuffer;
+    commandBuffers[2] = entry->timestamps[1];
+    return 3;
+}
+
+double
+an_stats_start (struct an_gpu_context *ctx) {
+    return (ctx->stats != NULL && ctx->stats->enabled) ? an_clock () : 0;
+}
+
+void
+an_stats_time (struct an_gpu_context *ctx, enum an_stat_stage stage, double start) {
+    struct an_stats_state *state = ctx->stats;
+
+    if (start > 0 && state != NULL && state->enabled) {
+        add_sample (state, stage, (an_clock () - start) * 1e6);
+    }
+}
+
+void
+an_stats_count (struct an_gpu_context *ctx, enum stats_counter counter, uint64_t n) {
+    struct an_stats_state *state = ctx->stats;
+
+    if (state == NULL || !state->enabled) {
+        return;
+    }
+
+    switch (counter) {
+    case STATS_SUBMITS:
+        state->stats.submits += n;
+        break;
+    case STATS_WAITS:
+        state->stats.waits += n;
+        break;
+    case STATS_ALLOCATIONS:
+        state->stats.allocations += n;
+        break;
+    case STATS_BYTES_UPLOADED:
+        state->stats.bytesUploaded += n;
+        break;
+    case STATS_BYTES_DOWNLOADED:
+        state->stats.bytesDownloaded += n;
+        break;
+    }
+}
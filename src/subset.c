@@ -0,0 +1,137 @@
+/* Spectra which store only a subset of frequencies */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <vulkan/vulkan.h>
+
+#include "annealing-lowlevel.h"
+#include "internal.h"
+
+/*
+ * Distance of a frequency of the half-spectrum from zero in cycles per
+ * sample along each axis, squared. Frequencies above the Nyquist
+ * frequency are negative ones.
+ */
+static double
+radius2 (const struct CFUpdateDataConst *data, size_t idx) {
+    double r2 = 0;
+
+    for (int i = 0; i < data->ndim; i++) {
+        unsigned int n = data->logical_dimensions[i];
+        long k = (idx / data->stride[i]) % data->actual_dimensions[i];
+        if (k > n / 2) {
+            k -= n;
+        }
+
+        double f = (double)k / (double)n;
+        r2 += f * f;
+    }
+
+    return r2;
+}
+
+static int
+retained (const struct an_frequency_set *set, size_t idx,
+          const unsigned char *mask, float cutoff) {
+    if (mask != NULL && !mask[idx]) {
+        return 0;
+    }
+
+    return cutoff <= 0 ||
+        radius2 (&set->updateData, idx) <= (double)cutoff * cutoff;
+}
+
+void
+an_destroy_frequency_set (struct an_frequency_set *set) {
+    if (set->indicesMemory != NULL) {
+        an_destroy_buffer (set->ctx, set->indicesMemory);
+    }
+
+    free (set->indices);
+    free (set);
+}
+
+struct an_frequency_set*
+an_create_frequency_set (struct an_gpu_context *ctx,
+                         const unsigned int    *dimensions,
+                         unsigned int           ndim,
+                         const unsigned char   *mask,
+                         float                  cutoff) {
+    if (ndim == 0 || ndim > MAX_DIMENSIONS) {
+        fprintf (stderr, "Wrong number of dimensions\n");
+        return NULL;
+    }
+
+    struct an_frequency_set *set = malloc (sizeof (struct an_frequency_set));
+    memset (set, 0, sizeof (struct an_frequency_set));
+
+    set->ctx = ctx;
+    set->full_size = an_init_update_data (&set->updateData, dimensions, ndim);
+
+    if (set->full_size > UINT32_MAX) {
+        fprintf (stderr, "The spectrum is too large\n");
+        goto cleanup;
+    }
+
+    for (size_t idx = 0; idx < set->full_size; idx++) {
+        set->count += retained (set, idx, mask, cutoff);
+    }
+
+    if (set->count == 0) {
+        fprintf (stderr, "No frequencies are retained\n");
+        goto cleanup;
+    }
+
+    set->indices = malloc (sizeof (unsigned int) * set->count);
+    for (size_t idx = 0, k = 0; idx < set->full_size; idx++) {
+        if (retained (set, idx, mask, cutoff)) {
+            set->indices[k++] = idx;
+        }
+    }
+
+    if (ctx->backend == AN_BACKEND_CPU) {
+        return set;
+    }
+
+    set->indicesMemory =
+        an_create_buffer (ctx, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                          VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                          sizeof (unsigned int) * set->count);
+    if (set->indicesMemory == NULL) {
+        fprintf (stderr, "Cannot create buffer for indices\n");
+        goto cleanup;
+    }
+
+    if (!an_write_data (ctx, set->indicesMemory, set->indices,
+                        sizeof (unsigned int) * set->count)) {
+        fprintf (stderr, "Cannot write indices\n");
+        goto cleanup;
+    }
+
+    return set;
+
+cleanup:
+    an_destroy_frequency_set (set);
+    return NULL;
+}
+
+size_t
+an_frequency_set_size (const struct an_frequency_set *set) {
+    return set->count;
+}
+
+const unsigned int*
+an_frequency_set_indices (const struct an_frequency_set *set) {
+    return set->indices;
+}
+
+void
+an_subset_gather (const struct an_frequency_set *set,
+                  const float                   *full,
+                  float                         *compact) {
+    for (size_t k = 0; k < set->count; k++) {
+        compact[k] = full[set->indices[k]];
+    }
+}
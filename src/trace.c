@@ -0,0 +1,326 @@
+/* Traces of host calls and device stages, see an_start_trace() */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <vulkan/vulkan.h>
+
+#include "annealing-lowlevel.h"
+#include "internal.h"
+
+/*
+ * Host spans are measured with CLOCK_MONOTONIC. Device timestamps are
+ * put on the same time line with a pair of a device timestamp and a
+ * host time taken at the same moment: with VK_EXT_calibrated_timestamps
+ * if the device can sample CLOCK_MONOTONIC, otherwise by writing a
+ * timestamp on the idle queue and taking the middle of the host
+ * interval around the submission. Times are in microseconds since the
+ * start of the trace.
+ */
+#define TRACE_MIN_EVENTS 4096
+
+struct trace_event {
+    const char *name;
+    int device;
+    double start;
+    double duration;
+};
+
+struct an_trace {
+    double origin;
+
+    /* Calibration */
+    const char *calibration;
+    double hostBase;
+    uint64_t deviceBase;
+    double deviation;
+
+    struct trace_event *events;
+    size_t count;
+    size_t capacity;
+};
+
+static const char *stageNames[AN_STAGE_COUNT] = {
+    "update", "metric", "move", "tracked update", "submit", "wait"
+};
+
+static void
+add_event (struct an_trace *trace, const char *name, int device,
+           double start, double duration) {
+    if (trace->count == trace->capacity) {
+        trace->capacity = (trace->capacity == 0) ? TRACE_MIN_EVENTS : 2 * trace->capacity;
+        trace->events = realloc (trace->events, sizeof (struct trace_event) * trace->capacity);
+    }
+
+    struct trace_event *event = &trace->events[trace->count++];
+    event->name = name;
+    event->device = device;
+    event->start = start;
+    event->duration = duration;
+}
+
+static int
+calibrate_extension (struct an_gpu_context *ctx, struct an_trace *trace) {
+    PFN_vkGetPhysicalDeviceCalibrateableTimeDomainsEXT getDomains =
+        (PFN_vkGetPhysicalDeviceCalibrateableTimeDomainsEXT)
+        vkGetInstanceProcAddr (ctx->instance,
+                               "vkGetPhysicalDeviceCalibrateableTimeDomainsEXT");
+    PFN_vkGetCalibratedTimestampsEXT getTimestamps =
+        (PFN_vkGetCalibratedTimestampsEXT)
+        vkGetDeviceProcAddr (ctx->device, "vkGetCalibratedTimestampsEXT");
+
+    if (getDomains == NULL || getTimestamps == NULL) {
+        return 0;
+    }
+
+    uint32_t count;
+    getDomains (ctx->physDev, &count, NULL);
+    VkTimeDomainEXT *domains = malloc (sizeof (VkTimeDomainEXT) * count);
+    getDomains (ctx->physDev, &count, domains);
+
+    int monotonic = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        monotonic |= domains[i] == VK_TIME_DOMAIN_CLOCK_MONOTONIC_EXT;
+    }
+    free (domains);
+
+    if (!monotonic) {
+        return 0;
+    }
+
+    VkCalibratedTimestampInfoEXT infos[2];
+    ZERO(infos);
+    infos[0].sType = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT;
+    infos[0].timeDomain = VK_TIME_DOMAIN_DEVICE_EXT;
+    infos[1].sType = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT;
+    infos[1].timeDomain = VK_TIME_DOMAIN_CLOCK_MONOTONIC_EXT;
+
+    uint64_t timestamps[2];
+    uint64_t deviation;
+    if (getTimestamps (ctx->device, 2, infos, timestamps, &deviation) != VK_SUCCESS) {
+        return 0;
+    }
+
+    trace->deviceBase = timestamps[0];
+    trace->hostBase = timestamps[1] * 1e-9;
+    trace->deviation = deviation * 1e-3;
+    trace->calibration = "VK_EXT_calibrated_timestamps";
+    return 1;
+}
+
+static int
+calibrate_query (struct an_gpu_context *ctx, struct an_trace *trace) {
+    VkResult result;
+    VkQueryPool queryPool = VK_NULL_HANDLE;
+    VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+    VkFence fence = VK_NULL_HANDLE;
+    int ok = 0;
+
+    VkQueryPoolCreateInfo poolInfo;
+    ZERO(poolInfo);
+    poolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    poolInfo.queryCount = 1;
+
+    result = vkCreateQueryPool (ctx->device, &poolInfo, NULL, &queryPool);
+    if (result != VK_SUCCESS) {
+        fprintf (stderr, "Cannot create query pool, code = %i\n", result);
+        goto cleanup;
+    }
+
+    result = an_create_command_buffer (ctx, &commandBuffer);
+    if (result != VK_SUCCESS) {
+        fprintf (stderr, "Cannot allocate command buffer, code = %i\n", result);
+        goto cleanup;
+    }
+
+    VkFenceCreateInfo fenceInfo;
+    ZERO(fenceInfo);
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    result = vkCreateFence (ctx->device, &fenceInfo, NULL, &fence);
+    if (result != VK_SUCCESS) {
+        fprintf (stderr, "Cannot create a fence, code = %i\n", result);
+        goto cleanup;
+    }
+
+    VkCommandBufferBeginInfo beginInfo;
+    ZERO(beginInfo);
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+    vkBeginCommandBuffer (commandBuffer, &beginInfo);
+    vkCmdResetQueryPool (commandBuffer, queryPool, 0, 1);
+    vkCmdWriteTimestamp (commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, queryPool, 0);
+    vkEndCommandBuffer (commandBuffer);
+
+    VkSubmitInfo submitInfo;
+    ZERO(submitInfo);
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &commandBuffer;
+
+    /* The queue is idle, the timestamp is written right after the submission */
+    double before = an_clock ();
+    vkQueueSubmit (ctx->queue, 1, &submitInfo, fence);
+    vkWaitForFences (ctx->device, 1, &fence, VK_TRUE, -1);
+    double after = an_clock ();
+
+    result = vkGetQueryPoolResults (ctx->device, queryPool, 0, 1,
+                                    sizeof (uint64_t), &trace->deviceBase,
+                                    sizeof (uint64_t),
+                                    VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+    if (result != VK_SUCCESS) {
+        fprintf (stderr, "Cannot read the timestamp, code = %i\n", result);
+        goto cleanup;
+    }
+
+    trace->hostBase = (before + after) / 2;
+    trace->deviation = (after - before) / 2 * 1e6;
+    trace->calibration = "timestamp query";
+    ok = 1;
+
+cleanup:
+    if (fence != VK_NULL_HANDLE) {
+        vkDestroyFence (ctx->device, fence, NULL);
+    }
+
+    if (commandBuffer != VK_NULL_HANDLE) {
+        vkFreeCommandBuffers (ctx->device, ctx->cmdPool, 1, &commandBuffer);
+    }
+
+    if (queryPool != VK_NULL_HANDLE) {
+        vkDestroyQueryPool (ctx->device, queryPool, NULL);
+    }
+
+    return ok;
+}
+
+static int
+write_trace (const struct an_trace *trace, const char *filename) {
+    FILE *out = fopen (filename, "w");
+    if (out == NULL) {
+        fprintf (stderr, "Cannot open %s\n", filename);
+        return 0;
+    }
+
+    fprintf (out, "{\n\"displayTimeUnit\": \"ms\",\n");
+    fprintf (out, "\"otherData\": {\"calibration\": \"%s\", \"deviation_us\": %.3f},\n",
+             (trace->calibration != NULL) ? trace->calibration : "none",
+             trace->deviation);
+    fprintf (out, "\"traceEvents\": [\n");
+    fprintf (out, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, "
+             "\"args\": {\"name\": \"annealing-lowlevel\"}},\n");
+    fprintf (out, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 1, "
+             "\"args\": {\"name\": \"host\"}},\n");
+    fprintf (out, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 2, "
+             "\"args\": {\"name\": \"device queue\"}}");
+
+    for (size_t i = 0; i < trace->count; i++) {
+        const struct trace_event *event = &trace->events[i];
+        fprintf (out, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", "
+                 "\"pid\": 1, \"tid\": %i, \"ts\": %.3f, \"dur\": %.3f}",
+                 event->name, event->device ? "device" : "host",
+                 event->device ? 2 : 1, event->start, event->duration);
+    }
+
+    fprintf (out, "\n]\n}\n");
+
+    if (fclose (out) != 0) {
+        fprintf (stderr, "Cannot write %s\n", filename);
+        return 0;
+    }
+
+    return 1;
+}
+
+void
+an_trace_destroy (struct an_gpu_context *ctx) {
+    struct an_trace *trace = ctx->trace;
+
+    if (trace != NULL) {
+        free (trace->events);
+        free (trace);
+        ctx->trace = NULL;
+    }
+}
+
+int
+an_start_trace (struct an_gpu_context *ctx) {
+    if (ctx->trace != NULL) {
+        fprintf (stderr, "The trace is already started\n");
+        return 0;
+    }
+
+    if (!an_stats_prepare (ctx)) {
+        return 0;
+    }
+
+    struct an_trace *trace = malloc (sizeof (struct an_trace));
+    memset (trace, 0, sizeof (struct an_trace));
+
+    if (ctx->backend != AN_BACKEND_CPU) {
+        /* Timestamps of earlier submissions are not a part of the trace */
+        vkQueueWaitIdle (ctx->queue);
+        an_stats_collect (ctx);
+
+        if (!an_stats_has_timestamps (ctx)) {
+            fprintf (stderr, "No device timestamps, only host calls are traced\n");
+        } else if (!(ctx->hasCalibratedTimestamps && calibrate_extension (ctx, trace)) &&
+                   !calibrate_query (ctx, trace)) {
+            fprintf (stderr, "Cannot calibrate timestamps\n");
+            free (trace);
+            return 0;
+        }
+    }
+
+    trace->origin = an_clock ();
+    ctx->trace = trace;
+    return 1;
+}
+
+int
+an_stop_trace (struct an_gpu_context *ctx, const char *filename) {
+    if (ctx->trace == NULL) {
+        fprintf (stderr, "The trace is not started\n");
+        return 0;
+    }
+
+    if (ctx->backend != AN_BACKEND_CPU) {
+        vkQueueWaitIdle (ctx->queue);
+        an_stats_collect (ctx);
+    }
+
+    int ok = filename == NULL || write_trace (ctx->trace, filename);
+    an_trace_destroy (ctx);
+    return ok;
+}
+
+double
+an_trace_begin (struct an_gpu_context *ctx) {
+    return (ctx->trace != NULL) ? an_clock () : 0;
+}
+
+void
+an_trace_end (struct an_gpu_context *ctx, const char *name, double start) {
+    struct an_trace *trace = ctx->trace;
+
+    if (start > 0 && trace != NULL) {
+        double end = an_clock ();
+        add_event (trace, name, 0, (start - trace->origin) * 1e6, (end - start) * 1e6);
+    }
+}
+
+void
+an_trace_device (struct an_gpu_context *ctx, enum an_stat_stage stage,
+                 uint64_t begin, uint64_t end) {
+    struct an_trace *trace = ctx->trace;
+
+    if (trace->calibration == NULL) {
+        return;
+    }
+
+    double start = (trace->hostBase - trace->origin) * 1e6 +
+        an_stats_ticks_ns (ctx, trace->deviceBase, begin) * 1e-3;
+    add_event (trace, stageNames[stage], 1, start,
+               an_stats_ticks_ns (ctx, begin, end) * 1e-3);
+}
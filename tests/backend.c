@@ -0,0 +1,251 @@
+/*
+ * Spectra of images updated with an_image_update_fft and
+ * an_image_update_fft_batch compared with an_rfft of the updated
+ * volume, and an_distance with a direct sum of squared differences.
+ * Arguments: vulkan, or cpu and optionally the kernels to use (scalar,
+ * avx2 or avx512, see AN_CPU_KERNELS).
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "annealing-lowlevel.h"
+
+/* Exit status of a skipped test, see tests/CMakeLists.txt */
+#define SKIP 77
+#define STEPS 40
+#define MAX_POINTS 5
+/* Relative to the maximal magnitude of the spectrum */
+#define TOLERANCE 1e-4
+/* Relative to the distance */
+#define DISTANCE_TOLERANCE 1e-3
+
+struct backend_case {
+    unsigned int ndim;
+    unsigned int dimensions[MAX_DIMENSIONS];
+};
+
+/*
+ * Rows of the half-spectrum have last / 2 + 1 elements. Most of them
+ * are not a multiple of the vector width (4 for AVX2, 8 for AVX-512).
+ */
+static const struct backend_case cases[] = {
+    { 1, { 30 } },
+    { 1, { 27 } },
+    { 2, { 5, 13 } },
+    { 2, { 6, 20 } },
+    { 2, { 7, 2 } },
+    { 3, { 4, 3, 9 } },
+    { 3, { 3, 5, 6 } },
+    { 3, { 2, 4, 14 } }
+};
+
+static size_t
+volume (const struct backend_case *c) {
+    size_t size = 1;
+    for (unsigned int i = 0; i < c->ndim; i++) {
+        size *= c->dimensions[i];
+    }
+
+    return size;
+}
+
+static size_t
+spectrum_size (const struct backend_case *c) {
+    unsigned int last = c->dimensions[c->ndim - 1];
+    return volume (c) / last * (last / 2 + 1);
+}
+
+static void
+random_array (float *array, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        array[i] = (rand () % 2 == 0) ? 1 : 0;
+    }
+}
+
+/* Random points, applied to the volume too */
+static unsigned int
+random_points (const struct backend_case *c, float *array,
+               unsigned int *coords, float *deltas) {
+    unsigned int npoints = 1 + rand () % MAX_POINTS;
+
+    for (unsigned int k = 0; k < npoints; k++) {
+        size_t idx = 0;
+        for (unsigned int i = 0; i < c->ndim; i++) {
+            coords[k * c->ndim + i] = rand () % c->dimensions[i];
+            idx = idx * c->dimensions[i] + coords[k * c->ndim + i];
+        }
+
+        deltas[k] = (rand () % 2 == 0) ? 1 : -1;
+        array[idx] += deltas[k];
+    }
+
+    return npoints;
+}
+
+/* Maximal difference relative to the maximal magnitude of the reference */
+static double
+difference (const float *real, const float *imag,
+            const float *refReal, const float *refImag, size_t n) {
+    double diff = 0, scale = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        diff = fmax (diff, hypot ((double)real[i] - refReal[i], (double)imag[i] - refImag[i]));
+        scale = fmax (scale, hypot (refReal[i], refImag[i]));
+    }
+
+    return (scale > 0) ? diff / scale : diff;
+}
+
+static double
+direct_distance (const float *cf, const float *real, const float *imag, size_t n) {
+    double sum = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        double diff = cf[i] - ((double)real[i] * real[i] + (double)imag[i] * imag[i]);
+        sum += diff * diff;
+    }
+
+    return sum;
+}
+
+static int
+run_case (struct an_gpu_context *ctx, const struct backend_case *c) {
+    size_t size = volume (c);
+    size_t ssize = spectrum_size (c);
+    unsigned int coords[MAX_POINTS * MAX_DIMENSIONS];
+    float deltas[MAX_POINTS];
+    double spectrum = 0, distance = 0;
+    int ok = 0;
+
+    float *array   = malloc (sizeof (float) * size);
+    float *cf      = malloc (sizeof (float) * ssize);
+    float *real    = malloc (sizeof (float) * ssize);
+    float *imag    = malloc (sizeof (float) * ssize);
+    float *refReal = malloc (sizeof (float) * ssize);
+    float *refImag = malloc (sizeof (float) * ssize);
+    struct an_corrfn *target = NULL;
+    struct an_image *image = NULL;
+    struct an_metric *metric = NULL;
+
+    random_array (array, size);
+    an_rfft (array, refReal, refImag, c->dimensions, c->ndim);
+    for (size_t i = 0; i < ssize; i++) {
+        cf[i] = refReal[i] * refReal[i] + refImag[i] * refImag[i];
+    }
+
+    random_array (array, size);
+    target = an_create_corrfn (ctx, cf, c->dimensions, c->ndim);
+    image = an_create_image_from_real (ctx, array, c->dimensions, c->ndim);
+    if (target == NULL || image == NULL ||
+        (metric = an_create_metric (ctx, target, image)) == NULL) {
+        fprintf (stderr, "Cannot create objects\n");
+        goto cleanup;
+    }
+
+    for (int step = 0; step < STEPS; step++) {
+        unsigned int npoints = random_points (c, array, coords, deltas);
+        float measured;
+
+        /* Single points on even steps, batches on odd */
+        int updated = 1;
+        if (step % 2 == 0) {
+            for (unsigned int k = 0; k < npoints && updated; k++) {
+                updated = an_image_update_fft (image, coords + k * c->ndim,
+                                               c->ndim, deltas[k]);
+            }
+        } else {
+            updated = an_image_update_fft_batch (image, coords, deltas, npoints, c->ndim);
+        }
+
+        if (!updated || !an_image_get (image, real, imag) ||
+            !an_distance (metric, &measured)) {
+            fprintf (stderr, "Cannot update the image\n");
+            goto cleanup;
+        }
+
+        an_rfft (array, refReal, refImag, c->dimensions, c->ndim);
+        double expected = direct_distance (cf, refReal, refImag, ssize);
+
+        spectrum = fmax (spectrum, difference (real, imag, refReal, refImag, ssize));
+        distance = fmax (distance, fabs (measured - expected) / expected);
+    }
+
+    printf ("%u:", c->ndim);
+    for (unsigned int i = 0; i < c->ndim; i++) {
+        printf ("%s%u", (i > 0) ? "x" : " ", c->dimensions[i]);
+    }
+    printf ("\tspectrum %.2e, distance %.2e\n", spectrum, distance);
+    ok = spectrum < TOLERANCE && distance < DISTANCE_TOLERANCE;
+
+cleanup:
+    if (metric != NULL) {
+        an_destroy_metric (metric);
+    }
+
+    if (image != NULL) {
+        an_destroy_image (image);
+    }
+
+    if (target != NULL) {
+        an_destroy_corrfn (target);
+    }
+
+    free (array);
+    free (cf);
+    free (real);
+    free (imag);
+    free (refReal);
+    free (refImag);
+    return ok;
+}
+
+/* Select the kernels of the CPU backend, 0 if the processor lacks them */
+static int
+select_kernels (const char *kernels) {
+    if (strcmp (kernels, "scalar") != 0) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init ();
+        int supported = (strcmp (kernels, "avx512") == 0) ?
+            __builtin_cpu_supports ("avx512f") :
+            __builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("fma");
+        if (!supported) {
+            return 0;
+        }
+#else
+        return 0;
+#endif
+    }
+
+    return setenv ("AN_CPU_KERNELS", kernels, 1) == 0;
+}
+
+int main (int argc, char *argv[]) {
+    enum an_backend backend = AN_BACKEND_CPU;
+
+    if (argc > 1 && strcmp (argv[1], "vulkan") == 0) {
+        backend = AN_BACKEND_VULKAN;
+    } else if (argc > 2 && !select_kernels (argv[2])) {
+        fprintf (stderr, "No %s kernels on this processor, skipping\n", argv[2]);
+        return SKIP;
+    }
+
+    struct an_gpu_context *ctx = an_create_context_with_backend (0, backend, 0);
+    if (ctx == NULL) {
+        fprintf (stderr, "Cannot create a context, skipping\n");
+        return SKIP;
+    }
+
+    int failed = 0;
+    srand (1);
+    for (size_t i = 0; i < sizeof (cases) / sizeof (cases[0]); i++) {
+        if (!run_case (ctx, &cases[i])) {
+            fprintf (stderr, "FAILED\n");
+            failed++;
+        }
+    }
+
+    an_destroy_context (ctx);
+    return (failed > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,138 @@
+/*
+ * Spectra calculated on the device (an_create_image_from_real and
+ * an_image_get_real) compared with an_rfft and an_irfft
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "annealing-lowlevel.h"
+
+/* Exit status of a skipped test, see tests/CMakeLists.txt */
+#define SKIP 77
+#define TOLERANCE 1e-4
+
+struct fft_case {
+    unsigned int ndim;
+    unsigned int dimensions[MAX_DIMENSIONS];
+};
+
+static const struct fft_case cases[] = {
+    /* Mixed radices: 120 = 2·3·5·4 */
+    { 1, { 120 } },
+    { 1, { 4096 } },
+    { 2, { 30, 120 } },
+    { 2, { 64, 48 } },
+    { 3, { 12, 20, 30 } },
+    { 3, { 16, 16, 16 } },
+    /* Fall back to FFTW: an odd last axis, a factor of 7 */
+    { 1, { 45 } },
+    { 1, { 98 } },
+    { 2, { 14, 40 } },
+    { 3, { 9, 10, 21 } }
+};
+
+static size_t
+volume (const struct fft_case *c) {
+    size_t size = 1;
+    for (unsigned int i = 0; i < c->ndim; i++) {
+        size *= c->dimensions[i];
+    }
+
+    return size;
+}
+
+static size_t
+spectrum_size (const struct fft_case *c) {
+    unsigned int last = c->dimensions[c->ndim - 1];
+    return volume (c) / last * (last / 2 + 1);
+}
+
+/* Maximal difference relative to the maximal magnitude of the reference */
+static double
+difference (const float *a, const float *b, const float *ref, size_t n) {
+    double diff = 0, scale = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        diff = fmax (diff, fabs ((double)a[i] - b[i]));
+        scale = fmax (scale, fabs (ref[i]));
+    }
+
+    return (scale > 0) ? diff / scale : diff;
+}
+
+static int
+run_case (struct an_gpu_context *ctx, const struct fft_case *c) {
+    size_t size = volume (c);
+    size_t ssize = spectrum_size (c);
+    int ok = 0;
+
+    float *array  = malloc (sizeof (float) * size);
+    float *result = malloc (sizeof (float) * size);
+    float *real   = malloc (sizeof (float) * ssize);
+    float *imag   = malloc (sizeof (float) * ssize);
+    float *gpuReal = malloc (sizeof (float) * ssize);
+    float *gpuImag = malloc (sizeof (float) * ssize);
+    struct an_image *image = NULL;
+
+    for (size_t i = 0; i < size; i++) {
+        array[i] = (float)rand () / RAND_MAX;
+    }
+
+    if (!an_rfft (array, real, imag, c->dimensions, c->ndim)) {
+        fprintf (stderr, "an_rfft failed\n");
+        goto cleanup;
+    }
+
+    image = an_create_image_from_real (ctx, array, c->dimensions, c->ndim);
+    if (image == NULL ||
+        !an_image_get (image, gpuReal, gpuImag) ||
+        !an_image_get_real (image, result)) {
+        fprintf (stderr, "Cannot transform on the device\n");
+        goto cleanup;
+    }
+
+    double forward = fmax (difference (gpuReal, real, real, ssize),
+                           difference (gpuImag, imag, real, ssize));
+    double inverse = difference (result, array, array, size);
+
+    printf ("%u:", c->ndim);
+    for (unsigned int i = 0; i < c->ndim; i++) {
+        printf ("%s%u", (i > 0) ? "x" : " ", c->dimensions[i]);
+    }
+    printf ("\tforward %.2e, inverse %.2e\n", forward, inverse);
+    ok = forward < TOLERANCE && inverse < TOLERANCE;
+
+cleanup:
+    if (image != NULL) {
+        an_destroy_image (image);
+    }
+
+    free (array);
+    free (result);
+    free (real);
+    free (imag);
+    free (gpuReal);
+    free (gpuImag);
+    return ok;
+}
+
+int main () {
+    struct an_gpu_context *ctx = an_create_context (0, 0);
+    if (ctx == NULL) {
+        fprintf (stderr, "No Vulkan device, skipping\n");
+        return SKIP;
+    }
+
+    int failed = 0;
+    srand (1);
+    for (size_t i = 0; i < sizeof (cases) / sizeof (cases[0]); i++) {
+        if (!run_case (ctx, &cases[i])) {
+            fprintf (stderr, "FAILED\n");
+            failed++;
+        }
+    }
+
+    an_destroy_context (ctx);
+    return (failed > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
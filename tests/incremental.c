@@ -0,0 +1,336 @@
+/*
+ * Functions maintained incrementally on the host (an_directional_s2 and
+ * an_lineal) compared after random updates and moves with those of a
+ * new object created from the updated image, and L(r) with a direct count
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "annealing-lowlevel.h"
+
+#define STEPS 200
+#define MAX_POINTS 4
+/* Binary images keep the sums of S2 exact */
+#define TOLERANCE 1e-6
+
+struct incremental_case {
+    unsigned int ndim;
+    unsigned int dimensions[MAX_DIMENSIONS];
+    /* Fraction of the phase, close to 1 gives lines entirely in the phase */
+    double fraction;
+    /* Up to the smallest dimension, S2 goes to LENGTH - 1 */
+    unsigned int length;
+};
+
+static const struct incremental_case cases[] = {
+    { 1, { 64 }, 0.5, 16 },
+    { 1, { 7 }, 0.9, 7 },
+    { 2, { 16, 5 }, 0.5, 5 },
+    { 2, { 12, 3 }, 0.9, 3 },
+    { 3, { 6, 4, 7 }, 0.5, 4 },
+    { 3, { 5, 3, 4 }, 0.85, 3 }
+};
+
+static size_t
+volume (const struct incremental_case *c) {
+    size_t size = 1;
+    for (unsigned int i = 0; i < c->ndim; i++) {
+        size *= c->dimensions[i];
+    }
+
+    return size;
+}
+
+/* NPOINTS distinct random points: coordinates and offsets */
+static unsigned int
+random_points (const struct incremental_case *c, unsigned int *coords, size_t *pos) {
+    unsigned int npoints = 1 + rand () % MAX_POINTS;
+
+    for (unsigned int k = 0; k < npoints; k++) {
+        unsigned int *coord = coords + k * c->ndim;
+    again:
+        pos[k] = 0;
+        for (unsigned int i = 0; i < c->ndim; i++) {
+            coord[i] = rand () % c->dimensions[i];
+            pos[k] = pos[k] * c->dimensions[i] + coord[i];
+        }
+
+        for (unsigned int j = 0; j < k; j++) {
+            if (pos[j] == pos[k]) {
+                goto again;
+            }
+        }
+    }
+
+    return npoints;
+}
+
+static double
+difference (const float *a, const float *b, size_t n) {
+    double diff = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        diff = fmax (diff, fabs ((double)a[i] - b[i]));
+    }
+
+    return diff;
+}
+
+/* L(r) by checking r consecutive pixels at every position */
+static void
+direct_lineal (const struct incremental_case *c, const unsigned char *phases,
+               float *values) {
+    size_t size = volume (c);
+
+    for (unsigned int a = 0; a < c->ndim; a++) {
+        size_t stride = 1;
+        for (unsigned int i = a + 1; i < c->ndim; i++) {
+            stride *= c->dimensions[i];
+        }
+
+        unsigned int n = c->dimensions[a];
+        for (unsigned int r = 1; r <= c->length; r++) {
+            size_t count = 0;
+
+            for (size_t pos = 0; pos < size; pos++) {
+                unsigned int coord = (pos / stride) % n;
+                size_t start = pos - coord * stride;
+                unsigned int k = 0;
+                while (k < r && phases[start + (coord + k) % n * stride]) {
+                    k++;
+                }
+                count += k == r;
+            }
+
+            values[a * c->length + r - 1] = (double)count / size;
+        }
+    }
+}
+
+static void
+print_case (const char *name, const struct incremental_case *c, double diff) {
+    printf ("%s %u:", name, c->ndim);
+    for (unsigned int i = 0; i < c->ndim; i++) {
+        printf ("%s%u", (i > 0) ? "x" : " ", c->dimensions[i]);
+    }
+    printf ("\tfraction %.2f, difference %.2e\n", c->fraction, diff);
+}
+
+static int
+run_s2 (const struct incremental_case *c) {
+    size_t size = volume (c);
+    unsigned int length = c->length - 1;
+    size_t nbins = (size_t)c->ndim * (length + 1);
+    unsigned int coords[MAX_POINTS * MAX_DIMENSIONS];
+    size_t pos[MAX_POINTS];
+    float deltas[MAX_POINTS];
+    double diff = 0;
+    int ok = 0;
+
+    float *array = malloc (sizeof (float) * size);
+    float *values = malloc (sizeof (float) * nbins);
+    float *expected = malloc (sizeof (float) * nbins);
+    float *target = malloc (sizeof (float) * nbins);
+    struct an_directional_s2 *s2 = NULL, *fresh = NULL;
+
+    for (size_t i = 0; i < size; i++) {
+        array[i] = (double)rand () / RAND_MAX < c->fraction;
+    }
+    for (size_t i = 0; i < nbins; i++) {
+        target[i] = (float)rand () / RAND_MAX;
+    }
+
+    s2 = an_create_directional_s2 (array, c->dimensions, c->ndim, length, target);
+    if (s2 == NULL) {
+        goto cleanup;
+    }
+
+    for (int step = 0; step < STEPS; step++) {
+        unsigned int npoints = random_points (c, coords, pos);
+        float distance;
+
+        for (unsigned int k = 0; k < npoints; k++) {
+            deltas[k] = 1 - 2 * array[pos[k]];
+        }
+
+        /* Updates, committed moves and rejected moves */
+        switch (step % 3) {
+        case 0:
+            ok = an_directional_s2_update (s2, coords, deltas, npoints, c->ndim);
+            break;
+        case 1:
+            ok = an_directional_s2_evaluate_move (s2, coords, deltas, npoints,
+                                                  c->ndim, &distance) &&
+                an_directional_s2_commit_move (s2);
+            break;
+        case 2:
+            ok = an_directional_s2_evaluate_move (s2, coords, deltas, npoints,
+                                                  c->ndim, &distance);
+            npoints = 0;
+            break;
+        }
+
+        if (!ok) {
+            goto cleanup;
+        }
+
+        for (unsigned int k = 0; k < npoints; k++) {
+            array[pos[k]] += deltas[k];
+        }
+
+        fresh = an_create_directional_s2 (array, c->dimensions, c->ndim, length, target);
+        an_directional_s2_get (s2, values);
+        an_directional_s2_get (fresh, expected);
+        diff = fmax (diff, difference (values, expected, nbins));
+
+        float d1, d2;
+        an_directional_s2_distance (s2, &d1);
+        an_directional_s2_distance (fresh, &d2);
+        diff = fmax (diff, fabs ((double)d1 - d2));
+        an_destroy_directional_s2 (fresh);
+        fresh = NULL;
+    }
+
+    print_case ("directional S2", c, diff);
+    ok = diff < TOLERANCE;
+
+cleanup:
+    if (s2 != NULL) {
+        an_destroy_directional_s2 (s2);
+    }
+
+    free (array);
+    free (values);
+    free (expected);
+    free (target);
+    return ok;
+}
+
+static int
+run_lineal (const struct incremental_case *c) {
+    size_t size = volume (c);
+    size_t nvalues = (size_t)c->ndim * c->length;
+    unsigned int coords[MAX_POINTS * MAX_DIMENSIONS];
+    size_t pos[MAX_POINTS];
+    double diff = 0;
+    int ok = 0;
+
+    unsigned char *phases = malloc (size);
+    float *lineal = malloc (sizeof (float) * nvalues);
+    float *chords = malloc (sizeof (float) * nvalues);
+    float *expectedLineal = malloc (sizeof (float) * nvalues);
+    float *expectedChords = malloc (sizeof (float) * nvalues);
+    struct an_lineal *l = NULL, *fresh = NULL;
+
+    for (size_t i = 0; i < size; i++) {
+        phases[i] = (double)rand () / RAND_MAX < c->fraction;
+    }
+
+    l = an_create_lineal (phases, c->dimensions, c->ndim, c->length, c->length);
+    if (l == NULL) {
+        goto cleanup;
+    }
+
+    for (int step = 0; step < STEPS; step++) {
+        unsigned int npoints = random_points (c, coords, pos);
+        float distance;
+
+        switch (step % 3) {
+        case 0:
+            ok = an_lineal_flip (l, coords, npoints, c->ndim);
+            break;
+        case 1:
+            ok = an_lineal_evaluate_move (l, coords, npoints, c->ndim, &distance) &&
+                an_lineal_commit_move (l);
+            break;
+        case 2:
+            ok = an_lineal_evaluate_move (l, coords, npoints, c->ndim, &distance);
+            npoints = 0;
+            break;
+        }
+
+        if (!ok) {
+            goto cleanup;
+        }
+
+        for (unsigned int k = 0; k < npoints; k++) {
+            phases[pos[k]] = !phases[pos[k]];
+        }
+
+        fresh = an_create_lineal (phases, c->dimensions, c->ndim, c->length, c->length);
+        an_lineal_get (l, lineal, chords);
+        an_lineal_get (fresh, expectedLineal, expectedChords);
+        diff = fmax (diff, difference (lineal, expectedLineal, nvalues));
+        diff = fmax (diff, difference (chords, expectedChords, nvalues));
+
+        direct_lineal (c, phases, expectedLineal);
+        diff = fmax (diff, difference (lineal, expectedLineal, nvalues));
+        an_destroy_lineal (fresh);
+        fresh = NULL;
+    }
+
+    print_case ("lineal", c, diff);
+    ok = diff < TOLERANCE;
+
+cleanup:
+    if (l != NULL) {
+        an_destroy_lineal (l);
+    }
+
+    free (phases);
+    free (lineal);
+    free (chords);
+    free (expectedLineal);
+    free (expectedChords);
+    return ok;
+}
+
+/* Segments longer than a line are rejected */
+static int
+run_limits (void) {
+    unsigned int dimensions[2] = { 8, 4 };
+    unsigned char phases[32];
+    float array[32];
+
+    memset (phases, 1, sizeof (phases));
+    memset (array, 0, sizeof (array));
+
+    struct an_lineal *l = an_create_lineal (phases, dimensions, 2, 5, 4);
+    struct an_lineal *m = an_create_lineal (phases, dimensions, 2, 4, 5);
+    struct an_directional_s2 *s2 = an_create_directional_s2 (array, dimensions, 2, 4, NULL);
+    int ok = l == NULL && m == NULL && s2 == NULL;
+
+    if (l != NULL) {
+        an_destroy_lineal (l);
+    }
+    if (m != NULL) {
+        an_destroy_lineal (m);
+    }
+    if (s2 != NULL) {
+        an_destroy_directional_s2 (s2);
+    }
+
+    printf ("limits\t%s\n", ok ? "rejected" : "accepted");
+    return ok;
+}
+
+int main () {
+    int failed = 0;
+
+    srand (1);
+    for (size_t i = 0; i < sizeof (cases) / sizeof (cases[0]); i++) {
+        if (!run_s2 (&cases[i]) || !run_lineal (&cases[i])) {
+            fprintf (stderr, "FAILED\n");
+            failed++;
+        }
+    }
+
+    if (!run_limits ()) {
+        fprintf (stderr, "FAILED\n");
+        failed++;
+    }
+
+    return (failed > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,315 @@
+/*
+ * Distances given by moves (an_metric_evaluate_move and
+ * an_metric_commit_move) and maintained incrementally
+ * (an_metric_update_fft) compared with an_distance. The first
+ * argument is the backend: cpu or vulkan.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "annealing-lowlevel.h"
+
+/* Exit status of a skipped test, see tests/CMakeLists.txt */
+#define SKIP 77
+#define STEPS 50
+#define MAX_POINTS 4
+/* Relative to the distance */
+#define TOLERANCE 1e-4
+/* Tracked distances accumulate rounding errors of many updates */
+#define TRACK_TOLERANCE 1e-3
+/* Updates between resynchronizations, see an_image_enable_resync */
+#define RESYNC_INTERVAL 16
+
+/* What happens to the image in the middle of tracked updates */
+enum track_mode {
+    TRACK_ONLY,
+    TRACK_UPDATE_IMAGE,
+    TRACK_RESYNC
+};
+
+static const char *track_names[] = {
+    "Tracked updates",
+    "Tracked updates and an_image_update_fft",
+    "Tracked updates with resynchronization"
+};
+
+struct metric_case {
+    unsigned int ndim;
+    unsigned int dimensions[MAX_DIMENSIONS];
+};
+
+static const struct metric_case cases[] = {
+    { 1, { 96 } },
+    { 2, { 16, 12 } },
+    { 3, { 8, 6, 10 } }
+};
+
+struct fixture {
+    struct an_image *image;
+    struct an_corrfn *target;
+    struct an_metric *metric;
+};
+
+static size_t
+volume (const struct metric_case *c) {
+    size_t size = 1;
+    for (unsigned int i = 0; i < c->ndim; i++) {
+        size *= c->dimensions[i];
+    }
+
+    return size;
+}
+
+static size_t
+spectrum_size (const struct metric_case *c) {
+    unsigned int last = c->dimensions[c->ndim - 1];
+    return volume (c) / last * (last / 2 + 1);
+}
+
+static void
+random_array (float *array, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        array[i] = (rand () % 2 == 0) ? 1 : 0;
+    }
+}
+
+/* An image of a random volume and a target from another one */
+static int
+create_fixture (struct an_gpu_context *ctx, const struct metric_case *c,
+                struct fixture *f) {
+    size_t size = volume (c);
+    size_t ssize = spectrum_size (c);
+    float *array = malloc (sizeof (float) * size);
+    float *real  = malloc (sizeof (float) * ssize);
+    float *imag  = malloc (sizeof (float) * ssize);
+    memset (f, 0, sizeof (struct fixture));
+
+    random_array (array, size);
+    an_rfft (array, real, imag, c->dimensions, c->ndim);
+    for (size_t i = 0; i < ssize; i++) {
+        real[i] = real[i] * real[i] + imag[i] * imag[i];
+    }
+    f->target = an_create_corrfn (ctx, real, c->dimensions, c->ndim);
+
+    random_array (array, size);
+    f->image = an_create_image_from_real (ctx, array, c->dimensions, c->ndim);
+
+    if (f->target != NULL && f->image != NULL) {
+        f->metric = an_create_metric (ctx, f->target, f->image);
+    }
+
+    free (array);
+    free (real);
+    free (imag);
+    return f->metric != NULL;
+}
+
+static void
+destroy_fixture (struct fixture *f) {
+    if (f->metric != NULL) {
+        an_destroy_metric (f->metric);
+    }
+
+    if (f->image != NULL) {
+        an_destroy_image (f->image);
+    }
+
+    if (f->target != NULL) {
+        an_destroy_corrfn (f->target);
+    }
+}
+
+static unsigned int
+random_points (const struct metric_case *c, unsigned int *coords, float *deltas) {
+    unsigned int npoints = 1 + rand () % MAX_POINTS;
+
+    for (unsigned int k = 0; k < npoints; k++) {
+        for (unsigned int i = 0; i < c->ndim; i++) {
+            coords[k * c->ndim + i] = rand () % c->dimensions[i];
+        }
+        deltas[k] = (rand () % 2 == 0) ? 1 : -1;
+    }
+
+    return npoints;
+}
+
+static int
+close_to (float value, float reference) {
+    return fabs ((double)value - reference) <= TOLERANCE * fabs (reference);
+}
+
+/* The tracked distance compared with the distance calculated from scratch */
+static int
+check_tracked (struct fixture *f, const char *what) {
+    float tracked, distance;
+
+    if (!an_metric_current_distance (f->metric, &tracked) ||
+        !an_distance (f->metric, &distance)) {
+        fprintf (stderr, "%s: cannot get the distance\n", what);
+        return 0;
+    }
+
+    if (fabs ((double)tracked - distance) > TRACK_TOLERANCE * fabs (distance)) {
+        fprintf (stderr, "%s: tracked %f, distance %f\n", what, tracked, distance);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* An empty move is the first request of a metric */
+static int
+check_empty_move (struct fixture *f, unsigned int ndim) {
+    float moved, before, after;
+
+    if (!an_metric_evaluate_move (f->metric, NULL, NULL, 0, ndim, &moved) ||
+        !an_distance (f->metric, &before) ||
+        !an_metric_commit_move (f->metric) ||
+        !an_distance (f->metric, &after)) {
+        fprintf (stderr, "Empty move failed\n");
+        return 0;
+    }
+
+    if (!close_to (moved, before) || !close_to (after, before)) {
+        fprintf (stderr, "Empty move: %f, distance %f, after commit %f\n",
+                 moved, before, after);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Committed moves give the distances they were evaluated with */
+static int
+check_moves (struct fixture *f, const struct metric_case *c) {
+    unsigned int coords[MAX_POINTS * MAX_DIMENSIONS];
+    float deltas[MAX_POINTS];
+
+    for (int step = 0; step < STEPS; step++) {
+        unsigned int npoints = random_points (c, coords, deltas);
+        float moved, distance;
+
+        if (!an_metric_evaluate_move (f->metric, coords, deltas, npoints, c->ndim, &moved) ||
+            !an_metric_commit_move (f->metric) ||
+            !an_distance (f->metric, &distance)) {
+            fprintf (stderr, "Move failed\n");
+            return 0;
+        }
+
+        if (!close_to (moved, distance)) {
+            fprintf (stderr, "Move: %f, distance after commit %f\n", moved, distance);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * STEPS tracked updates. Halfway the image is changed bypassing the
+ * metric or, with resynchronization enabled, resynchronized, which
+ * must invalidate the tracked distance.
+ */
+static int
+check_tracking (struct fixture *f, const struct metric_case *c, enum track_mode mode) {
+    unsigned int coords[MAX_POINTS * MAX_DIMENSIONS];
+    float deltas[MAX_POINTS];
+    int ok = 1;
+
+    if (mode == TRACK_RESYNC &&
+        !an_image_enable_resync (f->image, NULL, RESYNC_INTERVAL, 0)) {
+        fprintf (stderr, "Cannot enable resynchronization\n");
+        return 0;
+    }
+
+    for (int step = 0; step < STEPS && ok; step++) {
+        unsigned int npoints = random_points (c, coords, deltas);
+
+        if (!an_metric_update_fft (f->metric, coords, deltas, npoints, c->ndim)) {
+            fprintf (stderr, "Tracked update failed\n");
+            ok = 0;
+            break;
+        }
+
+        if (step == STEPS / 2) {
+            if (mode == TRACK_UPDATE_IMAGE) {
+                ok = an_image_update_fft (f->image, coords, c->ndim, 1);
+            } else if (mode == TRACK_RESYNC) {
+                ok = an_image_resync (f->image, NULL);
+            }
+        }
+    }
+
+    ok = ok && check_tracked (f, track_names[mode]);
+
+    if (mode == TRACK_RESYNC) {
+        an_image_disable_resync (f->image);
+    }
+
+    return ok;
+}
+
+/* A move evaluated before the image changed must not restore an old distance */
+static int
+check_stale_move (struct fixture *f, const struct metric_case *c) {
+    unsigned int coords[MAX_POINTS * MAX_DIMENSIONS];
+    float deltas[MAX_POINTS];
+    float moved;
+
+    unsigned int npoints = random_points (c, coords, deltas);
+    if (!an_metric_evaluate_move (f->metric, coords, deltas, npoints, c->ndim, &moved)) {
+        fprintf (stderr, "Move failed\n");
+        return 0;
+    }
+
+    if (!an_image_update_fft (f->image, coords, c->ndim, 1) ||
+        !an_metric_commit_move (f->metric)) {
+        fprintf (stderr, "Update or commit failed\n");
+        return 0;
+    }
+
+    return check_tracked (f, "Move committed after an update of the image");
+}
+
+static int
+run_case (struct an_gpu_context *ctx, const struct metric_case *c) {
+    struct fixture f;
+    int ok = create_fixture (ctx, c, &f) &&
+        check_empty_move (&f, c->ndim) &&
+        check_moves (&f, c) &&
+        check_tracking (&f, c, TRACK_ONLY) &&
+        check_tracking (&f, c, TRACK_UPDATE_IMAGE) &&
+        check_tracking (&f, c, TRACK_RESYNC) &&
+        check_stale_move (&f, c);
+
+    destroy_fixture (&f);
+    return ok;
+}
+
+int main (int argc, char *argv[]) {
+    enum an_backend backend = AN_BACKEND_CPU;
+
+    if (argc > 1 && strcmp (argv[1], "vulkan") == 0) {
+        backend = AN_BACKEND_VULKAN;
+    }
+
+    struct an_gpu_context *ctx = an_create_context_with_backend (0, backend, 0);
+    if (ctx == NULL) {
+        fprintf (stderr, "Cannot create a context, skipping\n");
+        return SKIP;
+    }
+
+    int failed = 0;
+    srand (1);
+    for (size_t i = 0; i < sizeof (cases) / sizeof (cases[0]); i++) {
+        if (!run_case (ctx, &cases[i])) {
+            fprintf (stderr, "FAILED: %u dimensions\n", cases[i].ndim);
+            failed++;
+        }
+    }
+
+    an_destroy_context (ctx);
+    return (failed > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}